@@ -5,8 +5,10 @@
  */
 
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <pins_arduino.h>
 
+#include "hal.h"
 #include "timer1.h"
 
 static void pin_mode(uint8_t pin, uint8_t mode) {
@@ -32,81 +34,224 @@ static void pin_set(uint8_t pin, uint8_t val) {
 volatile uint16_t actuators[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
 static uint8_t devs = 0;
 
-static void set_0_low(void) {
-	pin_set(0, 0);
-}
-static void set_1_low(void) {
-	pin_set(1, 0);
-}
-static void set_2_low(void) {
-	pin_set(2, 0);
-}
-static void set_3_low(void) {
-	pin_set(3, 0);
-}
-static void set_4_low(void) {
-	pin_set(4, 0);
-}
-static void set_5_low(void) {
-	pin_set(5, 0);
-}
-static void set_6_low(void) {
-	pin_set(6, 0);
-}
-static void set_7_low(void) {
-	pin_set(7, 0);
-}
+/*
+ * None of the actuator pins has a usable hardware output-compare unit
+ * (timer 1 is our 16MHz timebase and its OC1A/OC1B pins are shared with
+ * the rx inputs), so instead the pulse edges for a whole frame are
+ * precomputed as a table sorted by time, with the port registers and
+ * bitmasks resolved in advance, and a single TIMER1_COMPB_vect walks the
+ * table.  The compare fires EDGE_EARLY cycles before each edge and the
+ * ISR spins on TCNT1 for the exact moment so that the interrupt entry
+ * time doesn't add jitter.  Edges closer than EDGE_SPIN cycles to each
+ * other are all handled within one interrupt.  Pulse widths are
+ * accurate to within a few cycles unless another interrupt handler is
+ * running at the edge time.
+ *
+ * The edge times are 16-bit TCNT1 values so the table must be armed
+ * less than 4ms before the frame starts.
+ */
+#define EDGE_EARLY	48
+#define EDGE_SPIN	96
+#define EDGE_MERGE	4
 
-static void set_all_high(void) {
-	uint8_t i;
+static struct edge_s {
+	uint16_t when;
+	volatile uint8_t *reg;
+	uint8_t set, clr;
+} edges[8 + 2];
+static volatile uint8_t edge_cnt = 0, edge_idx = 0;
 
-	for (i = 0; i < devs; i ++)
-		pin_set(i, 1);
+static volatile uint8_t *pin_reg[8];
+static uint8_t pin_bit[8];
+
+ISR(TIMER1_COMPB_vect) {
+	for (;;) {
+		struct edge_s *e = &edges[edge_idx];
+
+		if (unlikely(edge_idx >= edge_cnt)) {
+			TIMSK1 &= ~0x04;
+			return;
+		}
+
+		if ((int16_t) (e->when - TCNT1) > EDGE_SPIN) {
+			OCR1B = e->when - EDGE_EARLY;
+			/* Make sure the compare didn't just go by */
+			if (likely((int16_t) (e->when - TCNT1) > EDGE_SPIN))
+				return;
+			continue;
+		}
+
+		while ((int16_t) (TCNT1 - e->when) < 0);
+		*e->reg = (*e->reg | e->set) & ~e->clr;
+		edge_idx ++;
+	}
 }
 
 static uint32_t base;
 static const uint32_t mili = F_CPU / 1000;
 
+static void edge_add(uint16_t when, volatile uint8_t *reg,
+		uint8_t set, uint8_t clr) {
+	uint8_t i = edge_cnt;
+
+	/* Merge with an edge on the same port that's close enough */
+	while (i && (int16_t) (edges[i - 1].when - when) > EDGE_MERGE) {
+		edges[i] = edges[i - 1];
+		i --;
+	}
+	if (i && edges[i - 1].reg == reg &&
+			(int16_t) (when - edges[i - 1].when) <= EDGE_MERGE) {
+		edges[i - 1].set |= set;
+		edges[i - 1].clr |= clr;
+		/* Close the gap we've just opened */
+		for (; i < edge_cnt; i ++)
+			edges[i] = edges[i + 1];
+		return;
+	}
+
+	edges[i].when = when;
+	edges[i].reg = reg;
+	edges[i].set = set;
+	edges[i].clr = clr;
+	edge_cnt ++;
+}
+
+#ifdef ESC_SYNC
+static volatile uint8_t sync_on;
+#endif
+
 static void actuators_update(void) {
 	/*
 	 * Use the standard timing..  the period is some 20ms so we
 	 * wait 5ms, then set all of outputs high and then leave it high
 	 * for between 1 and 2ms depending on the current actuator state.
+	 * We run 1ms before the frame starts to build the edge table.
 	 */
-	set_timeout(base + mili * 5, set_all_high);
-	if (devs > 0)
-		set_timeout(base + mili * 6 +
-				((actuators[0] * mili) >> 16), set_0_low);
-	if (devs > 1)
-		set_timeout(base + mili * 6 +
-				((actuators[1] * mili) >> 16), set_1_low);
-	if (devs > 2)
-		set_timeout(base + mili * 6 +
-				((actuators[2] * mili) >> 16), set_2_low);
-	if (devs > 3)
-		set_timeout(base + mili * 6 +
-				((actuators[3] * mili) >> 16), set_3_low);
-	if (devs > 4)
-		set_timeout(base + mili * 6 +
-				((actuators[4] * mili) >> 16), set_4_low);
-	if (devs > 5)
-		set_timeout(base + mili * 6 +
-				((actuators[5] * mili) >> 16), set_5_low);
-	if (devs > 6)
-		set_timeout(base + mili * 6 +
-				((actuators[6] * mili) >> 16), set_6_low);
-	if (devs > 7)
-		set_timeout(base + mili * 6 +
-				((actuators[7] * mili) >> 16), set_7_low);
+	uint32_t start = base + mili * 5;
+	uint8_t i, sreg;
+
+#ifdef ESC_SYNC
+	/* actuators_fire() has taken over the table */
+	if (sync_on)
+		return;
+#endif
 
 	base += mili * 20;
-	set_timeout(base, actuators_update);
+	set_timeout(base + mili * 4, actuators_update);
+
+	/* The previous frame's edges are long done and the compare
+	 * interrupt is off so the table is all ours */
+	edge_cnt = 0;
+	edge_idx = 0;
+	for (i = 0; i < devs; i ++)
+		edge_add(start, pin_reg[i], pin_bit[i], 0);
+	for (i = 0; i < devs; i ++)
+		edge_add(start + mili + ((actuators[i] * mili) >> 16),
+				pin_reg[i], 0, pin_bit[i]);
+
+	sreg = irq_save();
+
+	/* If we're so late that the frame should have started already,
+	 * skip it rather than output wrong pulse widths */
+	if (unlikely((int32_t) (start - timer_read()) < EDGE_SPIN)) {
+		irq_restore(sreg);
+		return;
+	}
+
+	OCR1B = (uint16_t) start - EDGE_EARLY;
+	TIFR1 = 0x04; /* Only clears OCF1B */
+	TIMSK1 |= 0x04;
+
+	irq_restore(sreg);
 }
 
-void actuators_init(int devices) {
+#ifdef ESC_SYNC
+/*
+ * Once the control loop is up, each of its updates gets the motors a
+ * pulse of their own right away instead of waiting for the next 50Hz
+ * frame, which could be up to 20ms late.  The first actuators_fire()
+ * stops the frames.  Until then, while the sensors get checked and
+ * calibrated, everything is on the standard frame.  That's when the
+ * ESCs arm and have their throttle range calibrated with the motor
+ * keys.  The ESCs have to accept the switch to the faster signal.
+ *
+ * With ESC_ONESHOT125 the motor pulses are 125us to 250us long,
+ * otherwise they're the standard 1ms to 2ms.  The servos, i.e. the
+ * outputs after the motors in the mixer table, get standard pulses
+ * with the updates that are at least SERVO_PERIOD after their last
+ * one, so analog servos don't see more than some 66Hz.
+ *
+ * The edges are added as offsets from the pulse start, which gets set
+ * with interrupts disabled FIRE_LEAD cycles ahead.  FIRE_LEAD covers
+ * the arming plus EDGE_EARLY + EDGE_SPIN.
+ */
+#ifdef ESC_ONESHOT125
+# define ESC_PULSE	(F_CPU / 8000)
+#else
+# define ESC_PULSE	(F_CPU / 1000)
+#endif
+#define FIRE_LEAD	(F_CPU / 25000)
+#define SERVO_PERIOD	(F_CPU / 1000 * 15)
+
+static uint8_t motors;
+static uint32_t servo_ts;
+
+void actuators_fire(void) {
+	uint32_t now = timer_read();
+	uint16_t start;
+	uint8_t i, n = motors, sreg;
+
+	sync_on = 1;
+	barrier();
+
+	/* The previous pulses are still going out, these values will
+	 * go with the next update */
+	if (edge_idx < edge_cnt)
+		return;
+
+	if (now - servo_ts >= SERVO_PERIOD) {
+		servo_ts = now;
+		n = devs;
+	}
+
+	/* The compare interrupt is off so the table is all ours */
+	edge_cnt = 0;
+	edge_idx = 0;
+	for (i = 0; i < n; i ++)
+		edge_add(0, pin_reg[i], pin_bit[i], 0);
+	for (i = 0; i < n; i ++)
+		edge_add(i < motors ?
+				ESC_PULSE + (((uint32_t) actuators[i] *
+						ESC_PULSE) >> 16) :
+				mili + ((actuators[i] * mili) >> 16),
+				pin_reg[i], 0, pin_bit[i]);
+
+	sreg = irq_save();
+
+	start = TCNT1 + FIRE_LEAD;
+	for (i = 0; i < edge_cnt; i ++)
+		edges[i].when += start;
+
+	OCR1B = start - EDGE_EARLY;
+	TIFR1 = 0x04; /* Only clears OCF1B */
+	TIMSK1 |= 0x04;
+
+	irq_restore(sreg);
+}
+#endif
+
+void actuators_init(int devices, int motor_cnt) {
 	uint8_t i;
 
 	devs = devices;
+#ifdef ESC_SYNC
+	motors = motor_cnt;
+#endif
+
+	for (i = 0; i < devices; i ++) {
+		pin_bit[i] = digitalPinToBitMask(i + 3);
+		pin_reg[i] = portOutputRegister(digitalPinToPort(i + 3));
+	}
 
 	/* Set the relevant GPIOs low */
 	for (i = 0; i < devices; i ++)
@@ -124,5 +269,5 @@ void actuators_start(void) {
 	 * right after power-up.
 	 */
 	base = timer_read();
-	actuators_update();
+	set_timeout(base + mili * 4, actuators_update);
 }
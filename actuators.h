@@ -6,9 +6,21 @@
 
 extern volatile uint16_t actuators[8];
 
-void actuators_init(int devices);
+/* The first motor_cnt of the outputs are ESCs, the rest servos */
+void actuators_init(int devices, int motor_cnt);
 void actuators_start(void);
 
+/*
+ * Called after each control update has set all the outputs.  With
+ * ESC_SYNC the motor pulses go out right then, see actuators.c,
+ * otherwise all the outputs wait for the next 50Hz frame.
+ */
+#ifdef ESC_SYNC
+void actuators_fire(void);
+#else
+static inline void actuators_fire(void) {}
+#endif
+
 static inline void actuator_set(uint8_t target, uint16_t value) {
 	actuators[target] = value;
 }
@@ -7,6 +7,15 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
+#ifndef NULL
+# define NULL 0
+#endif
+
+#include "adc.h"
+#include "timer1.h"
+#include "profile.h"
+#include "blackbox.h"
+
 static uint8_t admux = 0x00;
 static uint8_t adcsra = 0x87; /* Timing */
 void adc_init(void) {
@@ -15,6 +24,7 @@ void adc_init(void) {
 	DIDR0 = 0x3f;
 }
 
+/* Blocking single conversion, only for use before adc_start() */
 uint16_t adc_convert(uint8_t input) {
 	uint16_t ret;
 
@@ -37,39 +47,125 @@ uint16_t adc_convert(uint8_t input) {
  * 3: Battery voltage
  * 8: Temperature
  *
- * The first three are converted two times each using the external 3.3V
- * reference voltage.  Battery may be better with the internal 5V voltage
- * (REFS1[1:0] = 1), arduino contains the required capacitor on-board.
+ * Once started the ADC never stops.  Each conversion is started from
+ * the interrupt handler of the previous one, we don't use the freerunning
+ * mode because there the channel for conversion N + 2 has to be selected
+ * while N + 1 is already running and a single late interrupt would then
+ * shift all the results onto the wrong channels for good.
+ *
+ * The three gyro inputs are sampled round-robin, about 3200 times a
+ * second each at prescaler 128, and summed.  After every ADC_OVERSAMPLE
+ * rounds the sums are published in adc_values[0..2] scaled to 12 bits
+ * (4x the 10-bit value) and the finished callback runs, at about 200Hz.
+ *
+ * Battery and temperature change slowly so they're only converted
+ * ADC_SLOW_RATE times a second, in 10-bit units.  The temperature sensor
+ * needs the internal 1.1V reference, the first conversion after each
+ * reference switch is inaccurate so it's thrown away.
  */
 volatile uint16_t adc_values[5];
-static volatile uint8_t adc_ch;
-static uint8_t adc_ch_num[8] = { 0, 1, 2, 3, 8, 0, 1, 2 };
-static void (*adc_finished)(void);
 
-/* Should take about 0.92ms at F_CPU of 16MHz and prescaler of 128 */
-void adc_convert_all(void (*finished)(void)) {
-	ADMUX = admux | 0;
-	ADCSRA = adcsra | (1 << ADIE) | (1 << ADSC);
-	adc_ch = 0;
+enum adc_slot_e {
+	SLOT_GYRO_X,
+	SLOT_GYRO_Y,
+	SLOT_GYRO_REF,
+	SLOT_BATTERY,
+	SLOT_TEMP,
+	SLOT_TEMP_SETTLE,	/* First conversion at 1.1V, discarded */
+	SLOT_GYRO_SETTLE,	/* First conversion back at AREF, discarded */
+};
+static const uint8_t adc_slot_mux[7] = { 0, 1, 2, 3, 0xc8, 0xc8, 0 };
+
+#define ADC_OVERSAMPLE_BITS	4
+#define ADC_OVERSAMPLE		(1 << ADC_OVERSAMPLE_BITS)
+
+#define ADC_SLOW_RATE		10 /* Hz */
+#define ADC_SLOW_PERIOD		(F_CPU / 128 / 13 / ADC_SLOW_RATE)
+
+static uint8_t adc_slot;
+static uint8_t adc_rounds;
+static uint16_t adc_sums[3];
+static uint16_t adc_slow_cnt;
+static void (*volatile adc_finished)(void) = NULL;
+static uint8_t adc_running = 0;
+
+void adc_start(void (*finished)(void)) {
 	adc_finished = finished;
+	if (adc_running)
+		return;
+	adc_running = 1;
+
+	adc_slot = SLOT_GYRO_X;
+	adc_rounds = 0;
+	adc_sums[0] = adc_sums[1] = adc_sums[2] = 0;
+	adc_slow_cnt = 0;
+
+	ADMUX = admux | adc_slot_mux[SLOT_GYRO_X];
+	ADCSRA = adcsra | (1 << ADIE) | (1 << ADSC);
 }
 
 ISR(ADC_vect) {
-	if (adc_ch < 5) {
-		adc_values[adc_ch] = ADC;
-		if (adc_ch == 3) {
-			ADMUX = admux | 0xc8;
-			ADCSRA = adcsra | (1 << ADIE) | (1 << ADSC);
-			adc_ch ++;
-			return;
-		}
-	} else {
-		adc_values[adc_ch - 5] += ADC;
-		if (adc_ch == 7) {
-			sei();
-			return adc_finished();
+	PROF_START(PROF_ADC_ISR);
+	uint16_t val = ADC;
+	uint8_t slot = adc_slot, next;
+	void (*finished)(void);
+
+	switch (slot) {
+	case SLOT_GYRO_REF:
+		next = SLOT_GYRO_X;
+		if (adc_slow_cnt >= ADC_SLOW_PERIOD) {
+			adc_slow_cnt = 0;
+			next = SLOT_BATTERY;
 		}
+		break;
+	case SLOT_BATTERY:
+		next = SLOT_TEMP_SETTLE;
+		break;
+	case SLOT_TEMP_SETTLE:
+		next = SLOT_TEMP;
+		break;
+	case SLOT_TEMP:
+		next = SLOT_GYRO_SETTLE;
+		break;
+	case SLOT_GYRO_SETTLE:
+		next = SLOT_GYRO_X;
+		break;
+	default:
+		next = slot + 1;
 	}
-	ADMUX = admux | adc_ch_num[++ adc_ch];
+
+	/* Get the next conversion going before anything else */
+	adc_slot = next;
+	ADMUX = admux | adc_slot_mux[next];
 	ADCSRA = adcsra | (1 << ADIE) | (1 << ADSC);
+	adc_slow_cnt ++;
+
+	if (slot == SLOT_BATTERY)
+		adc_values[3] = val;
+	else if (slot == SLOT_TEMP)
+		adc_values[4] = val;
+	if (slot > SLOT_GYRO_REF) {
+		PROF_END(PROF_ADC_ISR);
+		return;
+	}
+
+	adc_sums[slot] += val;
+	if (slot != SLOT_GYRO_REF || ++ adc_rounds < ADC_OVERSAMPLE) {
+		PROF_END(PROF_ADC_ISR);
+		return;
+	}
+
+	adc_values[0] = adc_sums[0] >> (ADC_OVERSAMPLE_BITS - 2);
+	adc_values[1] = adc_sums[1] >> (ADC_OVERSAMPLE_BITS - 2);
+	adc_values[2] = adc_sums[2] >> (ADC_OVERSAMPLE_BITS - 2);
+	adc_sums[0] = adc_sums[1] = adc_sums[2] = 0;
+	adc_rounds = 0;
+
+	finished = adc_finished;
+	if (finished) {
+		sei();
+		BB_LOG_GYRO();
+		finished();
+	}
+	PROF_END(PROF_ADC_ISR);
 }
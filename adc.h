@@ -7,5 +7,13 @@
 void adc_init(void);
 uint16_t adc_convert(uint8_t input);
 
-void adc_convert_all(void (*finished)(void));
+/*
+ * Start the continuous sampling engine (or just change the callback if
+ * it's running already).  finished is called from the ADC interrupt,
+ * with interrupts enabled, every time new averaged gyro values are in.
+ *
+ * adc_values[0..2] (gyro X, Y, REF) are 12-bit, 4x the raw 10-bit scale,
+ * adc_values[3..4] (battery, temperature) are raw 10-bit.
+ */
+void adc_start(void (*finished)(void));
 extern volatile uint16_t adc_values[5];
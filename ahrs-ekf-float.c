@@ -21,15 +21,9 @@
 #include "ahrs.h"
 #include "trig.h"
 
-volatile int16_t ahrs_pitch, ahrs_roll, ahrs_yaw;
-volatile int16_t ahrs_pitch_rate, ahrs_roll_rate, ahrs_yaw_rate;
-
-/* Acceleration is reported in the initial coordinate system rotated
- * by the angles above so really it is the local coordinate system
- * of the vehicle.  It should not include the gravitational
- * acceleration.
- */
-volatile int16_t accel_acceleration[3];
+struct ahrs_state_s ahrs_state;
+struct ahrs_rates_s ahrs_rates;
+volatile uint8_t ahrs_seq, ahrs_rates_seq;
 
 volatile float q[4];
 volatile float mag[3], acc[3];
@@ -39,6 +33,13 @@ static const float two_kp = 1.0 * 0.2; /* 1 x proportional gain */
 static float integral_fb[3];
 static uint32_t last_update;
 
+/* Filter steps per second, each one a blocking read of both sensors.
+ * The soft-float maths keep the ATmega at some 30, with an FPU it's
+ * down to what the bus can do. */
+#ifndef EKF_RATE
+# define EKF_RATE 30
+#endif
+
 static float staticg[3]; /* Zero-rate gyro reading.. believed to be... */
 static float staticm[2]; /* Initial Mag readings average */
 
@@ -78,7 +79,7 @@ static void vectors_update(void) {
 	 * schedule the next measurement 1/50 sec from the time the previous
 	 * measurement was *supposed* to happen.  Not sure if that's really
 	 * better, need to think about it.  */
-	set_timeout(timer_read() + F_CPU / 30, vectors_update);
+	set_timeout(timer_read() + F_CPU / EKF_RATE, vectors_update);
 
 	/* Retrieve current values of everything */
 	wmp_read(graw, gscale); /* TODO: average over 2+ readings? */
@@ -274,16 +275,20 @@ static void vectors_update(void) {
 	grav[1] = q0q1 + q2q3;
 	grav[2] = 1 - q1q1 - q2q2;
 
-	ahrs_yaw = (uint16_t) (atan2(q1q2 - q0q3,
+	seq_write_begin(&ahrs_seq);
+	ahrs_state.yaw = (uint16_t) (atan2(q1q2 - q0q3,
 			q0q0 + q1q1 - 1) * (32768 / M_PI));
-	ahrs_pitch = (uint16_t) (atan(grav[0] / sqrt(grav[1] * grav[1] +
+	ahrs_state.pitch = (uint16_t) (atan(grav[0] / sqrt(grav[1] * grav[1] +
 				grav[2] * grav[2])) * (32768 / M_PI));
-	ahrs_roll = (uint16_t) (atan(grav[1] / sqrt(grav[0] *grav[0] +
+	ahrs_state.roll = (uint16_t) (atan(grav[1] / sqrt(grav[0] *grav[0] +
 				grav[2] * grav[2])) * (32768 / M_PI));
 	/* FIXME: overflows, naming */
-	ahrs_yaw_rate = (int16_t) (g[0] * (256l * 180 / M_PI));
-	ahrs_pitch_rate = (int16_t) (g[1] * (256l * 180 / M_PI));
-	ahrs_roll_rate = (int16_t) (g[2] * (256l * 180 / M_PI));
+	ahrs_state.yaw_rate = (int16_t) (g[0] * (256l * 180 / M_PI));
+	seq_write_end(&ahrs_seq);
+	seq_write_begin(&ahrs_rates_seq);
+	ahrs_rates.pitch = (int16_t) (g[1] * (256l * 180 / M_PI));
+	ahrs_rates.roll = (int16_t) (g[2] * (256l * 180 / M_PI));
+	seq_write_end(&ahrs_rates_seq);
 #endif
 	sei();
 }
@@ -352,7 +357,8 @@ void ahrs_init(void) {
 		avgg[1] += (float) c[1] - 0x2000;
 		avgg[2] += (float) c[2] - 0x2000;
 		if (gscale[0] > 2000 || gscale[1] > 2000 || gscale[2] > 2000) {
-			serial_write_str("Gyro fast-mode during calibration");
+			serial_write_str_P(PSTR("Gyro fast-mode during "
+						"calibration"));
 			while (1);
 		}
 
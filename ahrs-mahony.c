@@ -0,0 +1,574 @@
+/*
+ * Fixed-point quaternion AHRS, the Mahony filter of ahrs-ekf-float.c
+ * without the floats.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Exports the same ahrs.h interface as ahrs.c, build with AHRS=ahrs-mahony
+ * (see the Makefile) to use this one instead.
+ *
+ * The attitude is a unit quaternion, the rotation from the local frame to
+ * the initial (boot-up) frame same as ahrs.c's angles, kept in Q30 and
+ * advanced on every gyro sample, ~200Hz.  The
+ * accelerometer and magnetometer are read at 50Hz like in ahrs.c, the
+ * reference vectors are rotated into the local frame and their cross
+ * products with the measured vectors, the error, feed back into the
+ * rotation rate until the next reading.  The magnetometer's error is
+ * first projected onto the estimated vertical, so a disturbed magnetic
+ * field can only pull the yaw and never roll or pitch.
+ *
+ * All of the filter runs in the gyro callback, the TWI completion only
+ * flags the new registers, so only the published outputs need interrupts
+ * disabled.
+ *
+ * The gyro is either the 2-axis analog one through the ADC engine or,
+ * with -DGYRO_WMP (GYRO=wmp in the Makefile), a Wii MotionPlus on the
+ * TWI bus.  The analog gyro has no yaw axis so with it the yaw rate comes
+ * from the magnetometer feedback alone and lags in turns.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+
+#include "adc.h"
+#include "twi.h"
+#include "cmps09.h"
+#include "wmp.h"
+#include "timer1.h"
+#include "ahrs.h"
+#include "trig.h"
+#include "isqrt.h"
+#include "events.h"
+#include "profile.h"
+#include "blackbox.h"
+#include "params.h"
+#include "nav.h"
+
+/*
+ * Both are only written from mahony_update(), the timestamp is when
+ * the gyro sample behind the estimate was taken
+ */
+struct ahrs_state_s ahrs_state;
+struct ahrs_rates_s ahrs_rates;
+volatile uint8_t ahrs_seq, ahrs_rates_seq;
+
+/* The last vectors_fuse()'s results for the next ahrs_state update */
+static int16_t acceleration[3];
+
+/* The attitude, Q30, and the same rotation as a matrix */
+static int32_t quat[4];
+static struct dcm_s dcm;
+
+/* Rate correction from the last vector readings, in gyro units */
+static int16_t feedback[3];
+
+/*
+ * Gyro rates are in 1/16 LSB of the 12-bit oversampled ADC readings,
+ * 1/65.536 deg/s (see ahrs.c), around the local axes by the right-hand
+ * rule.  HALF_ANGLE_K turns rate * (cycles >> 4) into half the rotation
+ * angle in Q30 radians through mul_32_15().
+ */
+#define HALF_ANGLE_K	((int16_t) (3.14159265 / 180 / 65.536 * \
+			(1l << 29) * 16 * 32768 / F_CPU + 0.5))
+
+/*
+ * Feedback gains as shifts of the Q14 error, the correction is
+ * Kp = 4.36 / (1 << shift) rad/s per unit of sin(error angle), 0.27 rad/s
+ * at 4 (ahrs-ekf-float.c uses 0.2).  They're params.acc_shift and
+ * params.mag_shift, see params.h.
+ */
+
+/* 32-bit binary angles (see atan2_32) to ROLL_PITCH_180DEG units */
+#define BAM_TO_ROLL_PITCH ((int16_t) \
+		(ROLL_PITCH_180DEG * 32768.0 / 2147483648.0 + 0.5))
+
+static inline int16_t q30_to_15(int32_t x) {
+	return clip_15((x + (1 << 14)) >> 15);
+}
+
+/* local_to_global() and global_to_local() of ahrs-ekf-float.c become
+ * dcm_rotate() and dcm_rotate_rev() with this matrix */
+static void quat_to_dcm(struct dcm_s *m, const int16_t q[4]) {
+	/* The q0q0 .. q2q3 products, Q30 */
+	int32_t q0q1 = (int32_t) q[0] * q[1], q0q2 = (int32_t) q[0] * q[2];
+	int32_t q0q3 = (int32_t) q[0] * q[3], q1q1 = (int32_t) q[1] * q[1];
+	int32_t q1q2 = (int32_t) q[1] * q[2], q1q3 = (int32_t) q[1] * q[3];
+	int32_t q2q2 = (int32_t) q[2] * q[2], q2q3 = (int32_t) q[2] * q[3];
+	int32_t q3q3 = (int32_t) q[3] * q[3];
+
+	/* Twice the products minus the 1 of the diagonal, to Q15.  The
+	 * halved sums can't overflow for a unit quaternion. */
+#define DCM_15(x)	clip_15(((x) + (1 << 13)) >> 14)
+	m->m[0][0] = DCM_15((1l << 29) - q2q2 - q3q3);
+	m->m[0][1] = DCM_15(q1q2 - q0q3);
+	m->m[0][2] = DCM_15(q1q3 + q0q2);
+	m->m[1][0] = DCM_15(q1q2 + q0q3);
+	m->m[1][1] = DCM_15((1l << 29) - q1q1 - q3q3);
+	m->m[1][2] = DCM_15(q2q3 - q0q1);
+	m->m[2][0] = DCM_15(q1q3 - q0q2);
+	m->m[2][1] = DCM_15(q2q3 + q0q1);
+	m->m[2][2] = DCM_15((1l << 29) - q1q1 - q2q2);
+#undef DCM_15
+}
+
+/*
+ * quat += quat * (0, rate) / 2 * dt, the products taken from a Q15 copy
+ * in q[] which is left with the new attitude.  Then one Newton step
+ * towards |quat| = 1, quat *= (3 - |quat|^2) / 2, in place of the float
+ * code's inv_sqrt.  The norm only drifts by some 1e-6 per step so this
+ * is plenty.
+ */
+static void quat_integrate(const int16_t rate[3], uint16_t dt,
+		int16_t q[4]) {
+	int32_t h0, h1, h2;
+	uint32_t norm;
+	int16_t corr;
+	uint8_t i;
+
+	for (i = 0; i < 4; i ++)
+		q[i] = q30_to_15(quat[i]);
+
+	h0 = mul_32_15((int32_t) rate[0] * dt, HALF_ANGLE_K);
+	h1 = mul_32_15((int32_t) rate[1] * dt, HALF_ANGLE_K);
+	h2 = mul_32_15((int32_t) rate[2] * dt, HALF_ANGLE_K);
+
+	quat[0] -= mul_32_15(h0, q[1]) + mul_32_15(h1, q[2]) +
+		mul_32_15(h2, q[3]);
+	quat[1] += mul_32_15(h0, q[0]) + mul_32_15(h2, q[2]) -
+		mul_32_15(h1, q[3]);
+	quat[2] += mul_32_15(h1, q[0]) - mul_32_15(h2, q[1]) +
+		mul_32_15(h0, q[3]);
+	quat[3] += mul_32_15(h2, q[0]) + mul_32_15(h1, q[1]) -
+		mul_32_15(h0, q[2]);
+
+	norm = 0;
+	for (i = 0; i < 4; i ++) {
+		q[i] = q30_to_15(quat[i]);
+		norm += (int32_t) q[i] * q[i];
+	}
+	corr = ((int32_t) (1l << 30) - (int32_t) norm) >> 16;
+	for (i = 0; i < 4; i ++) {
+		quat[i] += mul_32_15(quat[i], corr);
+		q[i] = q30_to_15(quat[i]);
+	}
+}
+
+static int16_t statica[3]; /* Initial Acc readings average */
+static int16_t staticm[3]; /* Initial Mag readings average */
+static int16_t refa[3], refm[3]; /* The same as unit vectors, Q14 */
+
+static void unit_14(int16_t ret[3], const int16_t v[3], uint16_t len) {
+	ret[0] = ((int32_t) v[0] << 14) / len;
+	ret[1] = ((int32_t) v[1] << 14) / len;
+	ret[2] = ((int32_t) v[2] << 14) / len;
+}
+
+static struct twi_job_s vectors_job;
+static uint8_t vectors_regs[12];
+static volatile uint8_t vectors_new;
+static int16_t vectors_yaw;
+static uint32_t vectors_yaw_ts;
+
+/*
+ * Runs from the gyro update when vectors_regs has new CMPS09 readings,
+ * recomputes the feedback (see above) against the current attitude.
+ * ts is the gyro sample's time, close enough to the readings' for the
+ * velocity estimate's time step.
+ */
+static void vectors_fuse(uint32_t ts) {
+	PROF_START(PROF_FUSE);
+	int16_t a[3], m[3]; /* Current Acc & Mag readings */
+	int16_t n[3]; /* The same, normalised */
+	int16_t up[3]; /* Predicted gravity direction */
+	int16_t rotated[3]; /* Rotated (predicted) vector */
+	int16_t crossed[3]; /* Cross product of current & predicted vectors */
+	int32_t dot;
+	uint16_t len;
+	uint8_t *regs = vectors_regs;
+
+	m[1] = ((uint16_t) regs[0] << 8) | regs[1];
+	m[0] = ((uint16_t) regs[2] << 8) | regs[3];
+	m[2] = ((uint16_t) regs[4] << 8) | regs[5];
+	a[0] = ((uint16_t) regs[6] << 8) | regs[7];
+	a[1] = ((uint16_t) regs[8] << 8) | regs[9];
+	a[2] = ((uint16_t) regs[10] << 8) | regs[11];
+	vectors_new = 0;
+	m[1] -= cmps09_mag_calib[0];
+	m[0] -= cmps09_mag_calib[1];
+	m[2] -= cmps09_mag_calib[2];
+
+	cmps09_xy_adjust(m);
+	cmps09_xy_adjust(a);
+
+	feedback[0] = feedback[1] = feedback[2] = 0;
+	dcm_rotate_rev(&dcm, up, refa);
+
+	/* Same sanity limits as ahrs.c and ahrs-ekf-float.c, 1g is about
+	 * 0x4000 and the earth's field about 400 */
+	len = isqrt32(hypot3(a));
+	if (len > 0x2000 && len < 0x6000) {
+		unit_14(n, a, len);
+		cross(crossed, n, up, 4);
+		feedback[0] = crossed[0] >> params.acc_shift;
+		feedback[1] = crossed[1] >> params.acc_shift;
+		feedback[2] = crossed[2] >> params.acc_shift;
+	}
+
+	len = isqrt32(hypot3(m));
+	if (len > 300 && len < 500) {
+		unit_14(n, m, len);
+		dcm_rotate_rev(&dcm, rotated, refm);
+		cross(crossed, n, rotated, 4);
+
+		/* Only the part that turns around the vertical */
+		dot = ((int32_t) crossed[0] * up[0] +
+				(int32_t) crossed[1] * up[1] +
+				(int32_t) crossed[2] * up[2]) >> 14;
+		feedback[0] += ((dot * up[0]) >> 14) >> params.mag_shift;
+		feedback[1] += ((dot * up[1]) >> 14) >> params.mag_shift;
+		feedback[2] += ((dot * up[2]) >> 14) >> params.mag_shift;
+	}
+
+	dcm_rotate_rev(&dcm, rotated, statica);
+	acceleration[0] = a[0] - rotated[0];
+	acceleration[1] = a[1] - rotated[1];
+	acceleration[2] = a[2] - rotated[2];
+
+	dcm_rotate(&dcm, rotated, a);
+	nav_update(rotated, statica, ts);
+	PROF_END(PROF_FUSE);
+}
+
+/*
+ * One filter step for one gyro sample.  rate[] is in the units above,
+ * diff is the time in cycles since the previous sample and ts the time
+ * of this one.
+ */
+static void mahony_update(const int16_t rate[3], uint32_t diff,
+		uint32_t ts) {
+	int16_t r[3], q[4], yaw;
+	int32_t pitch, roll, sum;
+	uint16_t hyp;
+	uint8_t i, fused = 0;
+
+	if (vectors_new) {
+		vectors_fuse(ts);
+		fused = 1;
+	}
+
+	for (i = 0; i < 3; i ++) {
+		sum = (int32_t) rate[i] + feedback[i];
+		r[i] = sum > 32767 ? 32767 : sum < -32767 ? -32767 : sum;
+	}
+
+	/* We assume here that the time since the last sample is never
+	 * longer than some 30ms, if it is the step is cut short */
+	diff >>= 4;
+	if (unlikely(diff > 0x7fff))
+		diff = 0x7fff;
+	quat_integrate(r, diff, q);
+	quat_to_dcm(&dcm, q);
+
+	/* Back to the Euler angles of ahrs.c, dcm being
+	 * dcm_from_euler(yaw, -pitch, -roll) */
+	hyp = ihypot(dcm.m[0][0], dcm.m[1][0]);
+	pitch = mul_32_15(atan2_32(-dcm.m[2][0], hyp > 32767 ? 32767 : hyp),
+			BAM_TO_ROLL_PITCH);
+	roll = mul_32_15(atan2_32(-dcm.m[2][1], dcm.m[2][2]),
+			BAM_TO_ROLL_PITCH);
+	yaw = atan2_32(-dcm.m[1][0], dcm.m[0][0]) >> 16;
+
+	seq_write_begin(&ahrs_rates_seq);
+	ahrs_rates.roll = -rate[0] << 1;
+	ahrs_rates.pitch = rate[1] << 1;
+	seq_write_end(&ahrs_rates_seq);
+
+	seq_write_begin(&ahrs_seq);
+	ahrs_state.pitch = pitch;
+	ahrs_state.roll = roll;
+	ahrs_state.yaw = yaw;
+	if (fused) {
+		ahrs_state.yaw_rate = yaw - vectors_yaw;
+		ahrs_state.yaw_rate_dt = ahrs_ticks(ts - vectors_yaw_ts);
+		for (i = 0; i < 3; i ++)
+			ahrs_state.acceleration[i] = acceleration[i];
+		ahrs_state.nav = nav_state;
+	}
+	ahrs_state.timestamp = ts;
+	ahrs_state.dcm = dcm;
+	seq_write_end(&ahrs_seq);
+
+	if (fused) {
+		vectors_yaw = yaw;
+		vectors_yaw_ts = ts;
+		event_post(EVENT_AHRS);
+	}
+}
+
+static uint32_t v_ts;
+static int32_t avga[3];
+static int32_t avgm[3];
+
+static void vectors_cal(void) {
+	uint8_t regs[12];
+
+	cmps09_read_bytes(10, 12, regs);
+	avgm[0] += (int16_t) (((uint16_t) regs[0] << 8) | regs[1]);
+	avgm[1] += (int16_t) (((uint16_t) regs[2] << 8) | regs[3]);
+	avgm[2] += (int16_t) (((uint16_t) regs[4] << 8) | regs[5]);
+	avga[0] += (int16_t) (((uint16_t) regs[6] << 8) | regs[7]);
+	avga[1] += (int16_t) (((uint16_t) regs[8] << 8) | regs[9]);
+	avga[2] += (int16_t) (((uint16_t) regs[10] << 8) | regs[11]);
+}
+
+/* Runs from the TWI interrupt (with interrupts enabled) */
+static void vectors_done(void) {
+	/* Wake up the control loop even if there's nothing new, it
+	 * relies on us for its rate */
+	if (unlikely(vectors_job.status != TWI_JOB_DONE)) {
+		event_post(EVENT_AHRS);
+		return;
+	}
+
+	BB_LOG_CMPS09(vectors_regs);
+	vectors_new = 1;
+}
+
+static void vectors_update(void) {
+	PROF_START(PROF_VECTORS);
+
+	v_ts += F_CPU / 50;
+	set_timeout(v_ts, vectors_update);
+
+	/* Skip this one if the bus is in trouble or, somehow, the gyro
+	 * update hasn't picked up the previous registers yet */
+	if (unlikely(vectors_job.status == TWI_JOB_PENDING || vectors_new)) {
+		event_post(EVENT_AHRS);
+		PROF_END(PROF_VECTORS);
+		return;
+	}
+
+	cmps09_read_bytes_async(&vectors_job,
+			10, 12, vectors_regs, vectors_done);
+	PROF_END(PROF_VECTORS);
+}
+
+#define REF_RES 10
+
+static uint32_t prev_ts;
+
+#ifdef GYRO_WMP
+/*
+ * The Wii MotionPlus: a timeout at WMP_RATE queues a burst read of one
+ * report and the filter step runs from the TWI completion.  A read is
+ * about 0.9ms of bus time at 100kHz, 0.25ms at 400kHz.
+ */
+#ifndef WMP_RATE
+# define WMP_RATE 200
+#endif
+
+/*
+ * One slow mode LSB in gyro units << 12, the ahrs-ekf-float.c scale of
+ * 1 / (0.00227 * 0x2100) deg/s.  Fast mode readings beyond the +/- 500
+ * deg/s of the gyro units get clipped.
+ */
+#define WMP_K_SLOW	((int32_t) (65.536 / (0.00227 * 0x2100) * 4096 + 0.5))
+#define WMP_K_FAST	((int32_t) (65.536 / (0.00227 * 0x2100) * 4096 * \
+			WMP_SCALE_FAST / WMP_SCALE_SLOW + 0.5))
+
+static struct twi_job_s wmp_job;
+static uint8_t wmp_regs[6];
+static uint32_t wmp_ts, g_ts;
+static int32_t g_ref[3];
+static int16_t g_bias[3];
+
+static void gyro_mahony_update(void) {
+	PROF_START(PROF_GYRO);
+	uint16_t graw[3], gscale[3];
+	int16_t rate[3];
+	int32_t r;
+	uint32_t diff;
+	uint8_t i;
+
+	/* Bit 1 of the last byte tells a MotionPlus report from a
+	 * passed-through extension report */
+	if (unlikely(wmp_job.status != TWI_JOB_DONE || !(wmp_regs[5] & 2))) {
+		PROF_END(PROF_GYRO);
+		return;
+	}
+
+	wmp_decode(wmp_regs, graw, gscale);
+	for (i = 0; i < 3; i ++) {
+		r = ((int32_t) (int16_t) (graw[i] - 0x2000) * (gscale[i] ==
+					WMP_SCALE_SLOW ? WMP_K_SLOW :
+					WMP_K_FAST) >> 12) - g_bias[i];
+		r = r > 32767 ? 32767 : r < -32767 ? -32767 : r;
+		rate[i] = wmp_axis_sign[i] < 0 ? -r : r;
+	}
+
+	diff = wmp_ts - prev_ts;
+	prev_ts = wmp_ts;
+	mahony_update(rate, diff, wmp_ts);
+
+	event_post(EVENT_GYRO);
+	PROF_END(PROF_GYRO);
+}
+
+static void wmp_update(void) {
+	g_ts += F_CPU / WMP_RATE;
+	set_timeout(g_ts, wmp_update);
+
+	if (unlikely(wmp_job.status == TWI_JOB_PENDING))
+		return;
+
+	wmp_ts = timer_read();
+	wmp_read_async(&wmp_job, wmp_regs, gyro_mahony_update);
+}
+
+static void gyro_cal(void) {
+	uint16_t graw[3], gscale[3];
+	uint16_t i = 0;
+	uint8_t j;
+
+	g_ref[0] = g_ref[1] = g_ref[2] = 0;
+	wmp_on();
+	my_delay(200);
+
+	while (i < (1 << REF_RES)) {
+		my_delay(5);
+		wmp_read(graw, gscale);
+		/* Only slow mode readings are any good for the zero rate */
+		if (gscale[0] != WMP_SCALE_SLOW || gscale[1] != WMP_SCALE_SLOW ||
+				gscale[2] != WMP_SCALE_SLOW)
+			continue;
+
+		for (j = 0; j < 3; j ++)
+			g_ref[j] += (int16_t) (graw[j] - 0x2000);
+		if (!(i ++ & 7)) /* Every 40ms or so */
+			vectors_cal();
+	}
+
+	/* 16x the average zero rate, then in gyro units */
+	for (j = 0; j < 3; j ++)
+		g_bias[j] = (((g_ref[j] + (1 << 5)) >> 6) * WMP_K_SLOW) >> 16;
+}
+
+static void gyro_start(void) {
+	prev_ts = g_ts = timer_read();
+	wmp_update();
+}
+#else
+static int32_t x_ref, y_ref;
+
+/* Called from the ADC engine with new averaged gyro values at ~200Hz */
+static void gyro_mahony_update(void) {
+	PROF_START(PROF_GYRO);
+	uint32_t diff, now;
+	int16_t rate[3];
+	uint16_t x, y;
+
+	now = timer_read();
+	cli();
+	x = adc_values[0] - adc_values[2];
+	y = adc_values[1] - adc_values[2];
+	sei();
+
+	diff = now - prev_ts;
+	prev_ts = now;
+
+	/* ahrs.c's roll goes with -x and is minus the rotation around the
+	 * local x axis, its pitch goes with -y and is the rotation around
+	 * y, so only y changes sign */
+	rate[0] = ((int16_t) x << 4) - ((x_ref + (1 << 5)) >> 6);
+	rate[1] = ((y_ref + (1 << 5)) >> 6) - ((int16_t) y << 4);
+	rate[2] = 0;
+	mahony_update(rate, diff, now);
+
+	event_post(EVENT_GYRO);
+	PROF_END(PROF_GYRO);
+}
+
+static volatile uint16_t cal_cnt;
+
+static uint16_t cal_count(void) {
+	uint16_t cnt;
+
+	cli();
+	cnt = cal_cnt;
+	sei();
+	return cnt;
+}
+
+static void gyro_cal_update(void) {
+	if (cal_cnt >= (1 << REF_RES))
+		return;
+	cal_cnt ++;
+
+	x_ref += adc_values[0] - adc_values[2];
+	y_ref += adc_values[1] - adc_values[2];
+
+	event_post(EVENT_GYRO);
+}
+
+static void gyro_cal(void) {
+	uint16_t i;
+
+	x_ref = y_ref = 0;
+	cal_cnt = 0;
+	adc_start(gyro_cal_update);
+	for (i = 0; i < (1 << REF_RES); i += 8) {
+		while (cal_count() <= i) /* Every 40ms or so */
+			event_wait(1 << EVENT_GYRO);
+		vectors_cal();
+	}
+	while (cal_count() < (1 << REF_RES))
+		event_wait(1 << EVENT_GYRO);
+}
+
+static void gyro_start(void) {
+	prev_ts = timer_read();
+	adc_start(gyro_mahony_update);
+}
+#endif
+
+void ahrs_init(void) {
+	int16_t q[4] = { 32767, 0, 0, 0 };
+
+	/* Calibrate the sensors while waiting for the ESCs to detect
+	 * voltages etc. */
+	avga[0] = avga[1] = avga[2] = 0;
+	avgm[0] = avgm[1] = avgm[2] = 0;
+	gyro_cal();
+	statica[0] = (avga[0] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
+	statica[1] = (avga[1] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
+	statica[2] = (avga[2] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
+	staticm[1] = (avgm[0] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
+	staticm[0] = (avgm[1] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
+	staticm[2] = (avgm[2] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
+	staticm[1] -= cmps09_mag_calib[0];
+	staticm[0] -= cmps09_mag_calib[1];
+	staticm[2] -= cmps09_mag_calib[2];
+
+	cmps09_xy_adjust(staticm);
+	cmps09_xy_adjust(statica);
+	/* TODO: what if either is way off */
+	unit_14(refa, statica, isqrt32(hypot3(statica)) ?: 1);
+	unit_14(refm, staticm, isqrt32(hypot3(staticm)) ?: 1);
+
+	quat[0] = 1l << 30;
+	quat[1] = quat[2] = quat[3] = 0;
+	quat_to_dcm(&dcm, q);
+	feedback[0] = feedback[1] = feedback[2] = 0;
+	ahrs_state.pitch = ahrs_state.roll = ahrs_state.yaw = vectors_yaw = 0;
+	ahrs_state.dcm = dcm;
+	vectors_new = 0;
+
+	/* Start the correcting vector updates first */
+	v_ts = timer_read();
+	vectors_update();
+
+	/* Start the gyro output integration loop */
+	gyro_start();
+}
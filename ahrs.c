@@ -23,6 +23,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <avr/sleep.h>
 
 #include "adc.h"
 #include "twi.h"
@@ -30,6 +31,12 @@
 #include "timer1.h"
 #include "ahrs.h"
 #include "trig.h"
+#include "events.h"
+#include "profile.h"
+#include "blackbox.h"
+#include "calib.h"
+#include "params.h"
+#include "nav.h"
 
 /* Rotation angles around the axes of the coordinate system based on
  * the initial (boot-up, whatever) orientation of the IMU -- currently
@@ -40,40 +47,68 @@
  * the yaw axis aligns with the gravity vector for simplicity
  * (calculations here should not depend on this in any way).
  */
-volatile int32_t ahrs_pitch, ahrs_roll;
-volatile int16_t ahrs_yaw, ahrs_pitch_rate, ahrs_roll_rate, ahrs_yaw_rate;
+struct ahrs_state_s ahrs_state;
+struct ahrs_rates_s ahrs_rates;
+volatile uint8_t ahrs_seq, ahrs_rates_seq;
 
-/* Acceleration is reported in the initial coordinate system rotated
- * by the angles above so really it is the local coordinate system
- * of the vehicle.  It should not include the gravitational
- * acceleration.
- *
- * Velocity is estimated by simply integrating the acceleration and
- * should not be relied on in any way.  It is again in the fixed "global"
- * coordinate system set at system start.
- */
-volatile int16_t accel_acceleration[3];
-volatile int32_t accel_velocity[3] = { 0, 0, 0 };
-
-static volatile int32_t rel_pitch, rel_roll;
+/* Gyro integration since the last fusion step, only vectors_fuse()
+ * touches these */
+static int32_t rel_pitch, rel_roll;
+static uint32_t integ_ts;
 
 /* Doesn't seem to make a whole lot of difference */
 #define USE_REFERENCE_V
-volatile static uint32_t now;
-static uint32_t prev_ts;
 static int32_t x_ref, y_ref;
 
+/*
+ * Gyro samples on their way from the ADC interrupt to the fusion step,
+ * a single producer, single consumer ring: only gyro_ahrs_update()
+ * moves gyro_head and only gyro_integrate() moves gyro_tail, both are
+ * single bytes so neither side disables interrupts.  The fusion step
+ * normally empties it every 4 samples, should it stall for a whole
+ * ring the newest samples are dropped and counted, the sample after
+ * the gap is then integrated over the whole gap.
+ */
+#ifndef GYRO_RING_LEN
+# define GYRO_RING_LEN	16 /* Must be a power of 2 */
+#endif
+
+static struct gyro_sample_s {
+	uint32_t ts;
+	int16_t x, y;
+} gyro_ring[GYRO_RING_LEN];
+static volatile uint8_t gyro_head, gyro_tail;
+static volatile uint16_t gyro_dropped;
+
+/*
+ * After a warm start the full-length gyro and accelerometer averages
+ * are still taken in the background, sample by sample, for as long as
+ * the gyro says the vehicle is sitting still, e.g. while it waits to
+ * be armed or in a steady hover.  Once done they replace the stored
+ * values and go to the EEPROM for the next boot.  Any sample off the
+ * current bias by more than CALIB_STILL_TOL ends it for this boot.
+ */
+enum refine_state_e {
+	REFINE_OFF,
+	REFINE_GYRO,	/* Gyro and accelerometer sums going */
+	REFINE_DONE,	/* Gyro done, the rest is up to vectors_refine() */
+};
+static volatile uint8_t refine_state;
+static void gyro_refine(int16_t x, int16_t y);
+
+/* Called from the ADC engine with new averaged gyro values at ~200Hz */
 static void gyro_ahrs_update(void) {
-	uint32_t diff;
+	PROF_START(PROF_GYRO);
+	uint32_t now;
 	uint16_t x, y;
+	uint8_t head, next;
+	struct ahrs_rates_s rates;
 
+	now = timer_read();
 	cli();
 	x = adc_values[0];
 	y = adc_values[1];
 
-	diff = now - prev_ts;
-	prev_ts = now;
-
 #ifdef USE_REFERENCE_V
 	x -= adc_values[2];
 	y -= adc_values[2];
@@ -83,52 +118,98 @@ static void gyro_ahrs_update(void) {
 	 * Assuming the 10-bit ADC's reference volatage 3.3V and
 	 * the gyro outputs to change 3.3 mV/deg/s, 1 LSB of
 	 * x/y/ref corresponds to 0.9765625 deg/s, so nearly 1
-	 * deg/s.  Assuming F_CPU of 16M reduced by TIME_RES bits,
-	 * at 32 bits to represent 360 degrees of rotation we can
-	 * afford almost exactly TIME_RES fractional bits in
+	 * deg/s (the oversampled adc_values are 4x that).
+	 * Assuming F_CPU of 16M reduced by TIME_RES bits, at 32
+	 * bits to represent 360 degrees of rotation we can afford
+	 * almost exactly TIME_RES fractional bits in
 	 * x_ref/y_ref, e.g:
 	 * ((2 ** 32) / (0.9765625 * 360 * (16000000 >> 5)) == 24.43)
 	 *
-	 * We assume here that the time since last conversion is never
-	 * longer than some 30ms, if it is too long this may overflow.
+	 * We assume here that the time between samples is never
+	 * longer than some 30ms, gyro_step() clamps it to 65ms.
 	 */
-#define TIME_RES 2 /* 1+1 because adc_values are doubled */
+#define TIME_RES 3 /* 1+2 because adc_values are quadrupled */
 #define DIFF_RES 4
 #define REF_RES (DIFF_RES + 6)
 
-	ahrs_roll_rate = ((x_ref + (1 << (REF_RES - 7))) >> (REF_RES - 6)) -
-		((int16_t) x << 6);
-	ahrs_pitch_rate = ((y_ref + (1 << (REF_RES - 7))) >> (REF_RES - 6)) -
-		((int16_t) y << 6);
+	rates.roll = ((x_ref + (1 << (REF_RES - 6))) >> (REF_RES - 5)) -
+		((int16_t) x << 5);
+	rates.pitch = ((y_ref + (1 << (REF_RES - 6))) >> (REF_RES - 5)) -
+		((int16_t) y << 5);
 	sei();
 
-	diff = (diff/* + (1 << (DIFF_RES - 1))*/) >> DIFF_RES;
-	rel_roll += (int32_t) ((((int32_t) (int16_t) x << REF_RES) - x_ref) *
-			diff + (1 << (REF_RES - DIFF_RES + TIME_RES - 1))) >>
-		(REF_RES - DIFF_RES + TIME_RES);
-	rel_pitch += (int32_t) ((((int32_t) (int16_t) y << REF_RES) - y_ref) *
-			diff + (1 << (REF_RES - DIFF_RES + TIME_RES - 1))) >>
-		(REF_RES - DIFF_RES + TIME_RES);
+	seq_write_begin(&ahrs_rates_seq);
+	ahrs_rates = rates;
+	seq_write_end(&ahrs_rates_seq);
+
+	/* Queue the sample for the fusion step */
+	head = gyro_head;
+	next = (head + 1) & (GYRO_RING_LEN - 1);
+	if (likely(next != gyro_tail)) {
+		gyro_ring[head].ts = now;
+		gyro_ring[head].x = x;
+		gyro_ring[head].y = y;
+		barrier();
+		gyro_head = next;
+	} else
+		gyro_dropped ++;
+
+	if (unlikely(refine_state == REFINE_GYRO))
+		gyro_refine(x, y);
+
+	event_post(EVENT_GYRO);
+	PROF_END(PROF_GYRO);
 }
 
-static void gyro_update(void) {
-	now = timer_read();
-	adc_convert_all(gyro_ahrs_update);
+static volatile uint16_t cal_cnt;
+static uint16_t cal_len;
 
-	/* The gyro's bandwidth is 140Hz so schedule the next measurement
-	 * 1/140 sec from this measurement.  Don't try to compensate if the
-	 * timer was late this time, if the timer triggers sooner than 1/140
-	 * sec next time, the measurements won't be independent.  */
-	set_timeout(now + F_CPU / 140, gyro_update);
+static uint16_t cal_count(void) {
+	uint16_t cnt;
+
+	cli();
+	cnt = cal_cnt;
+	sei();
+	return cnt;
 }
 
 static void gyro_cal_update(void) {
+	if (cal_cnt >= cal_len)
+		return;
+	cal_cnt ++;
+
 	x_ref += adc_values[0];
 	y_ref += adc_values[1];
 #ifdef USE_REFERENCE_V
 	x_ref -= adc_values[2];
 	y_ref -= adc_values[2];
 #endif
+
+	event_post(EVENT_GYRO);
+}
+
+/* Samples off the bias at which the vehicle is taken to be moving */
+#ifndef CALIB_STILL_TOL
+# define CALIB_STILL_TOL 16 /* adc_values LSBs, about 4 deg/s */
+#endif
+
+static uint16_t refine_cnt;
+static int32_t refine_x, refine_y;
+
+static void gyro_refine(int16_t x, int16_t y) {
+	const int32_t tol = (int32_t) CALIB_STILL_TOL << REF_RES;
+	int32_t dx = ((int32_t) x << REF_RES) - x_ref;
+	int32_t dy = ((int32_t) y << REF_RES) - y_ref;
+
+	if (dx > tol || dx < -tol || dy > tol || dy < -tol) {
+		refine_state = REFINE_OFF;
+		return;
+	}
+
+	refine_x += x;
+	refine_y += y;
+	if (++ refine_cnt == (1 << REF_RES))
+		refine_state = REFINE_DONE;
 }
 
 static uint32_t v_ts;
@@ -137,6 +218,14 @@ static int16_t staticm[3]; /* Initial Mag readings average */
 static int32_t avga[3];
 static int32_t avgm[3];
 
+/* Magnetometer offsets, cmps09_mag_calib or the stored ones */
+static int16_t mag_calib[3];
+static struct calib_s calib;
+
+/* Rounded average of 1 << shift readings */
+#define CAL_AVG(sum, shift)	\
+	(((sum) + ((1 << ((shift) - 1)) - 1)) >> (shift))
+
 static void vectors_cal(void) {
 	uint8_t regs[12];
 
@@ -149,51 +238,210 @@ static void vectors_cal(void) {
 	avga[2] += (int16_t) (((uint16_t) regs[10] << 8) | regs[11]);
 }
 
-static void vectors_update(void) {
+static struct twi_job_s vectors_job;
+static uint8_t vectors_regs[12];
+static uint32_t vectors_ts;
+
+/* One gyro sample's rotation over diff cycles */
+static void gyro_step(int16_t x, int16_t y, uint32_t diff) {
+	/*
+	 * The readings have one bit more than the product below can have
+	 * and still fit in 32 bits, drop the last fractional bit of the
+	 * reference instead of the reading's resolution.  diff fits in 16
+	 * bits after the shift so the products are 32x16.
+	 */
+	diff = (diff/* + (1 << (DIFF_RES - 1))*/) >> DIFF_RES;
+	if (unlikely(diff > 0xffff))
+		diff = 0xffff;
+	rel_roll += (int32_t) (mul_32_16(((int32_t) x << (REF_RES - 1)) -
+				(x_ref >> 1), diff) +
+			(1 << (REF_RES - DIFF_RES + TIME_RES - 2))) >>
+		(REF_RES - DIFF_RES + TIME_RES - 1);
+	rel_pitch += (int32_t) (mul_32_16(((int32_t) y << (REF_RES - 1)) -
+				(y_ref >> 1), diff) +
+			(1 << (REF_RES - DIFF_RES + TIME_RES - 2))) >>
+		(REF_RES - DIFF_RES + TIME_RES - 1);
+}
+
+/*
+ * Integrate the queued samples up to the time until, each over the
+ * time since the previous one.  If the first later sample is already
+ * in, its rate is integrated up to until too and the rest of its
+ * interval is left for the next call, so the attitude is for exactly
+ * that time.
+ */
+static void gyro_integrate(uint32_t until) {
+	const struct gyro_sample_s *sample;
+	uint8_t tail = gyro_tail;
+
+	while (tail != gyro_head) {
+		barrier();
+		sample = &gyro_ring[tail];
+
+		if ((int32_t) (sample->ts - until) > 0) {
+			if ((int32_t) (until - integ_ts) > 0) {
+				gyro_step(sample->x, sample->y,
+						until - integ_ts);
+				integ_ts = until;
+			}
+			break;
+		}
+
+		gyro_step(sample->x, sample->y, sample->ts - integ_ts);
+		integ_ts = sample->ts;
+		tail = (tail + 1) & (GYRO_RING_LEN - 1);
+	}
+
+	barrier();
+	gyro_tail = tail;
+}
+
+/*
+ * The accelerometer half of the background refinement, the
+ * 1 << (REF_RES - 3) readings of the full calibration take some 2.6s
+ * and are normally in before the gyro's 1 << REF_RES samples.  The
+ * gyro ISR doesn't touch refine_x/y or x_ref/y_ref after REFINE_DONE.
+ */
+static uint8_t refine_acnt;
+
+static void vectors_refine(const int16_t a[3]) {
+	if (refine_acnt < (1 << (REF_RES - 3))) {
+		avga[0] += a[0];
+		avga[1] += a[1];
+		avga[2] += a[2];
+		refine_acnt ++;
+	}
+	if (refine_state != REFINE_DONE ||
+			refine_acnt < (1 << (REF_RES - 3)))
+		return;
+	refine_state = REFINE_OFF;
+
+	cli();
+	x_ref = refine_x;
+	y_ref = refine_y;
+	sei();
+	statica[0] = CAL_AVG(avga[0], REF_RES - 3);
+	statica[1] = CAL_AVG(avga[1], REF_RES - 3);
+	statica[2] = CAL_AVG(avga[2], REF_RES - 3);
+	cmps09_xy_adjust(statica);
+
+	calib.x_ref = refine_x;
+	calib.y_ref = refine_y;
+	calib.statica[0] = statica[0];
+	calib.statica[1] = statica[1];
+	calib.statica[2] = statica[2];
+	calib_save(&calib);
+}
+
+/*
+ * Magnetometer offset refinement, the min / max method of cmps09.h:
+ * the raw readings' extremes are kept per axis and once an axis has
+ * spanned MAG_SPAN_MIN the middle of the span is its offset.  A whole
+ * turn about the vertical does it for x and y unless the field is very
+ * steep, z needs the vehicle turned over, e.g. by hand before a flight.  An offset more than
+ * MAG_CALIB_TOL off the stored one gets stored, with staticm moved to
+ * match, but only takes effect on the next boot: this boot's yaw
+ * reference, staticm, was taken with the old ones.
+ */
+#ifndef MAG_SPAN_MIN
+# define MAG_SPAN_MIN 320 /* LSBs, a full circle spans 2 |m| >= 600 */
+#endif
+#ifndef MAG_CALIB_TOL
+# define MAG_CALIB_TOL 8
+#endif
+
+static int16_t mag_min[3], mag_max[3]; /* Register order, as mag_calib */
+
+static void mag_refine(const uint8_t *regs) {
+	int16_t v, mid, d[3] = { 0, 0, 0 };
+	uint8_t i, changed = 0;
+
+	for (i = 0; i < 3; i ++) {
+		v = ((uint16_t) regs[i * 2] << 8) | regs[i * 2 + 1];
+		if (v < mag_min[i])
+			mag_min[i] = v;
+		if (v > mag_max[i])
+			mag_max[i] = v;
+
+		if ((int32_t) mag_max[i] - mag_min[i] < MAG_SPAN_MIN)
+			continue;
+		mid = ((int32_t) mag_max[i] + mag_min[i]) >> 1;
+		if (mid - calib.mag[i] <= MAG_CALIB_TOL &&
+				mid - calib.mag[i] >= -MAG_CALIB_TOL)
+			continue;
+
+		d[i] = mid - calib.mag[i];
+		calib.mag[i] = mid;
+		changed = 1;
+	}
+	if (!changed)
+		return;
+
+	/* Same axis swap as for the readings */
+	v = d[0], d[0] = d[1], d[1] = v;
+	cmps09_xy_adjust(d);
+	calib.staticm[0] -= d[0];
+	calib.staticm[1] -= d[1];
+	calib.staticm[2] -= d[2];
+	calib_save(&calib);
+}
+
+/*
+ * Runs from the TWI interrupt (with interrupts enabled) once the CMPS09
+ * registers are in vectors_regs.
+ */
+static void vectors_fuse(void) {
+	PROF_START(PROF_FUSE);
 	int32_t pitch, roll, lensq;
 	int16_t yaw;
 	int16_t a[3], m[3]; /* Current Acc & Mag readings */
 	int16_t rotated[3]; /* Rotated (predicted) vector */
 	int16_t crossed[3]; /* Cross product of current & predicted vectors */
-	uint8_t regs[12];
+	struct dcm_s dcm;
+	uint8_t *regs = vectors_regs;
 	uint16_t factor;
 
-	/* The magnetometers's measurement frequency is 50Hz and the
-	 * accelerometer's rate is limite by buffer referesh rate of 55Hz, so
-	 * schedule the next measurement 1/50 sec from the time the previous
-	 * measurement was *supposed* to happen.  Not sure if that's really
-	 * better, need to think about it.  */
-	v_ts += F_CPU / 50;
-	set_timeout(v_ts, vectors_update);
+	/* Wake up the control loop even if there's nothing new, it
+	 * relies on us for its rate */
+	if (unlikely(vectors_job.status != TWI_JOB_DONE)) {
+		gyro_integrate(timer_read());
+		event_post(EVENT_AHRS);
+		PROF_END(PROF_FUSE);
+		return;
+	}
 
-	/* Retrieve current values of everything */
+	BB_LOG_CMPS09(regs);
+	mag_refine(regs);
 
-	cmps09_read_bytes(10, 12, regs); /* TODO: be async */
 	m[1] = ((uint16_t) regs[0] << 8) | regs[1];
 	m[0] = ((uint16_t) regs[2] << 8) | regs[3];
 	m[2] = ((uint16_t) regs[4] << 8) | regs[5];
 	a[0] = ((uint16_t) regs[6] << 8) | regs[7];
 	a[1] = ((uint16_t) regs[8] << 8) | regs[9];
 	a[2] = ((uint16_t) regs[10] << 8) | regs[11];
-	m[1] -= cmps09_mag_calib[0];
-	m[0] -= cmps09_mag_calib[1];
-	m[2] -= cmps09_mag_calib[2];
+	m[1] -= mag_calib[0];
+	m[0] -= mag_calib[1];
+	m[2] -= mag_calib[2];
+
+	if (unlikely(refine_state != REFINE_OFF))
+		vectors_refine(a);
 
 	cmps09_xy_adjust(m);
 	cmps09_xy_adjust(a);
 
-	cli();
+	/* The gyro up to when the readings were requested, ahrs_state
+	 * is only ever written here */
+	gyro_integrate(vectors_ts);
 	pitch = -rel_pitch, rel_pitch = 0;
 	roll = -rel_roll, rel_roll = 0;
-	yaw = ahrs_yaw;
-	sei();
+	yaw = ahrs_state.yaw;
 
 	/* TODO: decoupling like in FlightCtrl */
 
 	/* Integrate */
 
-	pitch += ahrs_pitch;
-	roll += ahrs_roll;
+	pitch += ahrs_state.pitch;
+	roll += ahrs_state.roll;
 	if (unlikely(pitch > ROLL_PITCH_180DEG))
 		pitch -= 2 * (uint32_t) ROLL_PITCH_180DEG;
 	else if (unlikely(pitch < -ROLL_PITCH_180DEG))
@@ -258,26 +506,33 @@ static void vectors_update(void) {
 	else
 		factor = 32000;
 
-	rotate_rev(rotated, staticm, yaw, -pitch, -roll);
+	/*
+	 * All the rotations below share one matrix for the integrated
+	 * attitude.  The velocity estimate and the control loop get
+	 * it too, without this step's correction which is a small
+	 * fraction of a degree and not worth another six sin/cos.
+	 */
+	dcm_from_euler(&dcm, yaw, -pitch, -roll);
+
+	dcm_rotate_rev(&dcm, rotated, staticm);
 	cross(crossed, rotated, m, factor >> 3);
 
-	rotate_rev(rotated, statica, yaw, -pitch, -roll);
+	dcm_rotate_rev(&dcm, rotated, statica);
 
 	/* Assuming |m| and |staticm| of about 0.4T,
-	 * crossed_n is about sin(angular distance) << 12
+	 * crossed_n is about sin(angular distance) << 12, the weights
+	 * are params.mag_prio and params.acc_prio (see params.h)
 	 */
-#define MAG_ROLLPITCH_PRIORITY 7
-#define ACCEL_ROLLPITCH_PRIORITY 9
 	yaw += (crossed[2] + 2) >> 2;
-	pitch -= (int32_t) crossed[1] << MAG_ROLLPITCH_PRIORITY;
-	roll += (int32_t) crossed[0] << MAG_ROLLPITCH_PRIORITY;
+	pitch -= (int32_t) crossed[1] << params.mag_prio;
+	roll += (int32_t) crossed[0] << params.mag_prio;
 
 	cross(crossed, rotated, a, 1);
 	yaw += (crossed[2] + 2) >> 2;
-	pitch -= (int32_t) crossed[1] << ACCEL_ROLLPITCH_PRIORITY;
-	roll += (int32_t) crossed[0] << ACCEL_ROLLPITCH_PRIORITY;
+	pitch -= (int32_t) crossed[1] << params.acc_prio;
+	roll += (int32_t) crossed[0] << params.acc_prio;
 #ifdef CAL
-	if (!(ahrs_pitch & 7)) {
+	if (!(ahrs_state.pitch & 7)) {
 		serial_write_hex16(m[0]);
 		serial_write_hex16(m[1]);
 		serial_write_hex16(m[2]);
@@ -287,53 +542,194 @@ static void vectors_update(void) {
 	}
 #endif
 
+	dcm_rotate(&dcm, crossed, a);
+	nav_update(crossed, statica, vectors_ts);
+
 	/* Write resulting current attitude */
 
-	cli();
-	ahrs_pitch = pitch;
-	ahrs_roll = roll;
-	ahrs_yaw_rate = yaw - ahrs_yaw;
-	ahrs_yaw = yaw;
-	accel_acceleration[0] = a[0] - rotated[0];
-	accel_acceleration[1] = a[1] - rotated[1];
-	accel_acceleration[2] = a[2] - rotated[2];
-	sei();
+	seq_write_begin(&ahrs_seq);
+	ahrs_state.pitch = pitch;
+	ahrs_state.roll = roll;
+	ahrs_state.yaw_rate = yaw - ahrs_state.yaw;
+	ahrs_state.yaw_rate_dt = ahrs_ticks(vectors_ts - ahrs_state.timestamp);
+	ahrs_state.yaw = yaw;
+	ahrs_state.timestamp = vectors_ts;
+	ahrs_state.acceleration[0] = a[0] - rotated[0];
+	ahrs_state.acceleration[1] = a[1] - rotated[1];
+	ahrs_state.acceleration[2] = a[2] - rotated[2];
+	ahrs_state.nav = nav_state;
+	ahrs_state.dcm = dcm;
+	seq_write_end(&ahrs_seq);
+
+	event_post(EVENT_AHRS);
+	PROF_END(PROF_FUSE);
+}
 
-	/* TODO: acceleration needs to be integrated using the time difference
-	 * like the rotation rates are.
-	 */
-	rotate(rotated, a, yaw, -pitch, -roll);
-	accel_velocity[0] += rotated[0] - statica[0];
-	accel_velocity[1] += rotated[1] - statica[1];
-	accel_velocity[2] += rotated[2] - statica[2];
+static void vectors_update(void) {
+	PROF_START(PROF_VECTORS);
+
+	/* The magnetometers's measurement frequency is 50Hz and the
+	 * accelerometer's rate is limite by buffer referesh rate of 55Hz, so
+	 * schedule the next measurement 1/50 sec from the time the previous
+	 * measurement was *supposed* to happen.  Not sure if that's really
+	 * better, need to think about it.  */
+	v_ts += F_CPU / 50;
+	set_timeout(v_ts, vectors_update);
+
+	/* Retrieve current values of everything, the fusion step runs
+	 * when the transfer completes.  If the previous read still hasn't
+	 * finished the bus is in trouble, skip this one.  */
+	if (unlikely(vectors_job.status == TWI_JOB_PENDING)) {
+		event_post(EVENT_AHRS);
+		PROF_END(PROF_VECTORS);
+		return;
+	}
+
+	vectors_ts = timer_read();
+	cmps09_read_bytes_async(&vectors_job,
+			10, 12, vectors_regs, vectors_fuse);
+	PROF_END(PROF_VECTORS);
 }
 
-void ahrs_init(void) {
-	int i;
+/*
+ * Warm start: with a calibration stored by an earlier boot only
+ * 1 << CALIB_CHECK_RES gyro samples (about 0.3s) are averaged, to
+ * check that the bias is still within CALIB_GYRO_TOL of the stored one,
+ * that each axis of gravity is within CALIB_ACCEL_TOL and that the
+ * magnetic field is about as strong as it was.  The stored bias and
+ * gravity are then used and refined later, see gyro_refine().  The
+ * magnetic field reference always comes from the check's readings as
+ * it's also the yaw reference and the vehicle rarely boots facing the
+ * same way.  If any of the checks fails the full calibration runs.
+ */
+#ifndef CALIB_CHECK_RES
+# define CALIB_CHECK_RES 6
+#endif
+#ifndef CALIB_GYRO_TOL
+# define CALIB_GYRO_TOL 8 /* adc_values LSBs, about 2 deg/s */
+#endif
+#ifndef CALIB_ACCEL_TOL
+# define CALIB_ACCEL_TOL 0x400 /* About 3.5 deg of tilt */
+#endif
+
+/*
+ * Sum 1 << res gyro samples into x_ref/y_ref and every 8th sample's
+ * CMPS09 readings into avga/avgm.
+ */
+static void sensors_cal(uint8_t res) {
+	uint16_t i;
 
-	/* Calibrate the sensors while waiting for the ESCs to detect
-	 * voltages etc. */
 	x_ref = y_ref = 0;
 	avga[0] = avga[1] = avga[2] = 0;
 	avgm[0] = avgm[1] = avgm[2] = 0;
-	for (i = 0; i < (1 << REF_RES); i ++) {
-		adc_convert_all(gyro_cal_update);
-		my_delay(4);
-		if (!(i & 7)) /* Every 32ms or so */
-			vectors_cal();
+	cal_cnt = 0;
+	cal_len = 1 << res;
+	adc_start(gyro_cal_update);
+	for (i = 0; i < cal_len; i += 8) {
+		while (cal_count() <= i) /* Every 40ms or so */
+			event_wait(1 << EVENT_GYRO);
+		vectors_cal();
 	}
-	statica[0] = (avga[0] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
-	statica[1] = (avga[1] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
-	statica[2] = (avga[2] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
-	staticm[1] = (avgm[0] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
-	staticm[0] = (avgm[1] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
-	staticm[2] = (avgm[2] + ((1 << (REF_RES - 4)) - 1)) >> (REF_RES - 3);
-	staticm[1] -= cmps09_mag_calib[0];
-	staticm[0] -= cmps09_mag_calib[1];
-	staticm[2] -= cmps09_mag_calib[2];
+	while (cal_count() < cal_len)
+		event_wait(1 << EVENT_GYRO);
+}
+
+static void vectors_avg(uint8_t shift) {
+	statica[0] = CAL_AVG(avga[0], shift);
+	statica[1] = CAL_AVG(avga[1], shift);
+	statica[2] = CAL_AVG(avga[2], shift);
+	staticm[1] = CAL_AVG(avgm[0], shift);
+	staticm[0] = CAL_AVG(avgm[1], shift);
+	staticm[2] = CAL_AVG(avgm[2], shift);
+	staticm[1] -= mag_calib[0];
+	staticm[0] -= mag_calib[1];
+	staticm[2] -= mag_calib[2];
 
 	cmps09_xy_adjust(staticm);
 	cmps09_xy_adjust(statica);
+}
+
+static uint8_t calib_check(void) {
+	const int32_t tol = (int32_t) CALIB_GYRO_TOL << REF_RES;
+	int32_t d, ref;
+	uint8_t i;
+
+	d = (x_ref << (REF_RES - CALIB_CHECK_RES)) - calib.x_ref;
+	if (d > tol || d < -tol)
+		return 0;
+	d = (y_ref << (REF_RES - CALIB_CHECK_RES)) - calib.y_ref;
+	if (d > tol || d < -tol)
+		return 0;
+
+	for (i = 0; i < 3; i ++) {
+		d = statica[i] - calib.statica[i];
+		if (d > CALIB_ACCEL_TOL || d < -CALIB_ACCEL_TOL)
+			return 0;
+	}
+
+	/* Within 1/4 in |m|^2, some 12% in |m| */
+	ref = hypot3(calib.staticm);
+	d = hypot3(staticm) - ref;
+	return d < (ref >> 2) && d > -(ref >> 2);
+}
+
+void ahrs_init(void) {
+	uint8_t warm = 0, loaded;
+
+	/* The magnetometer offsets are the vehicle's, not the boot's, so
+	 * once refined (see mag_refine()) a full calibration keeps them */
+	loaded = calib_load(&calib) && calib.ref_res == REF_RES;
+	if (loaded) {
+		mag_calib[0] = calib.mag[0];
+		mag_calib[1] = calib.mag[1];
+		mag_calib[2] = calib.mag[2];
+	} else {
+		mag_calib[0] = cmps09_mag_calib[0];
+		mag_calib[1] = cmps09_mag_calib[1];
+		mag_calib[2] = cmps09_mag_calib[2];
+	}
+	mag_min[0] = mag_min[1] = mag_min[2] = 32767;
+	mag_max[0] = mag_max[1] = mag_max[2] = -32768;
+
+	/* Calibrate the sensors while waiting for the ESCs to detect
+	 * voltages etc. */
+	if (loaded) {
+		sensors_cal(CALIB_CHECK_RES);
+		vectors_avg(CALIB_CHECK_RES - 3);
+		warm = calib_check();
+	}
+
+	if (warm) {
+		x_ref = calib.x_ref;
+		y_ref = calib.y_ref;
+		statica[0] = calib.statica[0];
+		statica[1] = calib.statica[1];
+		statica[2] = calib.statica[2];
+
+		refine_x = refine_y = 0;
+		refine_cnt = 0;
+		avga[0] = avga[1] = avga[2] = 0;
+		refine_acnt = 0;
+		refine_state = REFINE_GYRO;
+	} else {
+		sensors_cal(REF_RES);
+		vectors_avg(REF_RES - 3);
+
+		calib.ref_res = REF_RES;
+		calib.x_ref = x_ref;
+		calib.y_ref = y_ref;
+		calib.statica[0] = statica[0];
+		calib.statica[1] = statica[1];
+		calib.statica[2] = statica[2];
+		calib.staticm[0] = staticm[0];
+		calib.staticm[1] = staticm[1];
+		calib.staticm[2] = staticm[2];
+		calib.mag[0] = mag_calib[0];
+		calib.mag[1] = mag_calib[1];
+		calib.mag[2] = mag_calib[2];
+		calib_save(&calib);
+	}
+
 #ifdef CAL
 	serial_write_hex16(statica[0]);
 	serial_write_hex16(statica[1]);
@@ -345,14 +741,15 @@ void ahrs_init(void) {
 	 * statica[0] = statica[1] = 0
 	 */
 
-	ahrs_pitch = ahrs_roll = ahrs_yaw = 0;
+	ahrs_state.pitch = ahrs_state.roll = ahrs_state.yaw = 0;
 	rel_pitch = rel_roll = 0;
+	gyro_head = gyro_tail = 0;
 
 	/* Start the correcting vector updates first */
 	v_ts = timer_read();
 	vectors_update();
 
 	/* Start the gyro output integration loop */
-	prev_ts = timer_read();
-	gyro_update();
+	integ_ts = timer_read();
+	adc_start(gyro_ahrs_update);
 }
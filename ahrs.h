@@ -4,15 +4,95 @@
  * Licensed under AGPLv3.
  */
 
+#ifndef _AHRS_H
+#define _AHRS_H
+
 void ahrs_init(void);
 
 #define ROLL_PITCH_180DEG ((int32_t) (0.9765625 * F_CPU * 90))////
-extern volatile int16_t ahrs_pitch, ahrs_roll;
-extern volatile int16_t ahrs_yaw,
-       ahrs_pitch_rate, ahrs_roll_rate, ahrs_yaw_rate;
 
-/* Other non-ahrs data while we're there */
-extern volatile int16_t accel_acceleration[3];
+/* trig.h needs ROLL_PITCH_180DEG */
+#include "trig.h"
+#include "seqlock.h"
+#include "nav.h"
+
+/*
+ * Everything the AHRS outputs, published under a sequence count (see
+ * seqlock.h) so that ahrs_read() gets all of it from one and the same
+ * update without disabling interrupts.  Readers must be in the main
+ * loop, not in an interrupt handler.
+ */
+struct ahrs_state_s {
+	/* When the sensor readings behind this estimate were taken */
+	uint32_t timestamp;
+	/* ROLL_PITCH_180DEG is 180 deg */
+	int32_t pitch, roll;
+	/* 32768 is 180 deg */
+	int16_t yaw;
+	/*
+	 * pitch and roll change by rate * cycles / 256 (about 1/131
+	 * deg/s per unit), yaw by yaw_rate over yaw_rate_dt 256-cycle
+	 * ticks, 0 before there's a yaw_rate.
+	 */
+	int16_t pitch_rate, roll_rate, yaw_rate;
+	uint16_t yaw_rate_dt;
+	/*
+	 * Acceleration is reported in the initial coordinate system
+	 * rotated by the angles above so really it is the local
+	 * coordinate system of the vehicle.  It does not include the
+	 * gravitational acceleration.
+	 *
+	 * The velocity and altitude estimate is in the fixed "global"
+	 * coordinate system set at system start, see nav.h.
+	 */
+	int16_t acceleration[3];
+	struct nav_state_s nav;
+	/* The rotation from the global frame to the local one, trig.h */
+	struct dcm_s dcm;
+};
+
+/*
+ * The pitch and roll rates come from the gyro more often than the
+ * rest and may have a writer of their own, so they're published
+ * separately.  ahrs_state's own pitch_rate and roll_rate are unused.
+ */
+struct ahrs_rates_s {
+	int16_t pitch, roll;
+};
+
+extern struct ahrs_state_s ahrs_state;
+extern struct ahrs_rates_s ahrs_rates;
+extern volatile uint8_t ahrs_seq, ahrs_rates_seq;
+
+/* Cycles to yaw_rate_dt's ticks, saturated */
+static inline uint16_t ahrs_ticks(uint32_t cycles) {
+	return cycles > 0xffffff ? 0xffff : cycles >> 8;
+}
+
+static inline void ahrs_read_rates(struct ahrs_rates_s *rates) {
+	uint8_t count;
+
+	do {
+		count = seq_read_begin(&ahrs_rates_seq);
+		*rates = ahrs_rates;
+	} while (seq_read_retry(&ahrs_rates_seq, count));
+}
+
+static inline void ahrs_read(struct ahrs_state_s *state) {
+	struct ahrs_rates_s rates;
+	uint8_t count;
+
+	do {
+		count = seq_read_begin(&ahrs_seq);
+		*state = ahrs_state;
+	} while (seq_read_retry(&ahrs_seq, count));
+
+	ahrs_read_rates(&rates);
+	state->pitch_rate = rates.pitch;
+	state->roll_rate = rates.roll;
+}
+
+/* ahrs-ekf-float.c's own state */
 extern volatile float mag[3];
 extern volatile float acc[3];
 
@@ -37,3 +117,5 @@ static inline void global_to_local(const float *g, float *l) {
 	l[2] = g[0] * (q1q3 + q0q2) +
 		g[1] * (q2q3 - q0q1) + g[2] * (1 - q1q1 - q2q2);
 }
+
+#endif /* _AHRS_H */
@@ -0,0 +1,256 @@
+/*
+ * Host-side decoder for the blackbox EEPROM (see blackbox.h).
+ *
+ * Licensed under AGPLv3.
+ *
+ * Reads an EEPROM image, as saved by telemetry-decode -b, and prints one
+ * of the logs in it in the sil-replay log format (see sil/sil.c), the
+ * actuator records as comments.  A log is what was recorded between
+ * arming and disarming the motors.  Since the AHRS calibrates over the
+ * first 1024 gyro samples of a replay, and the motors were armed with
+ * the vehicle sitting still, the log is preceded by 5.5 seconds of
+ * the first gyro, CMPS09 and rx readings repeated, unless -n is given.
+ * Replay with sil-replay -m 0x1 to start out armed.
+ *
+ * Usage: blackbox-decode [-l] [-n] [-s <log>] <image>
+ *   -l		list the logs found in the image instead
+ *   -n		no calibration lead-in
+ *   -s		decode log number <log> from the -l list, the default is
+ *		the newest one
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "blackbox.h"
+
+#define TIME_MASK	((1ul << (32 - BB_TICK_SHIFT)) - 1)
+#define US(ticks)	\
+	((unsigned long long) (ticks) * BB_TICK * 1000000 / F_CPU)
+
+#define LEAD_IN		5500000ull /* us */
+#define LEAD_IN_PERIOD	5000ull
+
+static uint8_t image[BB_EEPROM_SIZE];
+static const uint8_t fields[BB_RECORDS] = BB_FIELDS;
+static const char record_names[BB_RECORDS] = "GCRAB";
+
+static struct record_s {
+	unsigned long long ticks;
+	uint8_t type;
+	int16_t v[BB_MAX_FIELDS];
+} *records;
+static int records_len, records_size;
+
+static const struct bb_page_header_s *header(int page) {
+	return (const void *) (image + page * BB_PAGE_SIZE);
+}
+
+static int valid(int page) {
+	return header(page)->magic == BB_MAGIC;
+}
+
+static int get_varint(const uint8_t *page, int *pos, uint16_t *val) {
+	int shift = 0;
+
+	*val = 0;
+	do {
+		if (*pos >= BB_PAGE_SIZE || shift > 14)
+			return -1;
+		*val |= (uint16_t) (page[*pos] & 0x7f) << shift;
+		shift += 7;
+	} while (page[(*pos) ++] & 0x80);
+
+	return 0;
+}
+
+static void record_add(const struct record_s *rec) {
+	if (records_len == records_size) {
+		records_size = records_size ? records_size * 2 : 1024;
+		records = realloc(records, records_size * sizeof(*records));
+		if (!records) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+
+	records[records_len ++] = *rec;
+}
+
+/* Decode one page's records, times relative to base */
+static void page_decode(int page, unsigned long long base) {
+	const uint8_t *p = image + page * BB_PAGE_SIZE;
+	int pos = sizeof(struct bb_page_header_s), i;
+	int16_t prev[BB_RECORDS][BB_MAX_FIELDS];
+	uint8_t seen[BB_RECORDS] = { 0 };
+	struct record_s rec;
+	uint16_t val;
+
+	rec.ticks = base;
+	while (pos < BB_PAGE_SIZE && p[pos] != 0xff) {
+		rec.type = p[pos ++];
+		if (rec.type >= BB_RECORDS || get_varint(p, &pos, &val))
+			goto bad;
+		rec.ticks += val;
+
+		for (i = 0; i < fields[rec.type]; i ++) {
+			if (get_varint(p, &pos, &val))
+				goto bad;
+			rec.v[i] = (val >> 1) ^ -(val & 1);
+			if (seen[rec.type])
+				rec.v[i] += prev[rec.type][i];
+			prev[rec.type][i] = rec.v[i];
+		}
+		seen[rec.type] = 1;
+
+		record_add(&rec);
+	}
+	return;
+
+bad:
+	fprintf(stderr, "Page %i (seq %i): bad record at offset %i\n",
+			page, header(page)->seq, pos);
+}
+
+static void record_print(unsigned long long us, const struct record_s *rec) {
+	int i;
+
+	printf("%s%llu %c", rec->type == BB_ACT ? "# " : "",
+			us, record_names[rec->type]);
+	for (i = 0; i < fields[rec->type]; i ++)
+		printf(" %i", rec->type == BB_GYRO || rec->type == BB_ACT ||
+				rec->type == BB_BAT ?
+				(uint16_t) rec->v[i] : rec->v[i]);
+	printf("\n");
+}
+
+static void lead_in(void) {
+	const struct record_s *first[BB_RECORDS] = { NULL };
+	unsigned long long us;
+	int i;
+
+	for (i = 0; i < records_len; i ++)
+		if (!first[records[i].type])
+			first[records[i].type] = records + i;
+	if (!first[BB_GYRO]) {
+		fprintf(stderr, "No gyro records in the log\n");
+		return;
+	}
+
+	printf("# Lead-in for the AHRS calibration\n");
+	if (first[BB_CMPS])
+		record_print(0, first[BB_CMPS]);
+	if (first[BB_RX])
+		record_print(0, first[BB_RX]);
+	for (us = LEAD_IN_PERIOD; us < LEAD_IN; us += LEAD_IN_PERIOD)
+		record_print(us, first[BB_GYRO]);
+	printf("# Log starts\n");
+}
+
+int main(int argc, char **argv) {
+	int list = 0, no_lead_in = 0, want = -1, logs = 0;
+	int start, page, n, i, lo, hi, mid;
+	unsigned long long ticks = 0, base;
+	const char *name = NULL;
+	FILE *in;
+
+	for (i = 1; i < argc; i ++) {
+		if (!strcmp(argv[i], "-l"))
+			list = 1;
+		else if (!strcmp(argv[i], "-n"))
+			no_lead_in = 1;
+		else if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			want = atoi(argv[++ i]);
+		else
+			name = argv[i];
+	}
+	if (!name) {
+		fprintf(stderr, "Usage: %s [-l] [-n] [-s <log>] <image>\n",
+				argv[0]);
+		return 1;
+	}
+
+	if (!(in = fopen(name, "rb"))) {
+		perror(name);
+		return 1;
+	}
+	memset(image, 0xff, sizeof(image));
+	if (fread(image, 1, sizeof(image), in) < sizeof(image))
+		fprintf(stderr, "Short image, the rest taken as erased\n");
+	fclose(in);
+
+	/* Same search as bb_init(), the oldest page follows the newest */
+	start = 0;
+	if (valid(0)) {
+		for (lo = 1, hi = BB_PAGES; lo < hi; ) {
+			mid = (lo + hi) >> 1;
+			if (valid(mid) && header(mid)->seq ==
+					(uint16_t) (header(0)->seq + mid))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		start = lo % BB_PAGES;
+	}
+
+	/* Count the logs first to know which one is the newest */
+	for (n = 0; n < BB_PAGES; n ++) {
+		page = (start + n) % BB_PAGES;
+		if (valid(page) && (!logs ||
+					(header(page)->flags & BB_FLAG_START)))
+			logs ++;
+	}
+	if (want < 0)
+		want = logs - 1;
+
+	for (n = 0, i = -1; n < BB_PAGES; n ++) {
+		const struct bb_page_header_s *hdr;
+		static uint32_t prev_time;
+		static uint16_t prev_seq;
+
+		page = (start + n) % BB_PAGES;
+		if (!valid(page))
+			continue;
+		hdr = header(page);
+
+		/* The oldest log may have lost its start to the newest */
+		if ((hdr->flags & BB_FLAG_START) || i < 0) {
+			i ++;
+			ticks = 0;
+			if (list)
+				printf("Log %i: starts at page %i "
+						"(seq %i)%s\n", i, page, hdr->seq,
+						(hdr->flags & BB_FLAG_START) ?
+						"" : ", beginning overwritten");
+		} else {
+			if (hdr->seq != (uint16_t) (prev_seq + 1))
+				fprintf(stderr, "Log %i: %i pages missing "
+						"before page %i\n", i,
+						(uint16_t) (hdr->seq -
+							prev_seq - 1), page);
+			ticks += (hdr->time - prev_time) & TIME_MASK;
+		}
+		prev_time = hdr->time;
+		prev_seq = hdr->seq;
+
+		if (i == want && !list)
+			page_decode(page, ticks);
+	}
+
+	if (list)
+		return 0;
+	if (!records_len) {
+		fprintf(stderr, "Log %i not found or empty\n", want);
+		return 1;
+	}
+
+	base = no_lead_in ? 0 : LEAD_IN;
+	if (!no_lead_in)
+		lead_in();
+	for (i = 0; i < records_len; i ++)
+		record_print(base + US(records[i].ticks), records + i);
+
+	return 0;
+}
@@ -0,0 +1,347 @@
+/*
+ * Flight data recorder, see blackbox.h.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "hal.h"
+#include "timer1.h"
+#include "twi.h"
+#include "uart.h"
+#include "telemetry.h"
+#include "blackbox.h"
+
+#ifndef NULL
+# define NULL 0
+#endif
+
+#ifdef BLACKBOX
+
+/* The 24LC512's page write cycle takes up to 5ms, during which it NACKs */
+#define BB_WRITE_CYCLE	(F_CPU / 200)
+#define BB_RETRY	(F_CPU / 1000)
+#define BB_MAX_RETRIES	20
+
+static const uint8_t bb_fields[BB_RECORDS] = BB_FIELDS;
+
+volatile uint16_t bb_dropped = 0;
+
+static uint8_t bb_present = 0;
+static volatile uint8_t bb_active = 0;
+static uint8_t bb_flags;
+
+/*
+ * bb_buf[bb_cur] is being filled, bb_pos is the write position in it or
+ * 0 if no page is open.  bb_busy is set while the other buffer is being
+ * written out, bb_full while the current one has been closed and waits
+ * for its turn.
+ */
+static uint8_t bb_buf[2][BB_PAGE_SIZE];
+static uint8_t bb_cur, bb_pos;
+static volatile uint8_t bb_busy;
+static volatile uint8_t bb_full;
+static uint16_t bb_seq;		/* Tells the page open from earlier ones */
+static uint16_t bb_last;	/* Time of the last record, in ticks */
+
+static uint16_t bb_prev_seq[BB_RECORDS];
+static int16_t bb_prev[BB_RECORDS][BB_MAX_FIELDS];
+
+/*
+ * The write-out: page bb_wpage from bb_buf[bb_flush_buf], chunk bb_off.
+ * The header is given bb_wseq as the buffer is handed over rather than
+ * bb_seq as it's opened, so a page that had to be given up leaves no gap
+ * in the EEPROM's sequence numbers, its slot is reused for the next one.
+ */
+static struct twi_job_s bb_job;
+static uint16_t bb_wpage, bb_wseq;
+static uint8_t bb_flush_buf, bb_off, bb_retries;
+
+static void bb_chunk_done(void);
+
+static void bb_chunk_write(void) {
+	uint16_t addr = bb_wpage * BB_PAGE_SIZE + bb_off;
+
+	bb_job.addr = BB_EEPROM_ADDR;
+	bb_job.wlen = 2;
+	bb_job.wbuf[0] = addr >> 8;
+	bb_job.wbuf[1] = addr & 255;
+	bb_job.dlen = BB_CHUNK;
+	bb_job.data = bb_buf[bb_flush_buf] + bb_off;
+	bb_job.rlen = 0;
+	bb_job.finished = bb_chunk_done;
+	twi_queue(&bb_job);
+}
+
+/* Interrupts disabled here */
+static void bb_hand_over(void) {
+	struct bb_page_header_s *hdr = (void *) bb_buf[bb_cur];
+
+	hdr->seq = bb_wseq;
+	bb_flush_buf = bb_cur;
+	bb_cur ^= 1;
+	bb_busy = 1;
+	bb_full = 0;
+
+	/*
+	 * The header goes out last so that a page cut short by a reset
+	 * is never taken for a valid one.
+	 */
+	bb_off = BB_CHUNK;
+	bb_retries = 0;
+	bb_chunk_write();
+}
+
+/* Queue the next chunk or a retry, returns 0 to give up on the page */
+static uint8_t bb_chunk_next(void) {
+	uint32_t delay = BB_WRITE_CYCLE;
+
+	if (unlikely(bb_job.status != TWI_JOB_DONE)) {
+		/* Most likely still busy with the previous write cycle */
+		if (unlikely(bb_retries ++ >= BB_MAX_RETRIES))
+			return 0;
+		delay = BB_RETRY;
+	} else {
+		bb_off = (bb_off + BB_CHUNK) & (BB_PAGE_SIZE - 1);
+		bb_retries = 0;
+	}
+
+	/* With the timeout heap full nothing would ever come back here */
+	return !set_timeout(timer_read() + delay, bb_chunk_write);
+}
+
+/* Runs from the TWI interrupt (with interrupts enabled) */
+static void bb_chunk_done(void) {
+	uint8_t sreg;
+
+	if (likely(bb_job.status == TWI_JOB_DONE) && !bb_off) {
+		/* The header is in */
+		bb_wpage = (bb_wpage + 1) % BB_PAGES;
+		bb_wseq ++;
+	} else if (likely(bb_chunk_next()))
+		return;
+	else
+		/* Drop the page, bb_wpage is retried with the next one */
+		bb_dropped ++;
+
+	sreg = irq_save();
+	bb_busy = 0;
+	if (bb_full)
+		bb_hand_over();
+	irq_restore(sreg);
+}
+
+/* Interrupts disabled here */
+static void bb_open(uint32_t now) {
+	struct bb_page_header_s *hdr = (void *) bb_buf[bb_cur];
+
+	hdr->magic = BB_MAGIC;
+	hdr->flags = bb_flags;
+	bb_seq ++;
+	hdr->time = now;
+	bb_flags = 0;
+	bb_pos = sizeof(*hdr);
+	bb_last = now;
+}
+
+/* Interrupts disabled here */
+static void bb_close(void) {
+	uint8_t *page = bb_buf[bb_cur];
+
+	while (bb_pos < BB_PAGE_SIZE)
+		page[bb_pos ++] = 0xff;
+	bb_pos = 0;
+
+	if (bb_busy)
+		bb_full = 1;
+	else
+		bb_hand_over();
+}
+
+static uint8_t put_varint(uint8_t *p, uint16_t val) {
+	uint8_t n = 0;
+
+	while (val >= 0x80) {
+		p[n ++] = val | 0x80;
+		val >>= 7;
+	}
+	p[n ++] = val;
+
+	return n;
+}
+
+/*
+ * The fields are encoded with interrupts enabled, against this type's
+ * previous record if it's in the page that is open at that point.  If
+ * by the time we get to copy the record in a different page is open,
+ * or the record doesn't fit and a new one has to be opened, the fields
+ * are encoded again.
+ */
+void bb_log(uint8_t type, const int16_t *v) {
+	uint8_t fields[BB_MAX_FIELDS * 3], len, i, delta, tries, sreg;
+	uint8_t *p;
+	uint32_t now;
+	int16_t d;
+
+	if (!bb_active)
+		return;
+
+	for (tries = 0; tries < 3; tries ++) {
+		sreg = irq_save();
+		delta = bb_pos && bb_prev_seq[type] == bb_seq;
+		irq_restore(sreg);
+
+		for (i = 0, len = 0; i < bb_fields[type]; i ++) {
+			d = delta ? v[i] - bb_prev[type][i] : v[i];
+			len += put_varint(fields + len,
+					((uint16_t) d << 1) ^ (d >> 15));
+		}
+
+		sreg = irq_save();
+		now = timer_read() >> BB_TICK_SHIFT;
+		if (unlikely(!bb_active))
+			break;
+		if (!bb_pos) {
+			if (unlikely(bb_full)) {
+				bb_dropped ++;
+				break;
+			}
+			bb_open(now);
+		}
+		if (delta != (bb_prev_seq[type] == bb_seq)) {
+			irq_restore(sreg);
+			continue;
+		}
+		/* type, at most 3 bytes of dt, the fields */
+		if (bb_pos + 4 + len > BB_PAGE_SIZE) {
+			bb_close();
+			irq_restore(sreg);
+			continue;
+		}
+
+		p = bb_buf[bb_cur] + bb_pos;
+		*p ++ = type;
+		p += put_varint(p, (uint16_t) now - bb_last);
+		for (i = 0; i < len; i ++)
+			*p ++ = fields[i];
+		bb_pos = p - bb_buf[bb_cur];
+		bb_last = now;
+
+		bb_prev_seq[type] = bb_seq;
+		for (i = 0; i < bb_fields[type]; i ++)
+			bb_prev[type][i] = v[i];
+		break;
+	}
+
+	irq_restore(sreg);
+}
+
+/* Blocking EEPROM read, only while not logging */
+static uint8_t bb_read(uint16_t addr, uint8_t len, uint8_t *out) {
+	struct twi_job_s job;
+
+	job.addr = BB_EEPROM_ADDR;
+	job.wlen = 2;
+	job.wbuf[0] = addr >> 8;
+	job.wbuf[1] = addr & 255;
+	job.dlen = 0;
+	job.rlen = len;
+	job.rbuf = out;
+	job.finished = NULL;
+	twi_queue(&job);
+	twi_wait(&job);
+
+	return job.status == TWI_JOB_DONE;
+}
+
+/* Does page number page hold the sequence number seq */
+static uint8_t bb_page_is(uint16_t page, uint16_t seq) {
+	struct bb_page_header_s hdr;
+
+	return bb_read(page * BB_PAGE_SIZE, sizeof(hdr), (uint8_t *) &hdr) &&
+		hdr.magic == BB_MAGIC && hdr.seq == seq;
+}
+
+/*
+ * Find where the previous log ended.  The pages from 0 up to the
+ * newest one have consecutive sequence numbers, anything after them is
+ * either older by BB_PAGES or garbage, so a binary search does it.
+ */
+void bb_init(void) {
+	struct bb_page_header_s hdr;
+	uint16_t lo, hi, mid, i;
+
+	if (!bb_read(0, sizeof(hdr), (uint8_t *) &hdr))
+		return;
+	bb_present = 1;
+
+	if (hdr.magic != BB_MAGIC) {
+		bb_wpage = 0;
+		bb_seq = 0;
+	} else {
+		for (lo = 1, hi = BB_PAGES; lo < hi; ) {
+			mid = (lo + hi) >> 1;
+			if (bb_page_is(mid, hdr.seq + mid))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		bb_wpage = lo % BB_PAGES;
+		bb_seq = hdr.seq + lo - 1;
+	}
+
+	bb_wseq = bb_seq + 1;
+
+	for (i = 0; i < BB_RECORDS; i ++)
+		bb_prev_seq[i] = bb_seq;
+}
+
+void bb_start(void) {
+	if (!bb_present || bb_active)
+		return;
+
+	bb_flags = BB_FLAG_START;
+	bb_active = 1;
+}
+
+/* Closes the current page, it's written out in the background */
+void bb_stop(void) {
+	uint8_t sreg;
+
+	if (!bb_active)
+		return;
+
+	sreg = irq_save();
+	bb_active = 0;
+	if (bb_pos)
+		bb_close();
+	irq_restore(sreg);
+}
+
+/*
+ * Stream the whole EEPROM as TELEM_BLACKBOX frames, the host sorts the
+ * pages out.  Blocks for as long as that takes at the UART speed, so
+ * only use while the motors are disarmed.
+ */
+void bb_dump(void) {
+	struct telem_blackbox_s chunk;
+	uint32_t addr;
+
+	if (!bb_present)
+		return;
+	bb_stop();
+	while (bb_busy || bb_full);
+
+	for (addr = 0; addr < BB_EEPROM_SIZE; addr += BB_CHUNK) {
+		chunk.addr = addr;
+		if (!bb_read(addr, BB_CHUNK, chunk.data))
+			continue;
+
+		while (serial_tx_free() < TELEM_MAX_PAYLOAD + 6);
+		telem_send(TELEM_BLACKBOX, &chunk, sizeof(chunk));
+	}
+}
+
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Flight data recorder on an I2C EEPROM.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Only built in with -DBLACKBOX (see the Makefile), otherwise the
+ * logging calls compile to nothing.  While the motors are armed the raw
+ * sensor inputs and the actuator outputs go into one of two RAM page
+ * buffers, each full page is then written out to a 24LC512-class EEPROM
+ * on the TWI bus in the background while the other buffer fills.  The
+ * EEPROM is used as a ring: every page carries a sequence number and a
+ * new log continues after the newest page found at boot, overwriting
+ * the oldest ones.
+ *
+ * A page is BB_PAGE_SIZE bytes, a struct bb_page_header_s followed by
+ * records and padded with 0xff.  Each record is:
+ *
+ *   [type] [dt] [field deltas ...]
+ *
+ * where dt is the time since the previous record in the page (or since
+ * the page's time for the first one) and each field is the difference
+ * from the same field in the previous record of the same type, or the
+ * absolute value in the first record of its type in the page, so any
+ * page decodes on its own.  dt and the fields are varints: 7 bits per
+ * byte, least significant group first, bit 7 set in all but the last
+ * byte, fields zigzag-encoded first (0, -1, 1, -2, ... map to 0, 1, 2,
+ * 3, ...).  Times are in BB_TICK cycles (64us at 16MHz), page times are
+ * the lower bits of timer_read() >> BB_TICK_SHIFT and wrap every 268s
+ * like the timer.
+ *
+ * A gyro record takes some 5 bytes, the whole log about 2.3kB/s, so a
+ * 64kB EEPROM holds the last 28 seconds.  Page writes cost 4 chunk
+ * writes of 3.2ms bus time at 100kHz each.
+ *
+ * Logging from any context costs one encoding pass of the fields (about
+ * 20 cycles per field) and a copy of the record into the page with
+ * interrupts disabled, at most some 150 cycles.  Records that arrive
+ * while both buffers are full are dropped and counted in bb_dropped.
+ *
+ * This header is shared with the host side decoder (blackbox-decode.c).
+ */
+
+#define BB_EEPROM_ADDR	0x50
+#ifndef BB_EEPROM_SIZE
+# define BB_EEPROM_SIZE	65536L
+#endif
+#define BB_PAGE_SIZE	128
+#define BB_PAGES	(BB_EEPROM_SIZE / BB_PAGE_SIZE)
+/* Bytes per write transaction, a divisor of BB_PAGE_SIZE */
+#define BB_CHUNK	32
+
+#define BB_TICK_SHIFT	10
+#define BB_TICK		(1L << BB_TICK_SHIFT)
+
+#define BB_MAGIC	0xbb
+/* First page of a log, written when logging (re)starts */
+#define BB_FLAG_START	1
+
+struct bb_page_header_s {
+	uint8_t magic;
+	uint8_t flags;
+	uint16_t seq;
+	uint32_t time;
+} __attribute__((packed));
+
+enum bb_record_e {
+	BB_GYRO,	/* adc_values[0..2] */
+	BB_CMPS,	/* CMPS09 registers 10 to 21 as 6 int16s */
+	BB_RX,		/* co_throttle, co_right, cy_front, cy_right,
+			 * gyro_sw, right_pot */
+	BB_ACT,		/* actuators[0..3] */
+	BB_BAT,		/* adc_values[3..4] */
+	BB_RECORDS,
+};
+
+#define BB_MAX_FIELDS	6
+#define BB_FIELDS	{ 3, 6, 6, 4, 2 }
+
+#ifdef BLACKBOX
+void bb_init(void);
+void bb_start(void);
+void bb_stop(void);
+void bb_log(uint8_t type, const int16_t *v);
+void bb_dump(void);
+
+extern volatile uint16_t bb_dropped;
+
+static inline void bb_log_cmps09(const uint8_t *regs) {
+	int16_t v[6];
+	uint8_t i;
+
+	for (i = 0; i < 6; i ++)
+		v[i] = ((uint16_t) regs[i * 2] << 8) | regs[i * 2 + 1];
+	bb_log(BB_CMPS, v);
+}
+
+/* adc_values[0..2] don't change until the next gyro sample is due */
+# define BB_LOG_GYRO()	bb_log(BB_GYRO, (const int16_t *) adc_values)
+# define BB_LOG_CMPS09(regs)	bb_log_cmps09(regs)
+#else
+static inline void bb_init(void) {}
+static inline void bb_start(void) {}
+static inline void bb_stop(void) {}
+static inline void bb_log(uint8_t type, const int16_t *v) {}
+static inline void bb_dump(void) {}
+
+# define BB_LOG_GYRO()
+# define BB_LOG_CMPS09(regs)
+#endif
@@ -0,0 +1,51 @@
+/*
+ * Sensor calibration kept in the ATmega's internal EEPROM across boots.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+
+#include "hal.h"
+#include "nvm.h"
+#include "calib.h"
+
+/* The record being written */
+static struct calib_s pending;
+static struct nvm_job_s pending_job = {
+	.addr = CALIB_EEPROM_ADDR,
+	.data = (const uint8_t *) &pending,
+	.len = sizeof(pending),
+};
+
+static uint8_t calib_sum(const struct calib_s *cal) {
+	const uint8_t *p = (const uint8_t *) cal;
+	uint8_t i, sum = 0;
+
+	for (i = 0; i < sizeof(*cal) - 1; i ++)
+		sum += p[i];
+	return -sum;
+}
+
+uint8_t calib_load(struct calib_s *cal) {
+	eeprom_read_block(cal, (const void *) CALIB_EEPROM_ADDR, sizeof(*cal));
+
+	return cal->magic == CALIB_MAGIC && cal->sum == calib_sum(cal);
+}
+
+void calib_save(const struct calib_s *cal) {
+	uint8_t sreg;
+
+	/*
+	 * A write still under way restarts from the first byte.  The
+	 * checksum goes out last, so until it does the EEPROM holds either
+	 * the old record or a mix of the two that fails the check.
+	 */
+	sreg = irq_save();
+	pending = *cal;
+	pending.magic = CALIB_MAGIC;
+	pending.sum = calib_sum(&pending);
+	nvm_write(&pending_job);
+	irq_restore(sreg);
+}
@@ -0,0 +1,38 @@
+/*
+ * Sensor calibration kept in the ATmega's internal EEPROM across boots.
+ *
+ * Licensed under AGPLv3.
+ *
+ * One struct calib_s at CALIB_EEPROM_ADDR, written after each good
+ * calibration so that the next boot can warm-start from it (see
+ * ahrs_init()).  Writing goes on in the background (see nvm.h), so
+ * calib_save() can be called from anywhere without blocking.  A record
+ * is only taken as valid if the magic and the checksum match, so a
+ * write cut short by a power loss only brings back the full calibration
+ * on the next boot.
+ */
+
+#ifndef _CALIB_H
+#define _CALIB_H
+
+#include <inttypes.h>
+
+#define CALIB_EEPROM_ADDR	0	/* Up to 64, see params.h */
+#define CALIB_MAGIC		0xca
+
+struct calib_s {
+	uint8_t magic;
+	uint8_t ref_res;	/* REF_RES the gyro sums below are for */
+	int32_t x_ref, y_ref;	/* Gyro bias sums */
+	int16_t statica[3];	/* Gravity and magnetic field references */
+	int16_t staticm[3];
+	int16_t mag[3];		/* Magnetometer offsets, see mag_refine() */
+	uint8_t sum;		/* Two's complement of the sum of the rest */
+};
+
+/* Returns 1 and fills in *cal if there's a valid record, 0 otherwise */
+uint8_t calib_load(struct calib_s *cal);
+/* Sets magic and sum and starts writing *cal out */
+void calib_save(const struct calib_s *cal);
+
+#endif /* _CALIB_H */
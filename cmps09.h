@@ -6,11 +6,40 @@
 
 #define CMPS09_ADDR 0x60
 
+/* Queue a register read, finished is called from the TWI interrupt */
+static inline void cmps09_read_bytes_async(struct twi_job_s *job,
+		uint8_t from, uint8_t count, uint8_t *out,
+		void (*finished)(void)) {
+	twi_read_regs(job, CMPS09_ADDR, from, count, out, finished);
+}
+
+/* Blocking version, only for boot-time use */
 static inline void cmps09_read_bytes(uint8_t from,
 		uint8_t count, uint8_t *out) {
-	i2c_send_byte(CMPS09_ADDR, from); /* Send start register number */
+	struct twi_job_s job;
+
+	cmps09_read_bytes_async(&job, from, count, out, 0);
+	twi_wait(&job);
+}
+
+/* Registers 10 to 21: magnetometer then accelerometer x, y, z, big endian,
+ * into raw vectors in the register order */
+static inline void cmps09_decode(const uint8_t *regs,
+		int16_t a[3], int16_t m[3]) {
+	m[0] = ((uint16_t) regs[0] << 8) | regs[1];
+	m[1] = ((uint16_t) regs[2] << 8) | regs[3];
+	m[2] = ((uint16_t) regs[4] << 8) | regs[5];
+	a[0] = ((uint16_t) regs[6] << 8) | regs[7];
+	a[1] = ((uint16_t) regs[8] << 8) | regs[9];
+	a[2] = ((uint16_t) regs[10] << 8) | regs[11];
+}
+
+/* Both vectors in one 12-byte read, blocking version */
+static inline void cmps09_read(int16_t a[3], int16_t m[3]) {
+	uint8_t regs[12];
 
-	i2c_request_bytes(CMPS09_ADDR, count, out);
+	cmps09_read_bytes(10, 12, regs);
+	cmps09_decode(regs, a, m);
 }
 
 /* This has been determined by averaging the magnetometer readings over a
@@ -0,0 +1,613 @@
+/*
+ * The flight controller: pilot modes and the attitude control loop.
+ *
+ * Licensed under AGPLv3.
+ *
+ * This is kept apart from pilot.c, which does the boot-time checks, the
+ * user interface and the telemetry, so that it can also be built for the
+ * host against the sil/ stubs (see sil/sil.c).
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "timer1.h"
+#include "actuators.h"
+#include "rx.h"
+#include "ahrs.h"
+#include "trig.h"
+#include "telemetry.h"
+#include "control.h"
+#include "mixer.h"
+#include "profile.h"
+#include "params.h"
+
+uint8_t modes =
+	(0 << MODE_MOTORS_ARMED) |
+	(0 << MODE_HEADINGHOLD_ENABLE) |
+	(0 << MODE_ADAPTIVE_ENABLE) |
+	(0 << MODE_AUTONEUTRAL_ENABLE) |
+	(0 << MODE_PANTILT_ENABLE) |
+	(0 << MODE_EMERGENCY);
+#define SET_ONLY 0
+
+static uint8_t prev_sw = 0;
+
+void modes_init(void) {
+	prev_sw = rx_gyro_sw;
+}
+
+void modes_update(void) {
+	uint8_t num;
+
+	if (likely(rx_gyro_sw == prev_sw))
+		return;
+	prev_sw = rx_gyro_sw;
+
+	num = ((uint16_t) rx_right_pot + 36) / 49;
+	modes &= ~(1 << num) | SET_ONLY;
+	modes |= prev_sw << num;
+}
+
+int constants_cnt = 0;
+
+/*
+ * Time from the sensor read behind the attitude estimate we've just
+ * used to the moment the first actuator values computed from it are
+ * set, in cycles.  avg is a running average over about 16 updates.
+ */
+struct telem_latency_s control_latency = { 0, 0, 0, 0 };
+
+/* The timestamp of the AHRS state control_update() last used */
+static uint32_t state_ts;
+
+/*
+ * When control_update() last ran, and the average time from there to
+ * the first actuator update after it: the mixing and, with
+ * CONTROL_CASCADE, the wait for the next gyro sample.
+ */
+static uint32_t update_ts, output_delay;
+static uint8_t output_pending;
+
+/*
+ * Only the first output after control_update() counts, the later ones
+ * from control_rate_update() go out with fresher gyro samples but the
+ * same attitude, its age would only measure the AHRS fusion period.
+ */
+static void latency_update(void) {
+	uint32_t now = timer_read();
+
+	if (!output_pending)
+		return;
+	output_pending = 0;
+
+	control_latency.cur = now - state_ts;
+	if (control_latency.cur > control_latency.max)
+		control_latency.max = control_latency.cur;
+	control_latency.avg += ((int32_t) (control_latency.cur -
+				control_latency.avg) + 8) >> 4;
+
+	output_delay += ((int32_t) (now - update_ts - output_delay) + 8) >> 4;
+}
+
+/*
+ * The attitude extrapolated from the estimate's timestamp to when the
+ * new actuator values are expected to be set, i.e. over how old the
+ * estimate is now plus output_delay, with the latest rates.  This is
+ * on top of the rate terms in control_update(), those are the loop's
+ * damping.  The lead is capped at CONTROL_LEAD_MAX in case the AHRS
+ * stalls.
+ */
+#ifndef CONTROL_LEAD_MAX
+# define CONTROL_LEAD_MAX (F_CPU / 25) /* 40ms */
+#endif
+
+static void control_predict(const struct ahrs_state_s *state,
+		int32_t *pitch, int32_t *roll, int16_t *yaw) {
+	int32_t age = update_ts - state->timestamp;
+	uint32_t lead = output_delay;
+	uint16_t ticks, k;
+
+	/* The estimate may be newer than update_ts by a little */
+	if (age > 0)
+		lead += age;
+	if (lead > CONTROL_LEAD_MAX)
+		lead = CONTROL_LEAD_MAX;
+	control_latency.lead = lead;
+	ticks = lead >> 8;
+
+	/* Like the gyro integration in ahrs.c: rate * cycles / 256 */
+	*pitch = state->pitch + mulsu_16_32(state->pitch_rate, ticks);
+	*roll = state->roll + mulsu_16_32(state->roll_rate, ticks);
+
+	/* yaw_rate is the change over yaw_rate_dt, k is the part of that
+	 * to add, Q15 */
+	*yaw = state->yaw;
+	if (!state->yaw_rate_dt)
+		return;
+	if (ticks > state->yaw_rate_dt)
+		ticks = state->yaw_rate_dt;
+	k = div_32_16((uint32_t) ticks << 15, state->yaw_rate_dt);
+	*yaw += (mulsu_16_32(state->yaw_rate, k) + 0x4000) >> 15;
+}
+
+#define CLAMP(x, mi, ma)	\
+	if (x < mi)		\
+		x = mi;		\
+	if (x > ma)		\
+		x = ma;
+
+/* Limit and set the actuators, out[] is changed */
+static void control_output(int32_t *out) {
+#ifdef MIXER_THRUST_LUT
+# define MIX_LINEARIZE(n, motor, mi, ma)	\
+	if (motor)				\
+		out[n] = mixer_thrust(out[n], mi, ma);
+#else
+# define MIX_LINEARIZE(n, motor, mi, ma)
+#endif
+#define LIMIT(n, p, r, y, motor, s, o, mi, ma)	\
+	MIX_LINEARIZE(n, motor, mi, ma)		\
+	CLAMP(out[n], mi, ma);
+#define IDLE(n, p, r, y, motor, s, o, mi, ma)	\
+		out[n] = (motor) ? 0 : (o);
+#define SET(n, p, r, y, motor, s, o, mi, ma)	\
+	actuator_set(n, (uint16_t) out[n]);
+	MIXER(LIMIT)
+	if (unlikely(!(modes & (1 << MODE_MOTORS_ARMED)))) {
+		MIXER(IDLE)
+	}
+	MIXER(SET)
+	actuators_fire();
+
+	latency_update();
+}
+
+/* The plain mix of the throttle and the pitch, roll and yaw commands */
+static void control_mix(int32_t *out, int16_t throttle,
+		int16_t pitch, int16_t roll, int16_t yaw) {
+#define DIRECT_MIX(n, p, r, y, motor, s, o, mi, ma)			\
+	out[n] = MIX_SCALE(MIX_SUM((motor) ? (int32_t) throttle : 0,	\
+				pitch, roll, yaw, p, r, y), s, o);
+	MIXER(DIRECT_MIX)
+}
+
+#ifdef CONTROL_CASCADE
+/*
+ * Cascaded pitch and roll control outside of the adaptive mode.  The
+ * outer loop in control_update() runs on every new attitude estimate
+ * and turns the attitude error into rate setpoints, the inner loop in
+ * control_rate_update() runs a PID on the rate error for every gyro
+ * sample and sets the actuators with the throttle and yaw command last
+ * computed by the outer loop.  With the default gains, and no I or D
+ * terms, the two together are the old attitude + rate / 4 law.
+ *
+ * The I term integrates over the time since the previous sample in
+ * 64us ticks, it's clamped to params.i_max and stops integrating in
+ * the direction that would push the command further into its limit.
+ * It's reset while disarmed or at low throttle, so it doesn't wind up
+ * on the ground.  The D term works on the measured rate, not the error,
+ * after a one-pole low-pass, and is per sample so it needs retuning
+ * with the gyro rate.  The gains and limits are run-time parameters,
+ * see params.h.
+ */
+#ifndef CASCADE_D_FILTER
+# define CASCADE_D_FILTER 2	/* Low-pass time constant, log2 samples */
+#endif
+/* Throttle below which the I term is held at zero */
+#ifndef CASCADE_I_THROTTLE
+# define CASCADE_I_THROTTLE 0x1000
+#endif
+
+struct rate_pid_s {
+	int16_t setpoint;
+	int32_t iterm;		/* Command << 12 */
+	int32_t rate_f;		/* Filtered rate << 4 */
+	int32_t prev_f;
+};
+
+static struct rate_pid_s pitch_pid, roll_pid;
+static int16_t cascade_throttle, cascade_yaw;
+static uint8_t cascade_on;
+static uint32_t cascade_ts;
+
+static void rate_pid_setpoint(struct rate_pid_s *pid, int16_t att_err) {
+	int32_t sp = ((int32_t) att_err * params.att_p) >> 2;
+
+	CLAMP(sp, -params.rate_max, params.rate_max);
+	pid->setpoint = sp;
+}
+
+static int16_t rate_pid_update(struct rate_pid_s *pid, int16_t rate,
+		uint16_t dt, uint8_t hold) {
+	int32_t err = (int32_t) pid->setpoint - rate, d, out;
+
+	pid->rate_f += (((int32_t) rate << 4) - pid->rate_f) >>
+		CASCADE_D_FILTER;
+	d = pid->rate_f - pid->prev_f;
+	pid->prev_f = pid->rate_f;
+
+	if (hold)
+		pid->iterm = 0;
+
+	out = ((err * params.rate_p) >> 8) + (pid->iterm >> 12) -
+		((d * params.rate_d) >> 8);
+
+	if (out > params.out_max) {
+		out = params.out_max;
+		if (err > 0)
+			hold = 1;
+	} else if (out < -params.out_max) {
+		out = -params.out_max;
+		if (err < 0)
+			hold = 1;
+	}
+
+	if (!hold) {
+		pid->iterm += ((err * dt) >> 4) * params.rate_i;
+		CLAMP(pid->iterm, -((int32_t) params.i_max << 12),
+				(int32_t) params.i_max << 12);
+	}
+
+	return out;
+}
+
+/* Call on every new gyro sample, i.e. on EVENT_GYRO */
+void control_rate_update(void) {
+	PROF_START(PROF_RATE);
+	int32_t out[MIXER_OUTPUTS];
+	struct ahrs_rates_s rates;
+	int16_t pitch, roll;
+	uint32_t now = timer_read(), dt;
+	uint8_t hold;
+
+	dt = (now - cascade_ts) >> 10;
+	cascade_ts = now;
+	if (unlikely(!cascade_on)) {
+		PROF_END(PROF_RATE);
+		return;
+	}
+	if (unlikely(dt > 511))
+		dt = 511;
+
+	ahrs_read_rates(&rates);
+
+	hold = !(modes & (1 << MODE_MOTORS_ARMED)) ||
+		cascade_throttle < CASCADE_I_THROTTLE;
+	pitch = rate_pid_update(&pitch_pid, rates.pitch, dt, hold);
+	roll = rate_pid_update(&roll_pid, rates.roll, dt, hold);
+
+	control_mix(out, cascade_throttle, pitch, roll, cascade_yaw);
+	control_output(out);
+	PROF_END(PROF_RATE);
+}
+#endif
+
+void control_update(void) {
+	PROF_START(PROF_CONTROL);
+	int16_t cur_pitch, cur_roll, cur_yaw, raw_pitch, raw_roll;
+	int16_t dest_pitch, dest_roll, dest_yaw, base_throttle, z, yaw;
+	int32_t pitch, roll;
+	uint16_t thr;
+	struct ahrs_state_s state;
+
+	static uint8_t yaw_deadband_pos = 0x80;
+	static uint8_t roll_deadband_pos = 0x80;
+	static uint8_t pitch_deadband_pos = 0x80;
+
+	static int16_t neutral_pitch = 0;
+	static int16_t neutral_roll = 0;
+	static int16_t neutral_yaw = 0;
+
+	uint8_t co_right = rx_co_right, cy_right = rx_cy_right,
+		cy_front = rx_cy_front, co_throttle = rx_co_throttle;
+	uint8_t db = params.deadband;
+
+	/* Motors (top view):
+	 * (A)_   .    _(B)
+	 *    '#_ .  _#'
+	 *      '#__#'
+	 * - - - _##_ - - - - pitch axis
+	 *     _#'. '#_
+	 *   _#'  .   '#_
+	 * (C)    .     (D)
+	 *        |
+	 *        '--- roll axis
+	 *
+	 * or whatever mixer.h has for the airframe.
+	 */
+	int32_t out[MIXER_OUTPUTS];
+
+	update_ts = timer_read();
+	output_pending = 1;
+	rx_no_signal = (rx_no_signal < 255) ? rx_no_signal + 1 : 255;
+
+	/* Yaw stick deadband in heading-hold mode */
+	if ((modes & (1 << MODE_HEADINGHOLD_ENABLE)) ||
+			(modes & (1 << MODE_ADAPTIVE_ENABLE))) {
+		co_right += 0x80 - yaw_deadband_pos;
+		if (co_right >= 0x80 - db && co_right <= 0x80 + db)
+			co_right = 0x80;
+		else if (co_right > 0x80)
+			co_right -= db;
+		else
+			co_right += db;
+	} else
+		yaw_deadband_pos = co_right;
+
+	/* Roll stick deadband in velocity-hold mode */
+	if (modes & (1 << MODE_AUTONEUTRAL_ENABLE)) {
+		cy_right += 0x80 - roll_deadband_pos;
+		if (cy_right >= 0x80 - db && cy_right <= 0x80 + db)
+			cy_right = 0x80;
+		else if (cy_right > 0x80)
+			cy_right -= db;
+		else
+			cy_right += db;
+	} else
+		roll_deadband_pos = cy_right;
+
+	/* Pitch stick deadband in velocity-hold mode */
+	if (modes & (1 << MODE_AUTONEUTRAL_ENABLE)) {
+		cy_front += 0x80 - pitch_deadband_pos;
+		if (cy_front >= 0x80 - db && cy_front <= 0x80 + db)
+			cy_front = 0x80;
+		else if (cy_front > 0x80)
+			cy_front -= db;
+		else
+			cy_front += db;
+	} else
+		pitch_deadband_pos = cy_front;
+
+	ahrs_read(&state);
+	state_ts = state.timestamp;
+	control_predict(&state, &pitch, &roll, &yaw);
+	raw_pitch = (pitch + 32768) >> 16;
+	raw_roll = (roll + 32768) >> 16;
+	cur_pitch = raw_pitch + ((state.pitch_rate + 2) >> 2);
+	cur_roll = raw_roll + ((state.roll_rate + 2) >> 2);
+	cur_yaw = yaw + (state.yaw_rate << 5);
+	z = dcm_z(&state.dcm);
+
+#ifdef CONTROL_CASCADE
+	/* The rate loop does the damping outside of the adaptive mode */
+	if (!(modes & (1 << MODE_ADAPTIVE_ENABLE))) {
+		cur_pitch = raw_pitch;
+		cur_roll = raw_roll;
+	}
+#endif
+
+	if (modes & (1 << MODE_AUTONEUTRAL_ENABLE)) {
+		/* TODO */
+		if (raw_pitch > neutral_pitch && state.acceleration[0] < 0)
+			neutral_pitch -= state.acceleration[0] *
+				(raw_pitch - neutral_pitch);
+		if (raw_pitch < neutral_pitch && state.acceleration[0] > 0)
+			neutral_pitch += state.acceleration[0] *
+				(raw_pitch - neutral_pitch);
+
+		if (raw_roll > neutral_roll && state.acceleration[1] < 0)
+			neutral_roll -= state.acceleration[1] *
+				(raw_roll - neutral_roll);
+		if (raw_roll < neutral_roll && state.acceleration[1] > 0)
+			neutral_roll += state.acceleration[1] *
+				(raw_roll - neutral_roll);
+	}
+
+	if (modes & (1 << MODE_PANTILT_ENABLE)) {
+		co_right = 0x80;
+		cy_right = 0x80;
+		cy_front = 0x80;
+	}
+
+	dest_pitch = neutral_pitch + ((int16_t) cy_front << 5) - (128 << 5);
+	dest_roll = neutral_roll + ((int16_t) cy_right << 5) - (128 << 5);
+	neutral_yaw += ((int16_t) co_right << 2) - (128 << 2);
+	dest_yaw = neutral_yaw;
+
+	base_throttle = co_throttle << 7;
+	/* Adjust throttle for the current tilt so we don't lose altitude
+	 * whenever accelerating.  z is the vertical component of the
+	 * vehicle's up vector from the AHRS's rotation matrix.  */
+	if (z < 0) {
+		if (base_throttle > 0x3000)
+			base_throttle = 0x3000; /* XXX */
+	} else {
+		if (z < (1 << 14))
+			z = 1 << 14;
+		/* Up to 2x, more than int16_t holds from a full stick */
+		thr = div_32_16((uint32_t) base_throttle << 15, z);
+		base_throttle = thr > 0x7fff ? 0x7fff : thr;
+	}
+
+	dest_pitch = -(cur_pitch + dest_pitch) / 1;
+	dest_roll = -(cur_roll + dest_roll) / 1;
+	dest_yaw = -(cur_yaw - dest_yaw) / 1;
+
+	dest_yaw <<= 2;
+
+#if 0
+	/* Some easing */
+	if (dest_pitch < 0x400 && dest_pitch > -0x400)
+		dest_pitch >>= 2;
+	else if (dest_pitch > 0)
+		dest_pitch -= 0x300;
+	else
+		dest_pitch += 0x300;
+	if (dest_roll < 0x400 && dest_roll > -0x400)
+		dest_roll >>= 2;
+	else if (dest_roll > 0)
+		dest_roll -= 0x300;
+	else
+		dest_roll += 0x300;
+#endif
+
+	if (modes & (1 << MODE_HEADINGHOLD_ENABLE)) {
+		CLAMP(dest_yaw, -params.yaw_max, params.yaw_max);
+	} else {
+		dest_yaw = (128 << 5) - ((int16_t) co_right << 5);
+		if (modes & (1 << MODE_ADAPTIVE_ENABLE)) {
+			dest_yaw -= state.yaw_rate << 4;
+			CLAMP(dest_yaw, -params.yaw_max, params.yaw_max);
+		}
+		neutral_yaw = cur_yaw;
+	}
+
+	if (modes & (1 << MODE_ADAPTIVE_ENABLE)) {
+#if 0
+		static int16_t prev_diff_pitch = 0;
+		static int16_t prev_diff_roll = 0;
+		int16_t diff[4];
+
+		prev_diff_pitch += dest_pitch >> 4;
+		prev_diff_roll += dest_roll >> 4;
+
+		dest_pitch = prev_diff_pitch;
+		dest_roll = prev_diff_roll;
+#else
+		/* Our motors are currently modelled as OUTPUT = a * INPUT,
+		 * or OUTPUT = a * gain_lut[INPUT] with MIXER_THRUST_LUT.
+		 * TODO: use the OUTPUT = b + a * INPUT model.  The a's
+		 * start out from the mixer's scale.
+		 */
+#define INIT_BASE(n, p, r, y, motor, s, o, mi, ma)	\
+		[n] = ((s) - 8) * 0x800,
+#define INIT_DIFF(n, p, r, y, motor, s, o, mi, ma)	\
+		[n] = ((s) - 8) * 0x400,
+		static int16_t throttle_base[MIXER_OUTPUTS] =
+			{ MIXER(INIT_BASE) };
+		static int16_t throttle_diff[MIXER_OUTPUTS] =
+			{ MIXER(INIT_DIFF) };
+
+		/*
+		 * The loop gain is estimated from exponentially weighted
+		 * running sums instead of a window of the past inputs and
+		 * rates.  Each motor's input goes through a one-pole lag
+		 * first (kept x4, its mean delay of 3 cycles stands in
+		 * for the response time) and then into a sum with a
+		 * 1 / (1 << ADAPT_SHIFT) decay, taking 12 / (1 << ADAPT_SHIFT)
+		 * of each new value (3/2 at the default 1/8) so that a
+		 * steady input sums up to the same 12x it did over the old
+		 * 12-cycle window, whatever the decay.
+		 * The rate sums take the rate increments the same way, so
+		 * they track the rate change over about the same time.
+		 */
+#ifndef ADAPT_SHIFT
+# define ADAPT_SHIFT 3
+#endif
+#define EW_ADD(sum, x)	\
+		sum += (((int32_t) (x) * 12) >> ADAPT_SHIFT) -	\
+			(sum >> ADAPT_SHIFT)
+		static int32_t motor_lag[MIXER_OUTPUTS];
+		static int32_t motor_sum[MIXER_OUTPUTS];
+		static int16_t prev_pitch_rate, prev_roll_rate,
+			       prev_yaw_rate;
+		static int32_t pitch_sum, roll_sum, yaw_sum;
+
+		int16_t diff[MIXER_OUTPUTS], sum;
+		int32_t pitch_gain, roll_gain, yaw_gain;
+		int32_t motor_gain[MIXER_OUTPUTS][2];
+#endif
+
+		/* Servos get the plain mix */
+#define ADAPT_MIX(n, p, r, y, motor, s, o, mi, ma)			\
+		if (motor) {						\
+			diff[n] = MIX_SUM(0, dest_pitch, dest_roll,	\
+					dest_yaw, p, r, y);		\
+			out[n] = ((((int32_t) base_throttle *		\
+					((int32_t) throttle_base[n] +	\
+					 0x4000)) >> 1) +		\
+					(int32_t) diff[n] *		\
+					(throttle_diff[n] + 0x2000)) >> 13; \
+		} else							\
+			out[n] = MIX_SCALE(MIX_SUM((int32_t) 0,		\
+					dest_pitch, dest_roll,		\
+					dest_yaw, p, r, y), s, o);
+		MIXER(ADAPT_MIX)
+
+		/* XXX: would it be better to use the pitch difference
+		 * instead of the pitch rate? */
+		EW_ADD(pitch_sum, state.pitch_rate - prev_pitch_rate);
+		EW_ADD(roll_sum, state.roll_rate - prev_roll_rate);
+		EW_ADD(yaw_sum, state.yaw_rate - prev_yaw_rate);
+		prev_pitch_rate = state.pitch_rate;
+		prev_roll_rate = state.roll_rate;
+		prev_yaw_rate = state.yaw_rate;
+#define ADAPT_INPUT(n, p, r, y, motor, s, o, mi, ma)			\
+		if (motor) {						\
+			motor_lag[n] += diff[n] - (motor_lag[n] >> 2);	\
+			EW_ADD(motor_sum[n], motor_lag[n] >> 2);	\
+		}
+		MIXER(ADAPT_INPUT)
+
+		/* The control loop gain over about 240ms */
+		pitch_gain = pitch_sum;
+		roll_gain = roll_sum;
+		yaw_gain = yaw_sum;
+		/* TODO: detect or calculate the right value based on
+		 * the propeller parameters.  The problem with hardcoding
+		 * any value is that it won't account for any tilt of
+		 * the motor shaft due to construction characteristics or
+		 * physical wear */
+		yaw_gain <<= 4;
+
+#define ADAPT_GAIN(n, p, r, y, motor, s, o, mi, ma)			\
+		if (motor) {						\
+			motor_gain[n][0] = motor_sum[n];		\
+			motor_gain[n][1] = MIX_SUM(0, pitch_gain,	\
+					roll_gain, yaw_gain, p, r, y);	\
+			motor_gain[n][1] -= (motor_gain[n][0] + 16) >> 5; \
+		}
+		MIXER(ADAPT_GAIN)
+
+		/* Update the factors */
+
+#define SUM_DIFF(n, p, r, y, motor, s, o, mi, ma)	\
+		+ ((motor) ? throttle_diff[n] : 0)
+#define ADAPT_DIFF(n, p, r, y, motor, s, o, mi, ma)			\
+		if ((motor) && (motor_gain[n][0] > params.mgain ||	\
+				motor_gain[n][0] < -params.mgain)) {	\
+			if (motor_gain[n][0] > 0)			\
+				motor_gain[n][1] = -motor_gain[n][1];	\
+			throttle_diff[n] +=				\
+				((motor_gain[n][1] + 512) >> 10) - sum;	\
+			CLAMP(throttle_diff[n], -0x1800, 0x4000);	\
+		}
+		sum = MIX_AVG(0 MIXER(SUM_DIFF));
+		MIXER(ADAPT_DIFF)
+
+#define SUM_BASE(n, p, r, y, motor, s, o, mi, ma)	\
+		+ ((motor) ? throttle_base[n] : 0)
+#define ADAPT_BASE(n, p, r, y, motor, s, o, mi, ma)			\
+		if (motor) {						\
+			throttle_base[n] += ((diff[n] + 32) >> 6) - sum; \
+			CLAMP(throttle_base[n], -0x1800, 0x4000);	\
+		}
+		sum = MIX_AVG(0 MIXER(SUM_BASE));
+		MIXER(ADAPT_BASE)
+
+#ifdef CONTROL_CASCADE
+		cascade_on = 0;
+#endif
+		control_output(out);
+	} else {
+#ifdef CONTROL_CASCADE
+		/* Outer loop, the actuators are set by the inner one */
+		if (!cascade_on)
+			pitch_pid.iterm = roll_pid.iterm = 0;
+		rate_pid_setpoint(&pitch_pid, dest_pitch);
+		rate_pid_setpoint(&roll_pid, dest_roll);
+		cascade_throttle = base_throttle;
+		cascade_yaw = dest_yaw;
+		cascade_on = 1;
+#else
+		control_mix(out, base_throttle,
+				dest_pitch, dest_roll, dest_yaw);
+		control_output(out);
+#endif
+	}
+
+	if (constants_cnt ++ >= 25) /* About half a sec */
+		constants_cnt = 0;
+	PROF_END(PROF_CONTROL);
+}
@@ -0,0 +1,50 @@
+/*
+ * The flight controller: pilot modes and the attitude control loop.
+ *
+ * Licensed under AGPLv3.
+ */
+
+/* The modes are a set of boolean switches that can be set or reset/cleared
+ * using the "gyro switch" on the transmitter.  Every move of the switch
+ * changes the mode pointed at by the "CH5" potentiometer which is on the
+ * right side of the transmitter.
+ */
+enum modes_e {
+	/* Arm/disarm the motors (dangerous!) */
+	MODE_MOTORS_ARMED,
+	/* Enable compass-based heading-hold, pitch/roll hold is always on */
+	MODE_HEADINGHOLD_ENABLE,
+	/* Adaptively change motor output differences, don't use absolute
+	 * values.  HEADINGHOLD is forced on when this is on.  */
+	MODE_ADAPTIVE_ENABLE,
+	/* Try to keep enhancing the neutral attitude based on acceleration */
+	MODE_AUTONEUTRAL_ENABLE,
+	/* TODO: Cyclic stick controls the camera pan&tilt instead of the
+	 * vehicle's attitude */
+	MODE_PANTILT_ENABLE,
+	/* TODO: Emergency land or return home, panic, scream! */
+	MODE_EMERGENCY,
+};
+extern uint8_t modes;
+
+/* Control updates since the last half second mark, cycles 0 to 25 */
+extern int constants_cnt;
+extern struct telem_latency_s control_latency;
+
+void modes_init(void);
+void modes_update(void);
+void control_update(void);
+
+/*
+ * With -DCONTROL_CASCADE the pitch and roll rate loop runs apart from
+ * control_update(), on every gyro sample, see control.c.  Wait for
+ * CONTROL_RATE_EVENTS as well as EVENT_AHRS and call
+ * control_rate_update() on them, after control_update() if both came.
+ */
+#ifdef CONTROL_CASCADE
+void control_rate_update(void);
+# define CONTROL_RATE_EVENTS	(1 << EVENT_GYRO)
+#else
+static inline void control_rate_update(void) {}
+# define CONTROL_RATE_EVENTS	0
+#endif
@@ -0,0 +1,19 @@
+/*
+ * Simple event flags used to wake up the main task from interrupt
+ * context.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "events.h"
+
+volatile uint8_t events = 0;
+
+void events_init(void) {
+	/* Idle mode keeps the timers, ADC, TWI and UART running */
+	set_sleep_mode(SLEEP_MODE_IDLE);
+}
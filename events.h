@@ -0,0 +1,49 @@
+/*
+ * Simple event flags used to wake up the main task from interrupt
+ * context.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include "hal.h"
+
+enum event_e {
+	EVENT_AHRS,	/* New attitude estimate published */
+	EVENT_GYRO,	/* New gyro sample / rates */
+};
+
+extern volatile uint8_t events;
+
+void events_init(void);
+
+/* Safe from any context */
+static inline void event_post(uint8_t ev) {
+	uint8_t sreg = irq_save();
+
+	events |= 1 << ev;
+	irq_restore(sreg);
+}
+
+/*
+ * Sleep in idle mode until any of the events in mask is posted, clear
+ * and return those.  Must be called with interrupts enabled.  The sei
+ * right before the sleep instruction guarantees that an event posted
+ * after we've checked the flags will still wake us up.
+ */
+static inline uint8_t event_wait(uint8_t mask) {
+	uint8_t ev;
+
+	for (;;) {
+		cli();
+		ev = events & mask;
+		if (ev) {
+			events &= ~ev;
+			sei();
+			return ev;
+		}
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+}
@@ -0,0 +1,67 @@
+/*
+ * Fixed-point multiply and divide kernels.
+ *
+ * Licensed under AGPLv3.
+ *
+ * On the AVR these are the hand-written routines in fixmul.S, which
+ * use the hardware multiplier directly where avr-gcc would promote the
+ * operands and call the generic 32-bit multiply and divide.  Elsewhere
+ * (sil/) they're the plain C expressions, giving the same results.
+ */
+
+#ifndef _FIXMUL_H
+#define _FIXMUL_H
+
+#include <inttypes.h>
+
+#ifdef __AVR__
+/* a * b, exact */
+extern int32_t mul_16_32(int16_t a, int16_t b);
+extern int32_t mulsu_16_32(int16_t a, uint16_t b);
+extern uint32_t umul_16_32(uint16_t a, uint16_t b);
+/* The low 32 bits of a * b */
+extern int32_t mul_32_16(int32_t a, uint16_t b);
+/* Rounded Q15 products: (a * b [+ c * d [+ e * f]] + 0x3fff) >> 15 */
+extern int16_t mul_15(int16_t a, int16_t b);
+extern int16_t mac2_15(int16_t a, int16_t b, int16_t c, int16_t d);
+extern int16_t mac3_15(int16_t a, int16_t b, int16_t c, int16_t d,
+		int16_t e, int16_t f);
+/* n / d, the quotient must fit in 16 bits */
+extern uint16_t div_32_16(uint32_t n, uint16_t d);
+#else
+static inline int32_t mul_16_32(int16_t a, int16_t b) {
+	return (int32_t) a * b;
+}
+
+static inline int32_t mulsu_16_32(int16_t a, uint16_t b) {
+	return (int32_t) a * b;
+}
+
+static inline uint32_t umul_16_32(uint16_t a, uint16_t b) {
+	return (uint32_t) a * b;
+}
+
+static inline int32_t mul_32_16(int32_t a, uint16_t b) {
+	return (uint32_t) a * b;
+}
+
+static inline int16_t mul_15(int16_t a, int16_t b) {
+	return ((int32_t) a * b + 0x3fff) >> 15;
+}
+
+static inline int16_t mac2_15(int16_t a, int16_t b, int16_t c, int16_t d) {
+	return ((int32_t) a * b + (int32_t) c * d + 0x3fff) >> 15;
+}
+
+static inline int16_t mac3_15(int16_t a, int16_t b, int16_t c, int16_t d,
+		int16_t e, int16_t f) {
+	return ((int32_t) a * b + (int32_t) c * d + (int32_t) e * f +
+			0x3fff) >> 15;
+}
+
+static inline uint16_t div_32_16(uint32_t n, uint16_t d) {
+	return n / d;
+}
+#endif
+
+#endif /* _FIXMUL_H */
@@ -0,0 +1,316 @@
+/*
+ * LS20126 GPS receiver, see gps.h.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "hal.h"
+#include "timer1.h"
+#include "ahrs.h"
+#include "trig.h"
+#include "gps.h"
+
+#ifdef GPS
+
+enum gps_state_e {
+	GPS_IDLE,	/* Waiting for a '$' */
+	GPS_TYPE,	/* Talker and sentence type */
+	GPS_FIELD,
+	GPS_CHECK_HI,	/* The two hex digits after the '*' */
+	GPS_CHECK_LO,
+	GPS_EOL,	/* Eating the "\r\n" */
+};
+
+#define GPS_GGA		1
+#define GPS_RMC		2
+
+/* Longest sentence, the NMEA limit is 82 */
+#define GPS_MAX_LEN	100
+
+static uint8_t state, sentence, field, len, sum, check;
+
+/* The current field: integer and fractional part, up to want decimals */
+static uint32_t ipart, fpart;
+static uint8_t fdigits, want, neg, letter;
+
+/* The fix being put together and whether its GGA is in */
+static struct gps_fix_s next;
+static uint8_t have_gga;
+static uint32_t sentence_ts;
+
+/*
+ * The fields that gps_read() converts, the divisions and the sin/cos
+ * would stretch the RX interrupt and whatever it delays
+ */
+struct gps_raw_s {
+	uint16_t lat_dm, lon_dm;	/* ddmm and dddmm */
+	uint32_t lat_mf, lon_mf;	/* The minutes' 5 decimals */
+	uint8_t south, west;
+};
+static struct gps_raw_s next_raw;
+
+static struct gps_fix_s fix;
+static struct gps_raw_s fix_raw;
+static uint8_t fix_count;
+volatile uint16_t gps_errors;
+
+/* Decimals kept for each field that's used, the others get none */
+static uint8_t field_decimals(void) {
+	switch (sentence) {
+	case GPS_GGA:
+		switch (field) {
+		case 1:		/* hhmmss.sss */
+			return 3;
+		case 2:		/* ddmm.mmmmm */
+		case 4:
+			return 5;
+		case 8:		/* HDOP */
+		case 9:		/* Altitude in m */
+			return 2;
+		}
+		break;
+	case GPS_RMC:
+		switch (field) {
+		case 1:
+			return 3;
+		case 7:		/* Speed in knots */
+		case 8:		/* Course in deg */
+			return 2;
+		}
+		break;
+	}
+
+	return 0;
+}
+
+static void field_start(void) {
+	ipart = fpart = 0;
+	fdigits = 0xff;
+	neg = letter = 0;
+	want = field_decimals();
+}
+
+static uint32_t field_value(void) {
+	uint8_t i;
+	uint32_t val = ipart;
+
+	for (i = 0; i < want; i ++)
+		val *= 10;
+	return val + fpart;
+}
+
+static void field_end(void) {
+	/* Pad the fraction to want decimals */
+	if (fdigits == 0xff)
+		fdigits = 0;
+	for (; fdigits < want; fdigits ++)
+		fpart *= 10;
+
+	if (sentence == GPS_GGA)
+		switch (field) {
+		case 1:
+			next.utc = field_value();
+			break;
+		case 2:
+			next_raw.lat_dm = ipart;
+			next_raw.lat_mf = fpart;
+			break;
+		case 3:
+			next_raw.south = letter == 'S';
+			break;
+		case 4:
+			next_raw.lon_dm = ipart;
+			next_raw.lon_mf = fpart;
+			break;
+		case 5:
+			next_raw.west = letter == 'W';
+			break;
+		case 6:
+			next.quality = ipart;
+			break;
+		case 7:
+			next.sats = ipart;
+			break;
+		case 8:
+			next.hdop = field_value();
+			break;
+		case 9:
+			next.alt = neg ? -field_value() : field_value();
+			break;
+		}
+	else if (sentence == GPS_RMC)
+		switch (field) {
+		case 1:
+			/* Has to be the same epoch as the GGA */
+			if (field_value() != next.utc)
+				have_gga = 0;
+			break;
+		case 2:
+			if (letter != 'A')
+				have_gga = 0;
+			break;
+		case 7:
+			/* 1 knot == 51.4444 cm/s, 0.514444 * 65536 == 33715 */
+			next.speed = (umul_16_32(field_value(), 33715) +
+					0x8000) >> 16;
+			break;
+		case 8:
+			/* deg * 100 to 65536 == 360 deg: 65536 / 36000 * 32768
+			 * == 59652 */
+			next.course = (field_value() * 59652 + 0x4000) >> 15;
+			break;
+		}
+}
+
+static void sentence_end(void) {
+	if (sentence == GPS_GGA) {
+		next.timestamp = sentence_ts;
+		have_gga = next.quality > 0;
+		return;
+	}
+	if (!have_gga)
+		return;
+	have_gga = 0;
+
+	/* Nothing can interrupt us here */
+	fix = next;
+	fix_raw = next_raw;
+	if (!++ fix_count)
+		fix_count = 1;
+}
+
+static uint8_t hex_digit(uint8_t ch) {
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	if (ch >= 'A' && ch <= 'F')
+		return ch - 'A' + 10;
+	return 0xff;
+}
+
+/* Called from the RX interrupt with interrupts disabled */
+uint8_t gps_input(uint8_t ch) {
+	uint8_t d;
+
+	if (ch == '$') {
+		/* A new sentence no matter what came before */
+		sentence_ts = timer_read();
+		state = GPS_TYPE;
+		sentence = GPS_GGA | GPS_RMC;
+		len = sum = 0;
+		return 1;
+	}
+
+	if (state == GPS_IDLE)
+		return 0;
+
+	if (unlikely(++ len > GPS_MAX_LEN)) {
+		state = GPS_IDLE;
+		return 1;
+	}
+
+	switch (state) {
+	case GPS_TYPE:
+		sum ^= ch;
+		if (ch == ',') {
+			/* "GPGGA" or "GNRMC" etc., anything else is skipped */
+			if (len != 6 || (sentence != GPS_GGA &&
+						sentence != GPS_RMC))
+				sentence = 0;
+			field = 1;
+			field_start();
+			state = GPS_FIELD;
+		} else if (len >= 3 && len <= 5) {
+			if (ch != "GGA"[len - 3])
+				sentence &= ~GPS_GGA;
+			if (ch != "RMC"[len - 3])
+				sentence &= ~GPS_RMC;
+		}
+		break;
+
+	case GPS_FIELD:
+		if (ch == '*') {
+			state = GPS_CHECK_HI;
+			if (sentence)
+				field_end();
+			break;
+		}
+		sum ^= ch;
+		if (!sentence)
+			break;
+
+		d = ch - '0';
+		if (ch == ',') {
+			field_end();
+			field ++;
+			field_start();
+		} else if (d < 10) {
+			if (fdigits == 0xff) {
+				if (ipart < 0x0ccccccc)
+					ipart = ipart * 10 + d;
+			} else if (fdigits < want) {
+				fpart = fpart * 10 + d;
+				fdigits ++;
+			}
+		} else if (ch == '.')
+			fdigits = 0;
+		else if (ch == '-')
+			neg = 1;
+		else
+			letter = ch;
+		break;
+
+	case GPS_CHECK_HI:
+		check = hex_digit(ch) << 4;
+		state = GPS_CHECK_LO;
+		break;
+
+	case GPS_CHECK_LO:
+		check |= hex_digit(ch);
+		state = GPS_EOL;
+		if (check != sum) {
+			gps_errors ++;
+			have_gga = 0;
+		} else if (sentence)
+			sentence_end();
+		break;
+
+	case GPS_EOL:
+		if (ch == '\n')
+			state = GPS_IDLE;
+		break;
+	}
+
+	return 1;
+}
+
+/* ddmm.mmmmm to 1e-7 deg */
+static int32_t gps_angle(uint16_t dm, uint32_t mf) {
+	uint16_t deg = dm / 100;
+	uint32_t min = dm - deg * 100;
+
+	return deg * 10000000l + ((min * 100000 + mf) * 5 + 1) / 3;
+}
+
+uint8_t gps_read(struct gps_fix_s *ret) {
+	struct gps_raw_s raw;
+	uint8_t sreg = irq_save(), count;
+
+	*ret = fix;
+	raw = fix_raw;
+	count = fix_count;
+	irq_restore(sreg);
+
+	ret->lat = gps_angle(raw.lat_dm, raw.lat_mf);
+	if (raw.south)
+		ret->lat = -ret->lat;
+	ret->lon = gps_angle(raw.lon_dm, raw.lon_mf);
+	if (raw.west)
+		ret->lon = -ret->lon;
+
+	return count;
+}
+
+#endif
@@ -0,0 +1,55 @@
+/*
+ * LS20126 GPS receiver on the UART's RX line.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Only built in with -DGPS (see the Makefile), otherwise gps_input()
+ * is a no-op and the RX line is all for the command handler.  The GPS
+ * shares the USART with the modem, so it has to be set to the same
+ * 115200 baud ($PMTK251) and to output GGA and RMC ($PMTK314), which
+ * the LS20126 keeps in its flash.  Its binary mode isn't handled.
+ *
+ * The NMEA sentences are parsed a byte at a time from the RX interrupt:
+ * everything from a '$' to the end of the line goes to the GPS, the
+ * rest is queued for the handler set with serial_set_handler().  While
+ * command frames are coming in nothing goes to the GPS, see uart.c.
+ * There's no line buffer, each field is accumulated in fixed-point as
+ * it comes in and scaled at its ',', and the checksum runs along.  The
+ * divisions for the latitude and longitude are left to gps_read(),
+ * outside of the interrupt.
+ * A fix is made of the GGA and RMC sentences of one epoch (the same
+ * UTC time) and published in one go once the RMC's checksum matches
+ * and both say there's a fix, with the time its GGA's '$' came in.
+ * Without a fix nothing gets published, check the timestamp's age.
+ */
+
+#ifndef _GPS_H
+#define _GPS_H
+
+#include <inttypes.h>
+
+struct gps_fix_s {
+	uint32_t timestamp;	/* timer_read() at the GGA's '$' */
+	uint32_t utc;		/* hhmmss.sss as the integer hhmmsssss */
+	int32_t lat, lon;	/* 1e-7 deg, north and east positive */
+	int32_t alt;		/* cm above mean sea level */
+	uint16_t speed;		/* cm/s over the ground */
+	uint16_t course;	/* 65536 == 360 deg, like the AHRS yaw */
+	uint16_t hdop;		/* 1/100 */
+	uint8_t quality;	/* GGA fix quality: 1 GPS, 2 DGPS */
+	uint8_t sats;
+};
+
+#ifdef GPS
+/* Returns 1 if ch was part of a sentence */
+uint8_t gps_input(uint8_t ch);
+/* Copies out the latest fix, returns its number, 0 before the first */
+uint8_t gps_read(struct gps_fix_s *fix);
+
+extern volatile uint16_t gps_errors;	/* Sentences with a bad checksum */
+#else
+static inline uint8_t gps_input(uint8_t ch) { return 0; }
+static inline uint8_t gps_read(struct gps_fix_s *fix) { return 0; }
+#endif
+
+#endif /* _GPS_H */
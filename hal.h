@@ -0,0 +1,55 @@
+/*
+ * Hardware abstraction.
+ *
+ * Licensed under AGPLv3.
+ *
+ * The drivers' headers are the interface everything else is written
+ * against:
+ *
+ *   timer1.h	timer_read() time stamps in F_CPU ticks, timeouts
+ *   adc.h	the gyro sampling engine and single conversions
+ *   twi.h	queued I2C transactions
+ *   uart.h	the serial port
+ *   rx.h	receiver pulse capture, pin change or PPM
+ *   actuators.h	ESC and servo pulse outputs
+ *   nvm.h	background EEPROM writes, eeprom_read_block() to read
+ *
+ * There are two implementations: the ATmega328p drivers in this
+ * directory and sil/sil.c for the host replays.  The portable modules
+ * only use the avr-libc headers for cli(), sei(), sleep_cpu(), PROGMEM,
+ * eeprom_read_block() and telemetry.c's CRC, which sil/avr/ stands in
+ * for, plus what's below.  Whatever saves and restores the interrupt
+ * state, drivers included, goes through irq_save() / irq_restore().
+ *
+ * Only for code built for a target (or the SIL, with its stand-ins),
+ * the host tools share headers like profile.h but never include this.
+ *
+ * F_CPU is the timer_read() rate, which all the time constants and
+ * tunings are written against.
+ */
+
+#ifndef _HAL_H
+#define _HAL_H
+
+#include <inttypes.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+/* Disable interrupts, return the previous state for irq_restore() */
+static inline uint8_t irq_save(void) {
+	uint8_t sreg = SREG;
+
+	cli();
+	return sreg;
+}
+
+static inline void irq_restore(uint8_t sreg) {
+	SREG = sreg;
+}
+
+/* The low 16 bits of timer_read() and of the next timeout's compare
+ * value, cheap enough for the profiler (see profile.h) */
+#define timer_lo16()	TCNT1
+#define timeout_lo16()	OCR1A
+
+#endif /* _HAL_H */
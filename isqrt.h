@@ -1,11 +1,34 @@
-#ifndef _ISQRT_H
-#define _ISQRT_H
-
-#include <inttypes.h>
-
-// coded in assembler file
-extern uint16_t isqrt32(uint32_t n);
-extern uint8_t  isqrt16(uint16_t n);
-extern uint16_t ihypot(int16_t x, int16_t y);
-
-#endif // _ISQRT_H
+#ifndef _ISQRT_H
+#define _ISQRT_H
+
+#include <inttypes.h>
+
+#ifdef __AVR__
+// coded in assembler file
+extern uint16_t isqrt32(uint32_t n);
+extern uint8_t  isqrt16(uint16_t n);
+extern uint16_t ihypot(int16_t x, int16_t y);
+#else
+// same results in C, bit by bit
+static inline uint16_t isqrt32(uint32_t n) {
+	uint32_t s = 0, bit;
+
+	for (bit = 1ul << 30; bit; bit >>= 2)
+		if (n >= s + bit) {
+			n -= s + bit;
+			s = (s >> 1) + bit;
+		} else
+			s >>= 1;
+	return s;
+}
+
+static inline uint8_t isqrt16(uint16_t n) {
+	return isqrt32(n);
+}
+
+static inline uint16_t ihypot(int16_t x, int16_t y) {
+	return isqrt32((int32_t) x * x + (int32_t) y * y);
+}
+#endif
+
+#endif // _ISQRT_H
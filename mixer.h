@@ -0,0 +1,138 @@
+/*
+ * Airframe mixers: from throttle, pitch, roll and yaw to the actuator
+ * outputs.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Each airframe is a table with one line per actuator output:
+ *
+ *   OUT(n, pitch, roll, yaw, motor, scale, offset, min, max)
+ *
+ * pitch, roll and yaw are the coefficients of each command in quarters
+ * (-4 to 4), motor is 1 for a motor, which also takes the throttle, is
+ * covered by the adaptive mode and is off while disarmed, or 0 for a
+ * servo, which is centered at offset and stays there while disarmed.
+ * Outside of the adaptive mode the sum is multiplied by scale / 8 and
+ * offset is added, the adaptive mode starts from the same scale.  min
+ * and max are the output limits.  In the control.c convention the pitch
+ * command tilts the left side (motors A and C on the quad) up against
+ * the right side, roll the front (A and B) against the rear.
+ *
+ * The tables are only ever expanded as macros with constant arguments,
+ * so every multiplication by 4, 0 or -4 quarters or by 8 eighths folds
+ * away and the code is what one would write by hand.
+ *
+ * With MIXER_THRUST_LUT the motor outputs are linearized through
+ * mixer_thrust_lut[] before the limits, see there.
+ */
+
+/*
+ * Quad in the X configuration.  Motor B is about 1.6x stronger than the
+ * others on my frame.
+ */
+#define MIXER_QUAD_X(OUT)					\
+	OUT(0,  4,  4,  4, 1, 8,  0, 0, 40000)			\
+	OUT(1, -4,  4, -4, 1, 5, -6, 0, 25000)			\
+	OUT(2,  4, -4, -4, 1, 8,  0, 0, 40000)			\
+	OUT(3, -4, -4,  4, 1, 8,  0, 0, 40000)
+
+/*
+ * Tricopter: A front left, B front right, C at the rear and the yaw
+ * servo tilting motor C on output 3.
+ */
+#define MIXER_TRI(OUT)						\
+	OUT(0,  4,  2,  0, 1, 8,  0, 0, 40000)			\
+	OUT(1, -4,  2,  0, 1, 8,  0, 0, 40000)			\
+	OUT(2,  0, -4,  0, 1, 8,  0, 0, 40000)			\
+	OUT(3,  0,  0,  4, 0, 8, 32768, 16384, 49152)
+
+/*
+ * Dualcopter (bicopter): A on the left, B on the right, each tilted
+ * by its servo (outputs 2 and 3) for roll and yaw.
+ */
+#define MIXER_DUAL(OUT)						\
+	OUT(0,  4,  0,  0, 1, 8,  0, 0, 40000)			\
+	OUT(1, -4,  0,  0, 1, 8,  0, 0, 40000)			\
+	OUT(2,  0,  4,  4, 0, 8, 32768, 16384, 49152)		\
+	OUT(3,  0,  4, -4, 0, 8, 32768, 16384, 49152)
+
+#if defined(AIRFRAME_TRI)
+# define MIXER		MIXER_TRI
+# define MIXER_OUTPUTS	4
+# define MIXER_MOTORS	3
+#elif defined(AIRFRAME_DUAL)
+# define MIXER		MIXER_DUAL
+# define MIXER_OUTPUTS	4
+# define MIXER_MOTORS	2
+#else
+# define MIXER		MIXER_QUAD_X
+# define MIXER_OUTPUTS	4
+# define MIXER_MOTORS	4
+#endif
+
+/* x * k / 4 for a constant k */
+#define MIX_TERM(x, k)						\
+	((k) == 4 ? (x) : (k) == -4 ? -(x) : (k) == 0 ? 0 :	\
+	 ((x) * (k)) >> 2)
+
+/* base plus the pitch, roll and yaw terms, in base's type or wider */
+#define MIX_SUM(base, pitch, roll, yaw, p, r, y)		\
+	((base) + MIX_TERM(pitch, p) + MIX_TERM(roll, r) +	\
+	 MIX_TERM(yaw, y))
+
+/* x * s / 8 + o for constants s and o */
+#define MIX_SCALE(x, s, o)					\
+	(((s) == 8 ? (x) : ((x) * (s)) >> 3) + (o))
+
+/* Average over the motors, a shift where possible */
+#if MIXER_MOTORS == 4
+# define MIX_AVG(sum)	(((sum) + 2) >> 2)
+#elif MIXER_MOTORS == 2
+# define MIX_AVG(sum)	(((sum) + 1) >> 1)
+#else
+# define MIX_AVG(sum)	(((sum) + MIXER_MOTORS / 2) / MIXER_MOTORS)
+#endif
+
+#ifdef MIXER_THRUST_LUT
+# include <avr/pgmspace.h>
+
+/*
+ * Output command for thrust, 64 linear segments over each motor's min
+ * to max range, as 0 to 65535.  The default assumes static thrust is
+ * proportional to the square of the command, i.e. mixer_thrust_lut[i]
+ * == 65536 * sqrt(i / 64), replace with a measured curve for your
+ * motors and propellers.  The control loop gains see the curve's slope
+ * so they need retuning when it's enabled.
+ */
+static const uint16_t mixer_thrust_lut[65] PROGMEM = {
+	0, 8192, 11585, 14189, 16384, 18318, 20066, 21674,
+	23170, 24576, 25905, 27170, 28378, 29537, 30652, 31727,
+	32768, 33776, 34756, 35708, 36636, 37540, 38424, 39287,
+	40132, 40960, 41771, 42567, 43348, 44115, 44869, 45611,
+	46341, 47059, 47767, 48465, 49152, 49830, 50499, 51159,
+	51811, 52454, 53090, 53719, 54340, 54954, 55561, 56162,
+	56756, 57344, 57926, 58503, 59073, 59639, 60199, 60753,
+	61303, 61848, 62388, 62924, 63455, 63982, 64504, 65022,
+	65535,
+};
+
+/* min and max are the output's constant limits */
+static inline int32_t mixer_thrust(int32_t x, int32_t min, int32_t max) {
+	uint16_t range = max - min, lo, hi, y;
+	uint8_t i;
+
+	/* Where x is in [min, max], times a constant 65536 / range << 8 */
+	x = ((x - min) * (int32_t) ((0x1000000 + range / 2) / range)) >> 8;
+	if (x <= 0)
+		return min;
+	if (x > 0xffff)
+		x = 0xffff;
+
+	i = (uint16_t) x >> 10;
+	lo = pgm_read_word(&mixer_thrust_lut[i]);
+	hi = pgm_read_word(&mixer_thrust_lut[i + 1]);
+	y = lo + (((uint32_t) (hi - lo) * ((uint16_t) x & 1023)) >> 10);
+
+	return min + (((uint32_t) y * range) >> 16);
+}
+#endif
@@ -6,6 +6,7 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 
 #include "adc.h"
 #include "timer1.h"
@@ -54,7 +55,6 @@ static void handle_input(char ch) {
 		return;
 	}
 
-	sei();
 	show_state();
 }
 
@@ -66,15 +66,15 @@ void setup(void) {
 	adc_init();
 	timer_init();
 	sei();
-	actuators_init(4);
+	actuators_init(4, 4);
 	serial_set_handler(handle_input);
 
 	/* Wait for someone to attach to UART */
 	my_delay(4000);
 
-	serial_write_str("SREG:");
+	serial_write_str_P(PSTR("SREG:"));
 	serial_write_hex16(s);
-	serial_write_str(", MCUCR:");
+	serial_write_str_P(PSTR(", MCUCR:"));
 	serial_write_hex16(m);
 	serial_write_eol();
 
@@ -86,7 +86,8 @@ void setup(void) {
 }
 
 void loop(void) {
-	my_delay(100);
+	serial_poll();
+	my_delay(10);
 	/*serial_write1('.');*/
 }
 
@@ -0,0 +1,122 @@
+/*
+ * Inertial velocity and altitude estimate, see nav.h.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+
+#include "timer1.h"
+#include "fixmul.h"
+#include "gps.h"
+#include "nav.h"
+
+#ifndef NAV_VEL_MAX
+# define NAV_VEL_MAX	2000 /* cm/s */
+#endif
+#ifndef NAV_LEAK_SHIFT
+# define NAV_LEAK_SHIFT	18
+#endif
+#ifndef NAV_GPS_SHIFT
+# define NAV_GPS_SHIFT	3
+#endif
+#ifndef NAV_GPS_TIMEOUT
+# define NAV_GPS_TIMEOUT (F_CPU * 2)
+#endif
+
+/*
+ * The time step is in 256-cycle ticks, capped at NAV_TICKS_MAX (0.26s
+ * at 16MHz) so a stall doesn't throw the estimate off.  In these units:
+ *
+ *   dv [cm/s << 8] = acc * ticks * 0x4000^-1 g * 256 / F_CPU * 256,
+ *     done as mul_15(acc, NAV_ACC_K) * ticks >> 11,
+ *   dalt [cm << 8] = v [cm/s << 4] * ticks * 256 / F_CPU * 16,
+ *     done as mul_15(v, NAV_ALT_K) * ticks >> 11.
+ *
+ * The mul_15()s keep the products within 32 bits for any acc and any
+ * velocity up to NAV_VEL_MAX.
+ */
+#define NAV_TICKS_MAX	0x3fff
+#define NAV_ACC_K	((int16_t) (980.665 / 16384 * 65536 / F_CPU * \
+			(1l << 26) + 0.5))
+#define NAV_ALT_K	((int16_t) (4096.0 / F_CPU * (1l << 26) + 0.5))
+#define NAV_V_LIMIT	((int32_t) NAV_VEL_MAX << 8)
+
+struct nav_state_s nav_state;
+
+static uint32_t prev_ts;
+
+#ifdef GPS
+static uint8_t fix_count;
+static uint32_t fix_ts;
+static int32_t alt_offset;	/* GPS altitude at altitude 0, cm << 8 */
+static uint8_t alt_offset_set;
+
+static void nav_gps_correct(void) {
+	struct gps_fix_s fix;
+	uint8_t count = gps_read(&fix);
+	int32_t err;
+
+	if (count == fix_count)
+		return;
+	fix_count = count;
+	fix_ts = fix.timestamp;
+
+	if (unlikely(!alt_offset_set)) {
+		alt_offset = (fix.alt << 8) - nav_state.altitude;
+		alt_offset_set = 1;
+	}
+
+	/* Altitude error to both the altitude and the vertical
+	 * velocity, per second of error over the fix interval of ~1s */
+	err = ((fix.alt << 8) - alt_offset) - nav_state.altitude;
+	nav_state.altitude += err >> NAV_GPS_SHIFT;
+	nav_state.velocity[2] += err >> (NAV_GPS_SHIFT + 2);
+}
+
+static uint8_t nav_gps_valid(uint32_t now) {
+	return fix_count && now - fix_ts < NAV_GPS_TIMEOUT;
+}
+#else
+static inline void nav_gps_correct(void) {}
+static inline uint8_t nav_gps_valid(uint32_t now) { return 0; }
+#endif
+
+void nav_update(const int16_t acc[3], const int16_t ref[3], uint32_t ts) {
+	uint32_t diff = ts - prev_ts;
+	uint16_t ticks;
+	int32_t v;
+	int16_t a, v16;
+	uint8_t i, gps;
+
+	prev_ts = ts;
+	ticks = diff > ((uint32_t) NAV_TICKS_MAX << 8) ?
+		NAV_TICKS_MAX : diff >> 8;
+
+	nav_gps_correct();
+	gps = nav_gps_valid(ts);
+
+	for (i = 0; i < 3; i ++) {
+		v = (int32_t) acc[i] - ref[i];
+		a = v > 32767 ? 32767 : v < -32767 ? -32767 : v;
+
+		v = nav_state.velocity[i];
+		v += (mul_16_32(mul_15(a, NAV_ACC_K), ticks) +
+				(1 << 10)) >> 11;
+		if (v > NAV_V_LIMIT)
+			v = NAV_V_LIMIT;
+		else if (v < -NAV_V_LIMIT)
+			v = -NAV_V_LIMIT;
+
+		/* Within int16_t after the clamp.  The GPS only corrects
+		 * z, so x and y always leak */
+		v16 = (v + 8) >> 4;
+		if (i < 2 || !gps)
+			v -= mul_16_32(v16, ticks) >> (NAV_LEAK_SHIFT - 4);
+		nav_state.velocity[i] = v;
+	}
+
+	v16 = (nav_state.velocity[2] + 8) >> 4;
+	nav_state.altitude += (mul_16_32(mul_15(v16, NAV_ALT_K), ticks) +
+			(1 << 10)) >> 11;
+}
@@ -0,0 +1,53 @@
+/*
+ * Inertial velocity and altitude estimate.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Fed by the AHRS on every fusion step with the acceleration rotated
+ * into its global frame (the vehicle's at boot, z up if it was level)
+ * less the gravity reference, and the time of the readings.  The
+ * acceleration is integrated over the real time step into the velocity
+ * and the vertical velocity into the altitude, all in fixed point with
+ * the velocity clamped to NAV_VEL_MAX so nothing can overflow.
+ *
+ * On its own that drifts with the accelerometer's offsets, so it's
+ * complemented by whatever absolute reference there is:
+ *
+ * - with -DGPS every new fix pulls the altitude, and through it the
+ *   vertical velocity, towards the GPS altitude (relative to that at
+ *   the first fix) by 1 / (1 << NAV_GPS_SHIFT) of the error,
+ * - without a fix for NAV_GPS_TIMEOUT the vertical velocity, and the
+ *   horizontal velocity always, leaks towards zero with a time
+ *   constant of 1 << NAV_LEAK_SHIFT 256-cycle ticks (4.2s at 16MHz),
+ *   which leaves a velocity that's good for a few seconds, enough for
+ *   the velocity hold to work against.  The altitude then
+ *   only follows the vertical velocity, it's good for changes over a
+ *   few seconds, not as an absolute height.
+ *
+ * The horizontal velocity isn't GPS-corrected yet: the fix's course is
+ * from north while the global frame's heading is wherever the vehicle
+ * pointed at boot, so speed and course aren't used until the two can
+ * be lined up.
+ */
+
+#ifndef _NAV_H
+#define _NAV_H
+
+#include <inttypes.h>
+
+struct nav_state_s {
+	int32_t velocity[3];	/* cm/s << 8, in the AHRS global frame */
+	int32_t altitude;	/* cm << 8, from where it was at boot */
+};
+
+/* Only written from nav_update() in the AHRS's fusion step */
+extern struct nav_state_s nav_state;
+
+/*
+ * acc[] is the accelerometer reading rotated into the global frame and
+ * ref[] the gravity reference in it, 0x4000 per 1g, ts the timer_read()
+ * time of the reading.
+ */
+void nav_update(const int16_t acc[3], const int16_t ref[3], uint32_t ts);
+
+#endif /* _NAV_H */
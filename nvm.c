@@ -0,0 +1,57 @@
+/*
+ * Background writes to the ATmega's internal EEPROM, see nvm.h.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "hal.h"
+#include "nvm.h"
+
+#ifndef NULL
+# define NULL 0
+#endif
+
+static struct nvm_job_s *nvm_head = NULL;
+
+void nvm_write(struct nvm_job_s *job) {
+	struct nvm_job_s *j;
+	uint8_t sreg = irq_save();
+
+	job->pos = 0;
+	for (j = nvm_head; j && j != job; j = j->next);
+	if (!j) {
+		job->next = nvm_head;
+		nvm_head = job;
+	}
+	EECR |= 1 << EERIE;
+	irq_restore(sreg);
+}
+
+/* Fires whenever the EEPROM is ready for a write while enabled */
+ISR(EE_READY_vect) {
+	struct nvm_job_s *job;
+	uint8_t val;
+
+	while ((job = nvm_head)) {
+		while (job->pos < job->len) {
+			val = job->data[job->pos];
+			EEAR = job->addr + job->pos ++;
+			EECR |= 1 << EERE;
+			if (EEDR == val)
+				continue;
+
+			EEDR = val;
+			/* EEPE has to follow EEMPE within four cycles */
+			EECR |= 1 << EEMPE;
+			EECR |= 1 << EEPE;
+			return;
+		}
+
+		nvm_head = job->next;
+	}
+
+	EECR &= ~(1 << EERIE);
+}
@@ -0,0 +1,35 @@
+/*
+ * Background writes to the ATmega's internal EEPROM.
+ *
+ * Licensed under AGPLv3.
+ *
+ * A write is a struct nvm_job_s owned by the caller, like the TWI
+ * jobs: len bytes from data go to EEPROM address addr, off the EEPROM
+ * ready interrupt, one byte every 3.4ms.  The bytes that already hold
+ * the right value are skipped.  data must stay untouched while the job
+ * is pending, change it with interrupts disabled and queue the job
+ * again, which restarts it from the first byte.  Jobs for overlapping
+ * addresses aren't ordered.
+ */
+
+#ifndef _NVM_H
+#define _NVM_H
+
+#include <inttypes.h>
+
+struct nvm_job_s {
+	uint16_t addr;
+	const uint8_t *data;
+	uint8_t len;
+	uint8_t pos;		/* Bytes done, len when finished */
+	struct nvm_job_s *next;
+};
+
+/* May be called with interrupts disabled, never blocks */
+void nvm_write(struct nvm_job_s *job);
+
+static inline uint8_t nvm_pending(const struct nvm_job_s *job) {
+	return *(volatile uint8_t *) &job->pos < job->len;
+}
+
+#endif /* _NVM_H */
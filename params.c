@@ -0,0 +1,137 @@
+/*
+ * Run-time tunables, see params.h.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <stddef.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/eeprom.h>
+#include <avr/pgmspace.h>
+
+#include "hal.h"
+#include "nvm.h"
+#include "params.h"
+
+#define PARAM_DEFAULT(name, type, def, mi, ma)	.name = def,
+#define PARAM_DESC(name, type, def, mi, ma)			\
+	{ #name, PARAM_##type, offsetof(struct params_s, name),	\
+		def, mi, ma },
+
+struct params_s params = {
+	PARAMS(PARAM_DEFAULT)
+};
+
+static const struct param_desc_s param_desc[PARAM_COUNT] PROGMEM = {
+	PARAMS(PARAM_DESC)
+};
+
+struct params_rec_s {
+	uint8_t magic;
+	uint8_t size;		/* sizeof(struct params_s) */
+	struct params_s p;
+	uint8_t sum;		/* Two's complement of the sum of the rest */
+};
+
+/* The record being written */
+static struct params_rec_s pending;
+static struct nvm_job_s pending_job = {
+	.addr = PARAMS_EEPROM_ADDR,
+	.data = (const uint8_t *) &pending,
+	.len = sizeof(pending),
+};
+
+static uint8_t params_sum(const struct params_rec_s *rec) {
+	const uint8_t *p = (const uint8_t *) rec;
+	uint8_t i, sum = 0;
+
+	for (i = 0; i < sizeof(*rec) - 1; i ++)
+		sum += p[i];
+	return -sum;
+}
+
+static int16_t param_read(const struct params_s *p,
+		const struct param_desc_s *desc) {
+	const uint8_t *field = (const uint8_t *) p + desc->offset;
+
+	if (desc->type == PARAM_U8)
+		return *field;
+	return *(const int16_t *) field;
+}
+
+static void param_write(struct params_s *p, const struct param_desc_s *desc,
+		int16_t value) {
+	uint8_t *field = (uint8_t *) p + desc->offset;
+
+	if (desc->type == PARAM_U8)
+		*field = value;
+	else
+		*(int16_t *) field = value;
+}
+
+void params_load(void) {
+	struct params_rec_s rec;
+	struct param_desc_s desc;
+	uint8_t i;
+	int16_t value;
+
+	eeprom_read_block(&rec, (const void *) PARAMS_EEPROM_ADDR, sizeof(rec));
+	if (rec.magic != PARAMS_MAGIC || rec.size != sizeof(rec.p) ||
+			rec.sum != params_sum(&rec))
+		return;
+
+	/* Anything out of its current range keeps the default */
+	for (i = 0; i < PARAM_COUNT; i ++) {
+		memcpy_P(&desc, &param_desc[i], sizeof(desc));
+		value = param_read(&rec.p, &desc);
+		if (value >= desc.min && value <= desc.max)
+			param_write(&params, &desc, value);
+	}
+}
+
+void params_save(void) {
+	/* Restarts a write that's still under way, see calib_save() */
+	uint8_t sreg = irq_save();
+
+	pending.magic = PARAMS_MAGIC;
+	pending.size = sizeof(pending.p);
+	pending.p = params;
+	pending.sum = params_sum(&pending);
+	nvm_write(&pending_job);
+	irq_restore(sreg);
+}
+
+void params_reset(void) {
+	struct param_desc_s desc;
+	uint8_t i;
+
+	for (i = 0; i < PARAM_COUNT; i ++) {
+		memcpy_P(&desc, &param_desc[i], sizeof(desc));
+		param_set(i, desc.def);
+	}
+}
+
+uint8_t param_set(uint8_t id, int16_t value) {
+	struct param_desc_s desc;
+
+	if (id >= PARAM_COUNT)
+		return 0;
+	memcpy_P(&desc, &param_desc[id], sizeof(desc));
+	if (value < desc.min || value > desc.max)
+		return 0;
+
+	/* A U8 is a single store, nothing can see it half written */
+	param_write(&params, &desc, value);
+
+	return 1;
+}
+
+uint8_t param_get(uint8_t id, int16_t *value, struct param_desc_s *desc) {
+	if (id >= PARAM_COUNT)
+		return 0;
+	memcpy_P(desc, &param_desc[id], sizeof(*desc));
+	*value = param_read(&params, desc);
+
+	return 1;
+}
@@ -0,0 +1,144 @@
+/*
+ * Run-time tunables, kept in the ATmega's internal EEPROM across boots.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Every parameter is one P(name, type, default, min, max) line in
+ * PARAMS below and a field of the same name in params, e.g.
+ * params.deadband.  The defaults are the compile-time constants, so a
+ * -D still sets them (see the Makefile's SILFLAGS example), and params
+ * holds them until params_load() finds a valid record.  The values are
+ * changed from the main loop by param_set() (the telemetry commands in
+ * telemetry.h), the U8 ones may be read from interrupt handlers, the
+ * I16 ones only from the main loop.
+ *
+ * The record goes at PARAMS_EEPROM_ADDR, after the calibration (see
+ * calib.h), with the size of struct params_s in place of a version, so
+ * a build with a different table starts from the defaults.  Entries
+ * that only one AHRS= or CONTROL= build uses are still in the table
+ * (and the record) of the others, except for the cascade's.
+ */
+
+#ifndef _PARAMS_H
+#define _PARAMS_H
+
+#include <inttypes.h>
+
+#define PARAMS_EEPROM_ADDR	64
+#define PARAMS_MAGIC		0x9a
+#define PARAM_NAME_LEN		10
+
+enum param_type_e {
+	PARAM_U8,
+	PARAM_I16,
+};
+
+/* Stick deadband around centre in the hold modes, see control.c */
+#ifndef STICK_DEADBAND
+# define STICK_DEADBAND	3
+#endif
+/* Yaw command limit in the heading-hold and adaptive modes */
+#ifndef YAW_CMD_MAX
+# define YAW_CMD_MAX	0xc00
+#endif
+/* Motor gain above which the adaptive mode corrects the throttle */
+#ifndef MGAIN
+# define MGAIN		0x800
+#endif
+/* ahrs.c: magnetometer and accelerometer correction, as left shifts */
+#ifndef MAG_ROLLPITCH_PRIORITY
+# define MAG_ROLLPITCH_PRIORITY 7
+#endif
+#ifndef ACCEL_ROLLPITCH_PRIORITY
+# define ACCEL_ROLLPITCH_PRIORITY 9
+#endif
+/* ahrs-mahony.c: feedback gains as right shifts */
+#ifndef MAHONY_ACC_SHIFT
+# define MAHONY_ACC_SHIFT 4
+#endif
+#ifndef MAHONY_MAG_SHIFT
+# define MAHONY_MAG_SHIFT 4
+#endif
+
+#define PARAMS_BASE(P)						\
+	P(deadband,	U8,	STICK_DEADBAND,		0, 0x40)	\
+	P(yaw_max,	I16,	YAW_CMD_MAX,		0, 0x7fff)	\
+	P(mgain,	I16,	MGAIN,			0, 0x7fff)	\
+	P(mag_prio,	U8,	MAG_ROLLPITCH_PRIORITY,	0, 15)		\
+	P(acc_prio,	U8,	ACCEL_ROLLPITCH_PRIORITY, 0, 15)	\
+	P(acc_shift,	U8,	MAHONY_ACC_SHIFT,	0, 15)		\
+	P(mag_shift,	U8,	MAHONY_MAG_SHIFT,	0, 15)
+
+#ifdef CONTROL_CASCADE
+/* The rate loop's gains, see control.c */
+# ifndef CASCADE_ATT_P
+#  define CASCADE_ATT_P	16	/* Rate setpoint per attitude error, x4 */
+# endif
+# ifndef CASCADE_RATE_MAX
+#  define CASCADE_RATE_MAX 0x6000
+# endif
+# ifndef CASCADE_RATE_P
+#  define CASCADE_RATE_P 64	/* Command per rate error, x256 */
+# endif
+# ifndef CASCADE_RATE_I
+#  define CASCADE_RATE_I 0	/* Per rate error and tick, x65536 */
+# endif
+# ifndef CASCADE_RATE_D
+#  define CASCADE_RATE_D 0	/* Per filtered rate change, x16 */
+# endif
+# ifndef CASCADE_I_MAX
+#  define CASCADE_I_MAX	0x800
+# endif
+# ifndef CASCADE_OUT_MAX
+#  define CASCADE_OUT_MAX 0x2000
+# endif
+
+# define PARAMS_CASCADE(P)					\
+	P(att_p,	I16,	CASCADE_ATT_P,		0, 0x100)	\
+	P(rate_max,	I16,	CASCADE_RATE_MAX,	0, 0x7fff)	\
+	P(rate_p,	I16,	CASCADE_RATE_P,		0, 0x400)	\
+	P(rate_i,	I16,	CASCADE_RATE_I,		0, 0x100)	\
+	P(rate_d,	I16,	CASCADE_RATE_D,		0, 0x1000)	\
+	P(i_max,	I16,	CASCADE_I_MAX,		0, 0x4000)	\
+	P(out_max,	I16,	CASCADE_OUT_MAX,	0, 0x4000)
+#else
+# define PARAMS_CASCADE(P)
+#endif
+
+#define PARAMS(P)	PARAMS_BASE(P) PARAMS_CASCADE(P)
+
+#define PARAM_CTYPE_U8	uint8_t
+#define PARAM_CTYPE_I16	int16_t
+
+#define PARAM_FIELD(name, type, def, mi, ma)	PARAM_CTYPE_##type name;
+#define PARAM_ID(name, type, def, mi, ma)	PARAM_##name,
+
+struct params_s {
+	PARAMS(PARAM_FIELD)
+};
+
+enum param_id_e {
+	PARAMS(PARAM_ID)
+	PARAM_COUNT
+};
+
+struct param_desc_s {
+	char name[PARAM_NAME_LEN];
+	uint8_t type;		/* enum param_type_e */
+	uint8_t offset;		/* In struct params_s */
+	int16_t def, min, max;
+};
+
+extern struct params_s params;
+
+/* Call once at boot before anything uses params */
+void params_load(void);
+/* Start writing the current values out, see nvm.h */
+void params_save(void);
+/* Back to the defaults, the EEPROM record is left alone */
+void params_reset(void);
+/* Return 0 if there's no such parameter or value is out of its range */
+uint8_t param_set(uint8_t id, int16_t value);
+uint8_t param_get(uint8_t id, int16_t *value, struct param_desc_s *desc);
+
+#endif /* _PARAMS_H */
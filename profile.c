@@ -0,0 +1,121 @@
+/*
+ * Cycle-count profiler, see profile.h.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "timer1.h"
+#include "uart.h"
+#include "telemetry.h"
+#include "profile.h"
+
+#ifdef PROFILE
+
+struct prof_stat_s {
+	uint16_t count;
+	uint16_t min, max;
+	uint32_t sum;
+};
+
+static struct prof_stat_s sections[PROF_SECTIONS];
+
+static struct prof_stat_s timeouts[PROF_TIMEOUT_USERS];
+static void (*timeout_users[PROF_TIMEOUT_USERS])(void);
+
+static void stat_add(struct prof_stat_s *stat, uint16_t cycles) {
+	if (!stat->count || cycles < stat->min)
+		stat->min = cycles;
+	if (cycles > stat->max)
+		stat->max = cycles;
+	stat->sum += cycles;
+	stat->count ++;
+
+	/* Restart the period rather than let the average go wrong */
+	if (unlikely(!stat->count || stat->sum >= 0xff000000)) {
+		stat->count = 1;
+		stat->min = stat->max = cycles;
+		stat->sum = cycles;
+	}
+}
+
+void prof_record(uint8_t section, uint16_t cycles) {
+	uint8_t sreg = irq_save();
+
+	stat_add(&sections[section], cycles);
+
+	irq_restore(sreg);
+}
+
+/* Called from TIMER1_COMPA_vect with interrupts disabled */
+void prof_timeout(void (*callback)(void), uint32_t late) {
+	uint8_t i;
+
+	for (i = 0; i < PROF_TIMEOUT_USERS - 1; i ++)
+		if (timeout_users[i] == callback || !timeout_users[i])
+			break;
+	/* The last slot collects everybody else */
+	timeout_users[i] = callback;
+
+	stat_add(&timeouts[i], late > 0xffff ? 0xffff : late);
+}
+
+static uint8_t stat_take(struct prof_stat_s *stat, uint16_t *out) {
+	uint16_t count;
+	uint32_t sum;
+	uint8_t sreg = irq_save();
+
+	count = stat->count;
+	sum = stat->sum;
+	out[0] = stat->min;
+	out[2] = stat->max;
+	stat->count = 0;
+	stat->max = 0;
+	stat->sum = 0;
+	irq_restore(sreg);
+
+	out[1] = count ? (sum + count / 2) / count : 0;
+	return count;
+}
+
+/*
+ * Send one frame per section and per timeout user and start a new
+ * period for each.  Whatever doesn't fit in the UART buffer this time
+ * goes out on the next call, the periods just get longer.
+ */
+void prof_report(void) {
+	static uint8_t next = 0;
+	struct telem_profile_s prof;
+	struct telem_jitter_s jit;
+	uint16_t vals[3];
+
+	while (next < PROF_SECTIONS + PROF_TIMEOUT_USERS) {
+		if (serial_tx_free() < sizeof(prof) + 8)
+			return;
+
+		if (next < PROF_SECTIONS) {
+			prof.section = next;
+			prof.count = stat_take(&sections[next], vals);
+			prof.min = vals[0];
+			prof.avg = vals[1];
+			prof.max = vals[2];
+			telem_send(TELEM_PROFILE, &prof, sizeof(prof));
+		} else if (timeout_users[next - PROF_SECTIONS]) {
+			jit.callback = (uint16_t) (uintptr_t)
+				timeout_users[next - PROF_SECTIONS];
+			jit.count = stat_take(&timeouts[next - PROF_SECTIONS],
+					vals);
+			jit.min = vals[0];
+			jit.avg = vals[1];
+			jit.max = vals[2];
+			telem_send(TELEM_JITTER, &jit, sizeof(jit));
+		}
+
+		next ++;
+	}
+	next = 0;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Cycle-count profiler for the interrupt handlers and the hot paths.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Only built in with -DPROFILE (see the Makefile), otherwise all of
+ * the below compiles to nothing.  Each section's min / avg / max cycle
+ * count and number of runs are collected between reports.  Times come
+ * straight from the timer_read() counter (timer_lo16(), see hal.h) so a
+ * section must take less than 65536 cycles (4ms at 16MHz), and they're
+ * wall-clock times: anything that preempts a section which runs with
+ * interrupts enabled is included.
+ *
+ * PROF_IRQ_LATENCY is how late TIMER1_COMPA_vect (the timeout handler)
+ * gets to run after its compare match, i.e. the longest stretch with
+ * interrupts disabled (or spent in another handler) seen so far, plus
+ * the constant ISR entry cost.  The timeout jitter is the lateness of
+ * each callback relative to its requested "when", tracked separately
+ * for up to PROF_TIMEOUT_USERS different callbacks.
+ */
+
+enum prof_section_e {
+	PROF_ADC_ISR,		/* ADC_vect, including the gyro callback */
+	PROF_GYRO,		/* gyro_ahrs_update */
+	PROF_TIMER_ISR,		/* TIMER1_COMPA_vect, including callbacks */
+	PROF_VECTORS,		/* vectors_update */
+	PROF_FUSE,		/* vectors_fuse */
+	PROF_RX_ISR,		/* PCINT0_vect or TIMER1_CAPT_vect */
+	PROF_CONTROL,		/* control_update */
+	PROF_RATE,		/* control_rate_update */
+	PROF_IRQ_LATENCY,
+	PROF_SECTIONS,
+};
+
+#define PROF_TIMEOUT_USERS	4
+
+#ifdef PROFILE
+# include "hal.h"
+
+void prof_record(uint8_t section, uint16_t cycles);
+void prof_timeout(void (*callback)(void), uint32_t late);
+void prof_report(void);
+
+# define PROF_START(section)	\
+	uint16_t prof_start_ ## section = timer_lo16()
+# define PROF_END(section)	\
+	prof_record(section, timer_lo16() - prof_start_ ## section)
+/* Call first thing in the timeout handler */
+# define PROF_IRQ_ENTRY()	\
+	prof_record(PROF_IRQ_LATENCY, timer_lo16() - timeout_lo16())
+# define PROF_TIMEOUT(callback, when)	\
+	prof_timeout(callback, timer_read() - (when))
+#else
+static inline void prof_report(void) {}
+
+# define PROF_START(section)
+# define PROF_END(section)
+# define PROF_IRQ_ENTRY()
+# define PROF_TIMEOUT(callback, when)
+#endif
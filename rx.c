@@ -8,6 +8,7 @@
 #include <avr/interrupt.h>
 
 #include "timer1.h"
+#include "profile.h"
 
 volatile uint16_t rx_ch[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, };
 volatile uint8_t rx_co_throttle = 0;
@@ -19,29 +20,70 @@ volatile uint8_t rx_right_pot = 0;
 volatile uint8_t rx_left_pot = 0;
 volatile uint8_t rx_no_signal = 0;
 
-#if 0
+/* Channels per frame that we use */
+#ifdef FIRST_4_CHANNELS_ONLY
+# define RX_FRAME_CHANNELS	4
+#else
+# define RX_FRAME_CHANNELS	6
+#endif
+
+/* Channel slot width that corresponds to a zero rx_ch[] value */
+#define RX_CH_OFFSET		(F_CPU / 1050)
+/* Anything longer than this between edges starts a new frame */
+#define RX_SYNC			(F_CPU / 400)
+
+/*
+ * The ISR fills rx_frame[rx_wbuf] and flips rx_wbuf when a frame is
+ * complete, rx_update() picks the other one up from the main loop.
+ */
+static uint16_t rx_frame[2][RX_FRAME_CHANNELS];
+static uint8_t rx_wbuf;
+static volatile uint8_t rx_ready;
+static uint8_t rx_chnum;
+
+/* Interrupts disabled here */
+static inline void rx_frame_done(void) {
+	rx_wbuf ^= 1;
+	rx_ready = 1;
+}
+
+#ifdef RX_PPM
 
-/* Rx sum signal connected to the PD2/INT0 pin.  */
+/*
+ * Rx sum signal (PPM) connected to PB0/ICP1.  Timer 1's input capture
+ * unit latches TCNT1 on every rising edge so the channel widths don't
+ * depend on when the interrupt gets to run, only the ISR must be done
+ * before the next edge comes, 0.7ms or more later.  The noise canceler
+ * adds a constant 4 cycles.  There's one rising edge at the start of
+ * each channel slot and one after the last one, followed by the sync
+ * pause.
+ */
 void rx_init(void) {
-	EICRA = 0x01;
-	EIMSK = 0x01;
-	DDRD &= ~0x04;
+	DDRB &= ~0x01;
+	TCCR1B |= (1 << ICNC1) | (1 << ICES1);
+	TIFR1 = 1 << ICF1; /* Only clears ICF1 */
+	TIMSK1 |= 1 << ICIE1;
 }
 
-ISR(INT0_vect) {
-	/* Timer1 overflows every >4ms, so we should be fine using TCNT1 raw */
-	uint16_t now = TCNT1;
+ISR(TIMER1_CAPT_vect) {
+	PROF_START(PROF_RX_ISR);
+	static uint32_t rx_up = 0;
+	uint32_t now = timer_extend(ICR1);
+	uint32_t len = now - rx_up;
 
-	if (PIND & 0x04) {
-		if (now - rx_up > 40000)
-			rx_chnum = 0;
-		rx_up = now;
-		return;
-	}
+	rx_up = now;
 
-	rx_ch[rx_chnum ++] = now - rx_up;
-	if (rx_chnum >= sizeof(rx_ch) / sizeof(*rx_ch))
+	if (len > RX_SYNC) {
 		rx_chnum = 0;
+	} else if (unlikely(len < F_CPU / 2000)) {
+		/* A glitch, drop everything until the next sync */
+		rx_chnum = RX_FRAME_CHANNELS;
+	} else if (rx_chnum < RX_FRAME_CHANNELS) {
+		rx_frame[rx_wbuf][rx_chnum ++] = len - RX_CH_OFFSET;
+		if (rx_chnum == RX_FRAME_CHANNELS)
+			rx_frame_done();
+	}
+	PROF_END(PROF_RX_ISR);
 }
 #else
 
@@ -53,7 +95,54 @@ void rx_init(void) {
 	PCICR |= 0x01;
 }
 
-static inline void rx_esky_update(void) {
+ISR(PCINT0_vect) {
+	PROF_START(PROF_RX_ISR);
+	static uint32_t rx_up = 0;
+	uint32_t now = timer_read();
+
+	/* Note: could even just use TCNT1 above at the timer frequency
+	 * of 16MHz because the timer overflows at about 4ms only, but
+	 * then we might miss the long pause which might be 10ms or longer.
+	 * May be fixable though.
+	 */
+
+	/* The E-sky receiver starts pulsing the next channel almost
+	 * immediately before the falling edge of the previous channel
+	 * pulse, so the edges come about 0.01 ms apart only and
+	 * sometimes the second interrupts gets missed.  Since they are
+	 * so close we choose to unconditionally ignore the second one,
+	 * because the first one stands a better chance of being reported
+	 * accurately by the AVR core.  We ignore any edges < 0.5ms since
+	 * the previous edge.  The PPM mode (RX_PPM) doesn't have this
+	 * problem.
+	 */
+
+	if ((uint32_t) (now - rx_up) > RX_SYNC)
+		rx_chnum = 0;
+	else if ((uint32_t) (now - rx_up) < F_CPU / 2000) {
+		PROF_END(PROF_RX_ISR);
+		return;
+	}
+	else if (rx_chnum < RX_FRAME_CHANNELS) {
+		rx_frame[rx_wbuf][rx_chnum ++] = now - rx_up - RX_CH_OFFSET;
+		if (rx_chnum == RX_FRAME_CHANNELS)
+			rx_frame_done();
+	}
+
+	rx_up = now;
+	PROF_END(PROF_RX_ISR);
+}
+#endif
+
+/*
+ * Un-mix the channels.  The ET6I trasmitter is made specifically for
+ * helicopters and mixes the channels on the tx side to produce signals
+ * for: the motor, the 4 servos and the gyro.  We need to perform some
+ * simple arithmetics to go back to the raw stick position values for
+ * any processing in the autopilot.  This is currently assuming the Idle
+ * Up setting ("aerobatic mode") is off.
+ */
+static void rx_esky_update(void) {
 	uint16_t up_raw = rx_ch[2] >= ((256 + 31) << 6) ?
 		((256 + 31) << 6) - 1 : rx_ch[2];
 #ifdef FIRST_4_CHANNELS_ONLY
@@ -90,51 +179,19 @@ static inline void rx_esky_update(void) {
 	rx_no_signal = 0;
 }
 
-ISR(PCINT0_vect) {
-	static uint32_t rx_up = 0;
-	static uint8_t rx_chnum = 0;
-	uint32_t now = timer_read();
-
-	/* Note: could even just use TCNT1 above at the timer frequency
-	 * of 16MHz because the timer overflows at about 4ms only, but
-	 * then we might miss the long pause which might be 10ms or longer.
-	 * May be fixable though.
-	 */
-
-	/* The E-sky receiver starts pulsing the next channel almost
-	 * immediately before the falling edge of the previous channel
-	 * pulse, so the edges come about 0.01 ms apart only and
-	 * sometimes the second interrupts gets missed.  Since they are
-	 * so close we choose to unconditionally ignore the second one,
-	 * because the first one stands a better chance of being reported
-	 * accurately by the AVR core.  We ignore any edges < 0.5ms since
-	 * the previous edge.
-	 */
+void rx_update(void) {
+	const uint16_t *frame;
+	uint8_t i;
 
-	if ((uint32_t) (now - rx_up) > F_CPU / 400)
-		rx_chnum = 0;
-	else if ((uint32_t) (now - rx_up) < F_CPU / 2000)
+	if (!rx_ready)
 		return;
-	else {
-		/* XXX: should use F_CPU below */
-		rx_ch[rx_chnum ++] = now - rx_up - F_CPU / 1050;
-
-		/* Un-mix the channels.  The ET6I trasmitter is made
-		 * specifically for helicopters and mixes the channels on
-		 * the tx side to produce signals for: the motor, the 4
-		 * servos and the gyro.  We need to perform some simple
-		 * arithmetics to go back to the raw stick position values
-		 * for any processing in the autopilot.  This is currently
-		 * assuming the Idle Up setting ("aerobatic mode") is off.
-		 */
-#ifdef FIRST_4_CHANNELS_ONLY
-		if (rx_chnum == 4)
-#else
-		if (rx_chnum == 6)
-#endif
-			rx_esky_update();
-	}
 
-	rx_up = now;
+	cli();
+	frame = rx_frame[rx_wbuf ^ 1];
+	for (i = 0; i < RX_FRAME_CHANNELS; i ++)
+		rx_ch[i] = frame[i];
+	rx_ready = 0;
+	sei();
+
+	rx_esky_update();
 }
-#endif
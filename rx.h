@@ -5,6 +5,9 @@
  */
 
 void rx_init(void);
+/* Process the latest complete frame if there's a new one, once per
+ * control update */
+void rx_update(void);
 
 /* Raw channels */
 extern volatile uint16_t rx_ch[10];
@@ -0,0 +1,50 @@
+/*
+ * Sequence counters for data with one writer and readers that mustn't
+ * disable interrupts.
+ *
+ * Licensed under AGPLv3.
+ *
+ * The writer makes the count odd before it updates the data and even
+ * again when it's done, a reader copies the data out and starts over
+ * if the count was odd or has changed meanwhile.  The writer never
+ * waits and nothing needs cli(), the price is that a reader may have
+ * to copy more than once.
+ *
+ * There may be only one writer for each count, or writers that can't
+ * preempt each other, and the readers must never preempt the writer
+ * (e.g. from an interrupt) or they'll retry forever.  Readers in the
+ * main loop and a writer in an interrupt handler are fine.  A uint8_t
+ * count is enough unless a reader is held up for 128 updates.
+ */
+
+#ifndef _SEQLOCK_H
+#define _SEQLOCK_H
+
+#include <inttypes.h>
+
+#include "timer1.h"
+
+static inline void seq_write_begin(volatile uint8_t *seq) {
+	*seq += 1;
+	barrier();
+}
+
+static inline void seq_write_end(volatile uint8_t *seq) {
+	barrier();
+	*seq += 1;
+}
+
+static inline uint8_t seq_read_begin(volatile uint8_t *seq) {
+	uint8_t count = *seq;
+
+	barrier();
+	return count;
+}
+
+/* Non-zero if what was read since seq_read_begin() has to be re-read */
+static inline uint8_t seq_read_retry(volatile uint8_t *seq, uint8_t count) {
+	barrier();
+	return (count & 1) || *seq != count;
+}
+
+#endif /* _SEQLOCK_H */
@@ -0,0 +1,19 @@
+/*
+ * Host stand-in for avr-libc's <avr/eeprom.h>, see sil/sil.c.
+ *
+ * Licensed under AGPLv3.
+ *
+ * An erased EEPROM, so params.c keeps its defaults.  The calibration
+ * record has its own stand-ins in sil.c.
+ */
+
+#ifndef SIL_AVR_EEPROM_H
+#define SIL_AVR_EEPROM_H
+
+#include <string.h>
+
+static inline void eeprom_read_block(void *dst, const void *src, size_t n) {
+	memset(dst, 0xff, n);
+}
+
+#endif
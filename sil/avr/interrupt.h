@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for avr-libc's <avr/interrupt.h>, see sil/sil.c.
+ *
+ * Licensed under AGPLv3.
+ *
+ * The simulated interrupt handlers never preempt anything so
+ * there's nothing to disable.
+ */
+
+#ifndef SIL_AVR_INTERRUPT_H
+#define SIL_AVR_INTERRUPT_H
+
+#define cli()	do {} while (0)
+#define sei()	do {} while (0)
+
+#endif
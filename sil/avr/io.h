@@ -0,0 +1,19 @@
+/*
+ * Host stand-in for avr-libc's <avr/io.h>, see sil/sil.c.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Only what the modules built for the host actually touch, anything
+ * else should fail to compile rather than silently do nothing.
+ */
+
+#ifndef SIL_AVR_IO_H
+#define SIL_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit)	(1 << (bit))
+
+extern volatile uint8_t SREG;
+
+#endif
@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for avr-libc's <avr/pgmspace.h>, see sil/sil.c.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#ifndef SIL_AVR_PGMSPACE_H
+#define SIL_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s)			(s)
+#define pgm_read_byte(addr)	(*(const uint8_t *) (addr))
+#define pgm_read_word(addr)	(*(const uint16_t *) (addr))
+#define pgm_read_dword(addr)	(*(const uint32_t *) (addr))
+#define memcpy_P(dst, src, n)	memcpy(dst, src, n)
+
+#endif
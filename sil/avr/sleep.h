@@ -0,0 +1,21 @@
+/*
+ * Host stand-in for avr-libc's <avr/sleep.h>, see sil/sil.c.
+ *
+ * Licensed under AGPLv3.
+ *
+ * sleep_cpu() is where simulated time passes: it runs the next
+ * simulated interrupt, whichever is due first.
+ */
+
+#ifndef SIL_AVR_SLEEP_H
+#define SIL_AVR_SLEEP_H
+
+#define SLEEP_MODE_IDLE		0
+
+#define set_sleep_mode(mode)	do {} while (0)
+#define sleep_enable()		do {} while (0)
+#define sleep_disable()		do {} while (0)
+
+void sleep_cpu(void);
+
+#endif
@@ -0,0 +1,413 @@
+/*
+ * Software-in-the-loop harness: the real AHRS ($(AHRS).c, trig.c) and
+ * flight controller (control.c) built for the host and fed from a
+ * recorded sensor log instead of the hardware, as fast as the host
+ * can run them.
+ *
+ * Licensed under AGPLv3.
+ *
+ * The headers in sil/avr/ stand in for avr-libc, this file stands in
+ * for the drivers: timer_read() and set_timeout() run off a simulated
+ * clock, adc_start() and twi_queue() are fed from the log, actuator_set()
+ * just lands in actuators[] and sleep_cpu() is where simulated time
+ * passes.  Each simulated interrupt (a timeout, the end of a TWI
+ * transfer, a new gyro sample) runs to completion at its own time, so
+ * nothing ever preempts anything and cli()/sei() are no-ops.
+ *
+ * The log is text, one record per line, times in microseconds since
+ * boot and never decreasing, '#' starts a comment:
+ *
+ *   <us> G <x> <y> <ref>			adc_values[0..2] as the ADC
+ *						engine publishes them
+ *   <us> C <mx> <my> <mz> <ax> <ay> <az>	CMPS09 registers 10 to 21
+ *   <us> R <throttle> <co_right> <cy_front> <cy_right> <gyro_sw> <pot>
+ *   <us> B <battery> <temperature>		adc_values[3..4]
+ *   <us> F <alt>				a GPS fix, altitude in cm
+ *						(with -DGPS)
+ *
+ * The log has to start with the vehicle sitting still for the 1024
+ * gyro samples (some 5 seconds) that ahrs_init() calibrates over, same
+ * as on a real boot.  For every control update one line goes to stdout:
+ *
+ *   <us> <pitch> <roll> <yaw> <pitch rate> <roll rate> <yaw rate>
+ *	<motor A> <motor B> <motor C> <motor D>
+ *
+ * with the angles in degrees.  The tuning constants in ahrs.c and
+ * control.c can be overridden when building, see the Makefile.
+ *
+ * Usage: sil-replay [-q] [-m <modes>] [-e <file>] [<log>]
+ *   -q		only print the summary
+ *   -m		initial modes bitmask (see control.h), e.g. 0x3 to
+ *		start armed with heading-hold.  The gyro_sw channel in the
+ *		log still toggles them as it would in flight.
+ *   -e		keep the calibration record (see calib.h) in <file>,
+ *		a second run with the same file warm-starts from it.
+ *		Without it every run does the full calibration.
+ *
+ * With -DGPS gps_read() hands out the F records, with -DBLACKBOX
+ * bb_log() only counts what would have been logged, for the summary.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+
+#include "adc.h"
+#include "timer1.h"
+#include "actuators.h"
+#include "rx.h"
+#include "twi.h"
+#include "cmps09.h"
+#include "ahrs.h"
+#include "events.h"
+#include "telemetry.h"
+#include "control.h"
+#include "calib.h"
+#include "nvm.h"
+#include "gps.h"
+#include "blackbox.h"
+
+#define US(us)	((uint64_t) (us) * (F_CPU / 1000000))
+
+volatile uint8_t SREG;
+
+/* What the modules under test see of the hardware */
+volatile uint16_t adc_values[5];
+volatile uint16_t actuators[8];
+volatile uint8_t rx_no_signal = 255;
+volatile uint8_t rx_co_throttle, rx_co_right = 0x80;
+volatile uint8_t rx_cy_front = 0x80, rx_cy_right = 0x80;
+volatile uint8_t rx_gyro_sw, rx_right_pot, rx_left_pot;
+volatile uint8_t timeouts_lost;
+
+static uint8_t cmps09_regs[32] = { [0] = 0x02 }; /* Revision 2 */
+
+/* The simulated clock and whatever is scheduled on it */
+static uint64_t now;
+
+#define MAX_PENDING	32
+static struct pending_s {
+	uint64_t when;
+	void (*callback)(void);
+	struct twi_job_s *job;
+} pending[MAX_PENDING];
+static uint8_t pending_len;
+
+static void pending_add(uint64_t when, void (*callback)(void),
+		struct twi_job_s *job) {
+	if (pending_len >= MAX_PENDING) {
+		fprintf(stderr, "Too many pending events\n");
+		exit(2);
+	}
+
+	pending[pending_len].when = when;
+	pending[pending_len].callback = callback;
+	pending[pending_len].job = job;
+	pending_len ++;
+}
+
+uint32_t timer_read(void) {
+	return now;
+}
+
+uint8_t set_timeout(uint32_t when, void (*callback)(void)) {
+	/* Late timeouts fire right away like in timer1.c */
+	int32_t delta = when - (uint32_t) now;
+
+	pending_add(now + (delta > 0 ? delta : 0), callback, NULL);
+	return 0;
+}
+
+#ifdef ESC_SYNC
+/* The outputs are sampled from actuators[] after each update anyway */
+void actuators_fire(void) {
+}
+#endif
+
+static void (*adc_finished)(void);
+
+void adc_start(void (*finished)(void)) {
+	adc_finished = finished;
+}
+
+static void twi_complete(struct twi_job_s *job) {
+	if (job->addr == CMPS09_ADDR && job->wlen == 1 &&
+			job->wbuf[0] + job->rlen <= sizeof(cmps09_regs)) {
+		memcpy(job->rbuf, cmps09_regs + job->wbuf[0], job->rlen);
+		job->status = TWI_JOB_DONE;
+	} else
+		job->status = TWI_JOB_ERROR;
+}
+
+void twi_queue(struct twi_job_s *job) {
+	/* START, address, data bytes, repeated START, address, data bytes,
+	 * 9 bits per byte */
+	uint32_t bits = (job->wlen + job->dlen + job->rlen + 2) * 9 + 2;
+
+	job->status = TWI_JOB_PENDING;
+
+	/* Nobody waits for the blocking jobs on our clock, same as if they
+	 * had happened in no time */
+	if (!job->finished) {
+		twi_complete(job);
+		return;
+	}
+
+	pending_add(now + bits * (F_CPU / TWI_FREQ), NULL, job);
+}
+
+/* Stand-ins for calib.c, the EEPROM is the -e file if there's one */
+static const char *calib_file;
+
+uint8_t calib_load(struct calib_s *cal) {
+	FILE *f;
+	uint8_t ok;
+
+	if (!calib_file || !(f = fopen(calib_file, "rb")))
+		return 0;
+	ok = fread(cal, sizeof(*cal), 1, f) == 1 && cal->magic == CALIB_MAGIC;
+	fclose(f);
+	return ok;
+}
+
+void calib_save(const struct calib_s *cal) {
+	struct calib_s rec = *cal;
+	FILE *f;
+
+	if (!calib_file || !(f = fopen(calib_file, "wb")))
+		return;
+	rec.magic = CALIB_MAGIC;
+	fwrite(&rec, sizeof(rec), 1, f);
+	fclose(f);
+}
+
+/* Nothing but params.c would write, and only on a telemetry command */
+void nvm_write(struct nvm_job_s *job) {
+	job->pos = job->len;
+}
+
+#ifdef GPS
+/* Stand-in for gps.c, the latest F record */
+static struct gps_fix_s gps_fix;
+static uint8_t gps_count;
+
+uint8_t gps_read(struct gps_fix_s *fix) {
+	*fix = gps_fix;
+	return gps_count;
+}
+#endif
+
+#ifdef BLACKBOX
+/* Stand-in for blackbox.c, there's no EEPROM to log to */
+static unsigned long bb_records[BB_RECORDS];
+
+void bb_log(uint8_t type, const int16_t *v) {
+	bb_records[type] ++;
+}
+#endif
+
+/* The log reader */
+static FILE *log_file;
+static unsigned long log_line;
+static struct record_s {
+	uint64_t when;
+	char type;
+	long v[6];
+} next_rec;
+
+static int record_read(struct record_s *rec) {
+	char line[256];
+	unsigned long long us;
+	int n;
+
+	while (fgets(line, sizeof(line), log_file)) {
+		log_line ++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+
+		n = sscanf(line, "%llu %c %li %li %li %li %li %li", &us,
+				&rec->type, &rec->v[0], &rec->v[1], &rec->v[2],
+				&rec->v[3], &rec->v[4], &rec->v[5]);
+		if (n < 3) {
+			fprintf(stderr, "Line %lu: bad record\n", log_line);
+			continue;
+		}
+		rec->when = US(us);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void record_apply(const struct record_s *rec) {
+	uint8_t i;
+
+	switch (rec->type) {
+	case 'G':
+		adc_values[0] = rec->v[0];
+		adc_values[1] = rec->v[1];
+		adc_values[2] = rec->v[2];
+		if (adc_finished)
+			adc_finished();
+		break;
+	case 'C':
+		for (i = 0; i < 6; i ++) {
+			cmps09_regs[10 + i * 2] = (uint16_t) rec->v[i] >> 8;
+			cmps09_regs[11 + i * 2] = rec->v[i] & 255;
+		}
+		break;
+	case 'R':
+		rx_co_throttle = rec->v[0];
+		rx_co_right = rec->v[1];
+		rx_cy_front = rec->v[2];
+		rx_cy_right = rec->v[3];
+		rx_gyro_sw = rec->v[4];
+		rx_right_pot = rec->v[5];
+		rx_no_signal = 0;
+		break;
+	case 'B':
+		adc_values[3] = rec->v[0];
+		adc_values[4] = rec->v[1];
+		break;
+#ifdef GPS
+	case 'F':
+		gps_fix.timestamp = now;
+		gps_fix.alt = rec->v[0];
+		gps_fix.quality = 1;
+		/* Never 0, that's before the first fix */
+		if (!++ gps_count)
+			gps_count = 1;
+		break;
+#endif
+	default:
+		fprintf(stderr, "Line %lu: unknown record type '%c'\n",
+				log_line, rec->type);
+	}
+}
+
+static unsigned long updates;
+static clock_t start;
+
+static void finish(void) {
+	double wall = (double) (clock() - start) / CLOCKS_PER_SEC;
+	double sim = (double) now / F_CPU;
+
+	fflush(stdout);
+	fprintf(stderr, "%lu control updates, %.1f s simulated in %.2f s "
+			"(%.0fx real time)\n", updates, sim, wall,
+			wall > 0 ? sim / wall : 0);
+	fprintf(stderr, "latency avg %.0fus max %.0fus, last lead %.0fus\n",
+			control_latency.avg * 1e6 / F_CPU,
+			control_latency.max * 1e6 / F_CPU,
+			control_latency.lead * 1e6 / F_CPU);
+#ifdef BLACKBOX
+	/* The gyro records come from adc.c, not built in */
+	fprintf(stderr, "%lu CMPS09 blackbox records\n",
+			bb_records[BB_CMPS]);
+#endif
+	exit(0);
+}
+
+/*
+ * Run whatever is due next: a log record or a pending timeout / TWI
+ * completion, in time order (log records first on a tie).  The replay
+ * ends with the log, the AHRS's own timeouts never run out.
+ */
+void sleep_cpu(void) {
+	struct pending_s ev;
+	uint8_t i, first = 0;
+
+	for (i = 1; i < pending_len; i ++)
+		if (pending[i].when < pending[first].when)
+			first = i;
+
+	if (!pending_len || next_rec.when <= pending[first].when) {
+		if (!next_rec.type)
+			finish();
+
+		now = next_rec.when;
+		record_apply(&next_rec);
+		if (!record_read(&next_rec))
+			next_rec.type = 0;
+		return;
+	}
+
+	ev = pending[first];
+	pending[first] = pending[-- pending_len];
+	if (ev.when > now)
+		now = ev.when;
+
+	if (ev.job) {
+		twi_complete(ev.job);
+		if (ev.job->finished)
+			ev.job->finished();
+	} else
+		ev.callback();
+}
+
+#define DEG(x)	((double) (x) * 180 / ROLL_PITCH_180DEG)
+
+int main(int argc, char **argv) {
+	int quiet = 0, i;
+	uint8_t ev;
+	struct ahrs_state_s state;
+
+	log_file = stdin;
+	for (i = 1; i < argc; i ++) {
+		if (!strcmp(argv[i], "-q"))
+			quiet = 1;
+		else if (!strcmp(argv[i], "-m") && i + 1 < argc)
+			modes = strtol(argv[++ i], NULL, 0);
+		else if (!strcmp(argv[i], "-e") && i + 1 < argc)
+			calib_file = argv[++ i];
+		else if (!(log_file = fopen(argv[i], "r"))) {
+			perror(argv[i]);
+			return 1;
+		}
+	}
+
+	start = clock();
+	if (!record_read(&next_rec)) {
+		fprintf(stderr, "Empty log\n");
+		return 1;
+	}
+
+	/* Same order as setup() in pilot.c */
+	events_init();
+	ahrs_init();
+	modes_init();
+
+	for (;;) {
+		ev = event_wait((1 << EVENT_AHRS) | CONTROL_RATE_EVENTS);
+		if (!(ev & (1 << EVENT_AHRS))) {
+			control_rate_update();
+			continue;
+		}
+
+		modes_update();
+		control_update();
+		if (ev & CONTROL_RATE_EVENTS)
+			control_rate_update();
+		updates ++;
+
+		if (quiet)
+			continue;
+		ahrs_read(&state);
+		printf("%llu %.3f %.3f %.3f %i %i %i %u %u %u %u\n",
+				(unsigned long long) (now / (F_CPU / 1000000)),
+				DEG(state.pitch), DEG(state.roll),
+				state.yaw * 180.0 / 32768,
+				state.pitch_rate, state.roll_rate,
+				state.yaw_rate,
+				actuators[0], actuators[1],
+				actuators[2], actuators[3]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,55 @@
+# Synthetic sil-replay log: the vehicle sits level and still for the
+# gyro calibration, then is armed and rolls over 2 seconds to tilt
+# degrees and holds that for 8 seconds at the given throttle, with the
+# roll stick at stick (128 is centered).  The gyro, acceleration and
+# magnetometer readings are all consistent with the motion.
+#
+# Licensed under AGPLv3.
+#
+# Usage: awk -v tilt=<deg> -v throttle=<0-255> -v stick=<0-255> \
+#	-f sil/tilt.awk | ./sil-replay
+
+function rnd(x) {
+	return x < 0 ? -int(-x + 0.5) : int(x + 0.5)
+}
+
+BEGIN {
+	if (throttle == "")
+		throttle = 255
+	if (stick == "")
+		stick = 128
+	pi = atan2(0, -1)
+	tilt = tilt * pi / 180
+	k = 0.244140625 * pi / 180	# rad/s per gyro count
+	bias = 1526
+	# CMPS09 offsets subtracted in ahrs.c
+	cal[0] = -135; cal[1] = -20; cal[2] = -90
+	mx = 200; my = 42; mz = 300
+
+	print "# level, then rolled to " tilt * 180 / pi " deg"
+	for (us = 0; us < 16000000; us += 1000) {
+		t = us / 1000000
+		a = w = 0
+		if (t > 6 && t < 8) {
+			ph = (t - 6) / 2 * pi
+			a = tilt * (1 - cos(ph)) / 2
+			w = tilt * pi / 4 * sin(ph)
+		} else if (t >= 8)
+			a = tilt
+		c = cos(a); s = sin(a)
+
+		if (us % 5000 == 0)
+			printf "%d G %d %d %d\n", us, rnd(bias + w / k), \
+				bias, bias
+		if (us % 18000 == 0)
+			printf "%d C %d %d %d %d %d %d\n", us, \
+				rnd(c * my + s * mz + cal[0]), \
+				rnd(mx + cal[1]), \
+				rnd(-s * my + c * mz + cal[2]), \
+				0, rnd(s * 16384), rnd(c * 16384)
+		if (us % 20000 == 0)
+			printf "%d R %d 128 128 %d %d 0\n", us, \
+				(t >= 6 ? throttle : 0), \
+				(t >= 6 ? stick : 128), (t >= 5.5)
+	}
+}
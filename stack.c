@@ -0,0 +1,50 @@
+/*
+ * Stack high-water mark, see stack.h.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+
+#include "stack.h"
+
+/* From the linker script: the end of .bss (and .noinit) and RAMEND */
+extern uint8_t _end, __stack;
+
+/*
+ * Runs from .init1, before r1 is cleared and the stack pointer is set
+ * in .init2, so it has to be naked and can't rely on anything the
+ * compiler would assume.  The stack is still empty at this point.
+ */
+void stack_paint(void) __attribute__((naked, used, section(".init1")));
+void stack_paint(void) {
+	__asm__ __volatile__(
+		"	ldi r30, lo8(_end)\n"
+		"	ldi r31, hi8(_end)\n"
+		"	ldi r24, %0\n"
+		"	ldi r25, hi8(__stack)\n"
+		"	rjmp 2f\n"
+		"1:	st Z+, r24\n"
+		"2:	cpi r30, lo8(__stack)\n"
+		"	cpc r31, r25\n"
+		"	brlo 1b\n"
+		"	breq 1b\n"
+		:: "M" (STACK_CANARY));
+}
+
+uint16_t stack_static_size(void) {
+	return &_end - (uint8_t *) RAMSTART;
+}
+
+uint16_t stack_free(void) {
+	return SP - (uint16_t) &_end;
+}
+
+uint16_t stack_unused(void) {
+	const uint8_t *p = &_end;
+
+	while (p <= &__stack && *p == STACK_CANARY)
+		p ++;
+
+	return p - &_end;
+}
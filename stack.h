@@ -0,0 +1,21 @@
+/*
+ * Stack high-water mark.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Everything between the end of .bss and the top of RAM is painted
+ * with STACK_CANARY at boot, before the C runtime is set up.  There's
+ * no heap, so that region only ever holds the stack, and the bytes at
+ * its bottom that still hold the pattern tell how close the deepest
+ * nesting of interrupt handlers and timer callbacks so far got to the
+ * variables.
+ */
+
+#define STACK_CANARY	0xc5
+
+/* Bytes used by .data and .bss */
+uint16_t stack_static_size(void);
+/* Bytes between the end of .bss and the current stack pointer */
+uint16_t stack_free(void);
+/* Bytes at the bottom of the stack area never touched since boot */
+uint16_t stack_unused(void);
@@ -0,0 +1,124 @@
+/*
+ * Host-side encoder for the telemetry commands (see telemetry.h).
+ *
+ * Licensed under AGPLv3.
+ *
+ * Writes one command frame to stdout, preceded by the 0x00 that makes
+ * the receiver take it as a frame, e.g.:
+ *
+ *   telemetry-cmd set deadband 5 > /dev/ttyUSB0
+ *
+ * The reply shows up in telemetry-decode's output.  Parameters are
+ * given by number or by name as listed by "get", build with the same
+ * CONTROL= as the firmware for the names to match.
+ *
+ * Usage: telemetry-cmd get [<param>] | set <param> <value> | save |
+ *                      reset | key <keys>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "telemetry.h"
+#include "params.h"
+
+/* Built with the firmware's CDEFS so that the ids match */
+#define PARAM_NAME(name, type, def, mi, ma)	#name,
+
+static const char *param_names[] = {
+	PARAMS(PARAM_NAME)
+};
+
+#define PARAM_NAMES	(int) (sizeof(param_names) / sizeof(*param_names))
+
+static uint16_t crc_ccitt_update(uint16_t crc, uint8_t data) {
+	/* Same as avr-libc's _crc_ccitt_update() */
+	data ^= crc & 255;
+	data ^= data << 4;
+
+	return ((((uint16_t) data << 8) | (crc >> 8)) ^
+			(uint8_t) (data >> 4) ^ ((uint16_t) data << 3));
+}
+
+static void send_frame(uint8_t id, const void *payload, int len) {
+	uint8_t raw[TELEM_MAX_CMD + 4], out[TELEM_MAX_CMD + 5];
+	uint16_t crc = 0xffff;
+	int i, code_pos = 0, o = 1;
+
+	raw[0] = id;
+	raw[1] = 0;
+	memcpy(raw + 2, payload, len);
+	for (i = 0; i < len + 2; i ++)
+		crc = crc_ccitt_update(crc, raw[i]);
+	raw[len + 2] = crc & 255;
+	raw[len + 3] = crc >> 8;
+
+	/* COBS, as in telemetry.c */
+	for (i = 0; i < len + 4; i ++)
+		if (raw[i])
+			out[o ++] = raw[i];
+		else {
+			out[code_pos] = o - code_pos;
+			code_pos = o ++;
+		}
+	out[code_pos] = o - code_pos;
+
+	putchar(0);
+	fwrite(out, 1, o, stdout);
+	putchar(0);
+}
+
+static int param_id(const char *arg) {
+	char *end;
+	int i = strtol(arg, &end, 0);
+
+	if (!*end)
+		return i;
+	for (i = 0; i < PARAM_NAMES; i ++)
+		if (!strcmp(arg, param_names[i]))
+			return i;
+
+	fprintf(stderr, "No parameter %s\n", arg);
+	exit(1);
+}
+
+static void usage(void) {
+	fprintf(stderr, "Usage: telemetry-cmd get [<param>] | "
+			"set <param> <value> | save | reset | key <keys>\n");
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	struct telem_cmd_param_s arg;
+	int len;
+
+	if (argc < 2)
+		usage();
+
+	if (!strcmp(argv[1], "get") && argc == 2) {
+		/* Just list the ids and names */
+		for (len = 0; len < PARAM_NAMES; len ++)
+			fprintf(stderr, "%i %s\n", len, param_names[len]);
+	} else if (!strcmp(argv[1], "get") && argc == 3) {
+		arg.id = param_id(argv[2]);
+		send_frame(TELEM_CMD_PARAM_GET, &arg, 1);
+	} else if (!strcmp(argv[1], "set") && argc == 4) {
+		arg.id = param_id(argv[2]);
+		arg.value = strtol(argv[3], NULL, 0);
+		send_frame(TELEM_CMD_PARAM_SET, &arg, sizeof(arg));
+	} else if (!strcmp(argv[1], "save") && argc == 2)
+		send_frame(TELEM_CMD_PARAM_SAVE, NULL, 0);
+	else if (!strcmp(argv[1], "reset") && argc == 2)
+		send_frame(TELEM_CMD_PARAM_RESET, NULL, 0);
+	else if (!strcmp(argv[1], "key") && argc == 3) {
+		len = strlen(argv[2]);
+		if (len > TELEM_MAX_CMD)
+			len = TELEM_MAX_CMD;
+		send_frame(TELEM_CMD_KEY, argv[2], len);
+	} else
+		usage();
+
+	return 0;
+}
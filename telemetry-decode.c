@@ -0,0 +1,258 @@
+/*
+ * Host-side decoder for the binary telemetry frames (see telemetry.h).
+ *
+ * Licensed under AGPLv3.
+ *
+ * Reads the raw serial stream from stdin, or from the file / tty given
+ * on the command line (configure the tty with stty beforehand), and
+ * prints one line per frame.  Anything between delimiters that isn't a
+ * valid frame, such as the plain text boot messages, is printed as is.
+ *
+ * Usage: telemetry-decode [-b <image>] [<input>]
+ *   -b		write the blackbox dump frames into the EEPROM image file
+ *		<image> for blackbox-decode, instead of printing them
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ahrs.h"
+#include "telemetry.h"
+#include "profile.h"
+#include "params.h"
+
+static uint16_t crc_ccitt_update(uint16_t crc, uint8_t data) {
+	/* Same as avr-libc's _crc_ccitt_update() */
+	data ^= crc & 255;
+	data ^= data << 4;
+
+	return ((((uint16_t) data << 8) | (crc >> 8)) ^
+			(uint8_t) (data >> 4) ^ ((uint16_t) data << 3));
+}
+
+static int cobs_decode(const uint8_t *in, int len, uint8_t *out) {
+	int i = 0, o = 0;
+
+	while (i < len) {
+		uint8_t code = in[i ++];
+		uint8_t j;
+
+		if (!code || i + code - 1 > len)
+			return -1;
+		for (j = 1; j < code; j ++)
+			out[o ++] = in[i ++];
+		if (code < 0xff && i < len)
+			out[o ++] = 0;
+	}
+
+	return o;
+}
+
+#define DEG(x)	((double) (x) * 180 / ROLL_PITCH_180DEG)
+
+static FILE *bb_image;
+
+static void print_frame(uint8_t id, const void *payload, int len) {
+	const struct telem_attitude_s *att = payload;
+	const struct telem_rates_s *rates = payload;
+	const struct telem_accel_s *acc = payload;
+	const struct telem_velocity_s *vel = payload;
+	const struct telem_rx_s *rx = payload;
+	const struct telem_motors_s *mot = payload;
+	const struct telem_battery_s *bat = payload;
+	const struct telem_quaternion_s *quat = payload;
+	const struct telem_latency_s *lat = payload;
+	const struct telem_profile_s *prof = payload;
+	const struct telem_jitter_s *jit = payload;
+	const struct telem_blackbox_s *bb = payload;
+	const struct telem_memory_s *mem = payload;
+	const struct telem_param_s *param = payload;
+	const struct telem_ack_s *ack = payload;
+	static const char *section_names[PROF_SECTIONS] = {
+		[PROF_ADC_ISR] = "ADC_vect",
+		[PROF_GYRO] = "gyro_ahrs_update",
+		[PROF_TIMER_ISR] = "TIMER1_COMPA_vect",
+		[PROF_VECTORS] = "vectors_update",
+		[PROF_FUSE] = "vectors_fuse",
+		[PROF_RX_ISR] = "rx ISR",
+		[PROF_CONTROL] = "control_update",
+		[PROF_RATE] = "control_rate_update",
+		[PROF_IRQ_LATENCY] = "irq latency",
+	};
+
+	switch (id) {
+#define CHECK_LEN(s)						\
+		if (len != sizeof(s)) {				\
+			printf("BAD LENGTH %i for id %i\n",	\
+					len, id);		\
+			return;					\
+		}
+	case TELEM_ATTITUDE:
+		CHECK_LEN(*att);
+		printf("ATT %.2f %.2f %.2f\n", DEG(att->pitch),
+				DEG(att->roll), att->yaw * 180.0 / 32768);
+		break;
+	case TELEM_RATES:
+		CHECK_LEN(*rates);
+		printf("RATE %i %i %i\n", rates->pitch, rates->roll,
+				rates->yaw);
+		break;
+	case TELEM_ACCEL:
+		CHECK_LEN(*acc);
+		printf("ACC %.4f %.4f %.4f\n", acc->a[0] / 16384.0,
+				acc->a[1] / 16384.0, acc->a[2] / 16384.0);
+		break;
+	case TELEM_VELOCITY:
+		CHECK_LEN(*vel);
+		printf("V %.2f %.2f %.2f m/s ALT %.2f m\n",
+				vel->v[0] / 25600.0, vel->v[1] / 25600.0,
+				vel->v[2] / 25600.0, vel->alt / 25600.0);
+		break;
+	case TELEM_RX:
+		CHECK_LEN(*rx);
+		printf("RX %i %i %i %i %i %i %i\n", rx->no_signal,
+				rx->co_throttle, rx->co_right, rx->cy_front,
+				rx->cy_right, rx->gyro_sw, rx->right_pot);
+		break;
+	case TELEM_MOTORS:
+		CHECK_LEN(*mot);
+		printf("MOT %i %i %i %i\n", mot->m[0], mot->m[1],
+				mot->m[2], mot->m[3]);
+		break;
+	case TELEM_BATTERY:
+		CHECK_LEN(*bat);
+		/* Same conversions as in pilot.c's setup() */
+		printf("BAT %.2fV %.1fC\n", (double) bat->battery *
+				323 * (991 + 241) / (0x400L * 100 * 241),
+				((int) bat->temperature - 269) * 1100.0 /
+				0x400 / 1000);
+		break;
+	case TELEM_QUATERNION:
+		CHECK_LEN(*quat);
+		printf("Q %f %f %f %f M %f %f %f A %f %f %f\n",
+				quat->q[0], quat->q[1], quat->q[2], quat->q[3],
+				quat->mag[0], quat->mag[1], quat->mag[2],
+				quat->acc[0], quat->acc[1], quat->acc[2]);
+		break;
+	case TELEM_LATENCY:
+		CHECK_LEN(*lat);
+		printf("LAT %.0fus avg %.0fus max %.0fus lead %.0fus\n",
+				lat->cur * 1e6 / F_CPU, lat->avg * 1e6 / F_CPU,
+				lat->max * 1e6 / F_CPU, lat->lead * 1e6 / F_CPU);
+		break;
+	case TELEM_PROFILE:
+		CHECK_LEN(*prof);
+		printf("PROF %s: %i runs, %i/%i/%i cycles\n",
+				prof->section < PROF_SECTIONS ?
+				section_names[prof->section] : "?",
+				prof->count, prof->min, prof->avg, prof->max);
+		break;
+	case TELEM_JITTER:
+		CHECK_LEN(*jit);
+		/* The byte address is what avr-nm shows */
+		printf("JITTER %04x: %i runs, %i/%i/%i cycles late\n",
+				jit->callback * 2, jit->count,
+				jit->min, jit->avg, jit->max);
+		break;
+	case TELEM_BLACKBOX:
+		CHECK_LEN(*bb);
+		if (!bb_image) {
+			printf("BLACKBOX %04x\n", bb->addr);
+			break;
+		}
+		fseek(bb_image, bb->addr, SEEK_SET);
+		fwrite(bb->data, 1, sizeof(bb->data), bb_image);
+		break;
+	case TELEM_MEMORY:
+		CHECK_LEN(*mem);
+		printf("MEM static %i, free %i, never used %i bytes\n",
+				mem->static_size, mem->free, mem->unused);
+		break;
+	case TELEM_PARAM:
+		CHECK_LEN(*param);
+		printf("PARAM %i %.*s = %i (default %i, %i..%i%s)\n",
+				param->id, (int) sizeof(param->name),
+				param->name, param->value, param->def,
+				param->min, param->max,
+				param->type == PARAM_U8 ? ", 8-bit" : "");
+		break;
+	case TELEM_ACK:
+		CHECK_LEN(*ack);
+		printf("ACK %02x seq %i %s\n", ack->cmd, ack->seq,
+				ack->ok ? "ok" : "FAILED");
+		break;
+	default:
+		printf("UNKNOWN id %i, %i bytes\n", id, len);
+	}
+}
+
+static int lost = 0, frames = 0;
+
+static int try_frame(const uint8_t *buf, int len) {
+	static int prev_seq = -1;
+	uint8_t frame[512];
+	uint16_t crc = 0xffff;
+	int n, i;
+
+	n = cobs_decode(buf, len, frame);
+	if (n < 4 || n - 4 > TELEM_MAX_PAYLOAD)
+		return 0;
+	for (i = 0; i < n - 2; i ++)
+		crc = crc_ccitt_update(crc, frame[i]);
+	if (crc != (frame[n - 2] | (frame[n - 1] << 8)))
+		return 0;
+
+	if (prev_seq >= 0)
+		lost += (uint8_t) (frame[1] - prev_seq - 1);
+	prev_seq = frame[1];
+	frames ++;
+
+	print_frame(frame[0], frame + 2, n - 4);
+	return 1;
+}
+
+int main(int argc, char **argv) {
+	FILE *in = stdin;
+	uint8_t buf[512];
+	int len = 0, ch, i;
+
+	for (i = 1; i < argc; i ++) {
+		if (!strcmp(argv[i], "-b") && i + 1 < argc) {
+			if (!(bb_image = fopen(argv[++ i], "wb"))) {
+				perror(argv[i]);
+				return 1;
+			}
+		} else if (!(in = fopen(argv[i], "rb"))) {
+			perror(argv[i]);
+			return 1;
+		}
+	}
+
+	while ((ch = fgetc(in)) != EOF) {
+		if (ch) {
+			if (len < (int) sizeof(buf))
+				buf[len ++] = ch;
+			continue;
+		}
+
+		if (!try_frame(buf, len)) {
+			/*
+			 * Not a frame, probably text.  Text has no delimiter
+			 * of its own so the first frame after it comes glued
+			 * to its end, try whatever follows the last newline.
+			 */
+			for (i = len - 1; i >= 0 && buf[i] != '\n'; i --);
+			fwrite(buf, 1, i + 1, stdout);
+			if (i < 0 || !try_frame(buf + i + 1, len - i - 1))
+				fwrite(buf + i + 1, 1, len - i - 1, stdout);
+		}
+		len = 0;
+		fflush(stdout);
+	}
+
+	fprintf(stderr, "%i frames, %i lost\n", frames, lost);
+	if (bb_image)
+		fclose(bb_image);
+	return 0;
+}
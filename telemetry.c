@@ -0,0 +1,160 @@
+/*
+ * Binary telemetry frames, see telemetry.h for the format.
+ *
+ * Licensed under AGPLv3.
+ */
+
+#include <avr/io.h>
+#include <util/crc16.h>
+
+#include "timer1.h"
+#include "uart.h"
+#include "telemetry.h"
+
+static uint8_t seq = 0;
+volatile uint16_t telem_dropped = 0;
+uint16_t telem_rx_errors = 0;
+
+/*
+ * Consistent Overhead Byte Stuffing.  len must be below 254 so that a
+ * single code byte group is always enough, out needs len + 1 bytes.
+ */
+static uint8_t cobs_encode(const uint8_t *in, uint8_t len, uint8_t *out) {
+	uint8_t code_pos = 0, code = 1, o = 1;
+
+	while (len --) {
+		if (*in) {
+			out[o ++] = *in;
+			code ++;
+		} else {
+			out[code_pos] = code;
+			code_pos = o ++;
+			code = 1;
+		}
+		in ++;
+	}
+	out[code_pos] = code;
+
+	return o;
+}
+
+/*
+ * The reverse, in place (out may be in), returns the decoded length or
+ * 0xff if the code bytes don't add up.
+ */
+static uint8_t cobs_decode(const uint8_t *in, uint8_t len, uint8_t *out) {
+	uint8_t i = 0, o = 0, code, n;
+
+	while (i < len) {
+		code = in[i ++];
+		if (code - 1 > len - i)
+			return 0xff;
+		for (n = 1; n < code; n ++)
+			out[o ++] = in[i ++];
+		if (code < 0xff && i < len)
+			out[o ++] = 0;
+	}
+
+	return o;
+}
+
+uint8_t telem_send(uint8_t id, const void *payload, uint8_t len) {
+	uint8_t raw[TELEM_MAX_PAYLOAD + 4], enc[TELEM_MAX_PAYLOAD + 5];
+	const uint8_t *p = payload;
+	uint16_t crc = 0xffff;
+	uint8_t i, n;
+
+	raw[0] = id;
+	raw[1] = seq ++;
+	for (i = 0; i < len; i ++)
+		raw[2 + i] = p[i];
+	for (i = 0; i < len + 2; i ++)
+		crc = _crc_ccitt_update(crc, raw[i]);
+	raw[len + 2] = crc & 255;
+	raw[len + 3] = crc >> 8;
+
+	n = cobs_encode(raw, len + 4, enc);
+
+	/* Not atomic against writers in interrupt handlers (only debug
+	 * code prints from those) but the worst that can happen is a
+	 * mangled frame which the receiver will discard because of the
+	 * CRC.  Holding interrupts off for the whole frame would cost
+	 * more.  */
+	if (unlikely(serial_tx_free() < n + 1)) {
+		telem_dropped ++;
+		return 0;
+	}
+	for (i = 0; i < n; i ++)
+		serial_write1(enc[i]);
+	serial_write1(0);
+
+	return 1;
+}
+
+/*
+ * The frame coming in: id, seq, payload and CRC plus the code byte.
+ * The rest of a frame that's too long is skipped, rx_len RX_SKIP, so
+ * that it isn't taken for keys.
+ */
+#define RX_SKIP	0xff
+
+static uint8_t rx_buf[TELEM_MAX_CMD + 5];
+static uint8_t rx_len, rx_framing;
+static uint32_t rx_ts;
+
+static uint8_t telem_frame_check(struct telem_cmd_s *cmd) {
+	uint16_t crc = 0xffff;
+	uint8_t i, n;
+
+	n = cobs_decode(rx_buf, rx_len, rx_buf);
+	if (n < 4 || n > TELEM_MAX_CMD + 4)
+		return 0;
+	for (i = 0; i < n - 2; i ++)
+		crc = _crc_ccitt_update(crc, rx_buf[i]);
+	if (rx_buf[n - 2] != (crc & 255) || rx_buf[n - 1] != crc >> 8)
+		return 0;
+
+	cmd->id = rx_buf[0];
+	cmd->seq = rx_buf[1];
+	cmd->len = n - 4;
+	for (i = 0; i < cmd->len; i ++)
+		cmd->payload[i] = rx_buf[2 + i];
+
+	return 1;
+}
+
+int8_t telem_receive(uint8_t ch, struct telem_cmd_s *cmd) {
+	uint32_t now = timer_read();
+
+	if (rx_framing && now - rx_ts > TELEM_RX_TIMEOUT)
+		rx_framing = 0;
+	rx_ts = now;
+
+	if (!ch) {
+		/* Ends a frame if there's one, and starts the next */
+		uint8_t ret = 0;
+
+		if (rx_framing && rx_len && rx_len != RX_SKIP) {
+			ret = telem_frame_check(cmd);
+			if (!ret)
+				telem_rx_errors ++;
+		}
+		rx_framing = 1;
+		rx_len = 0;
+		return ret;
+	}
+
+	if (!rx_framing)
+		return -1;
+
+	if (rx_len == RX_SKIP)
+		return 0;
+	if (unlikely(rx_len >= sizeof(rx_buf))) {
+		telem_rx_errors ++;
+		rx_len = RX_SKIP;
+		return 0;
+	}
+	rx_buf[rx_len ++] = ch;
+
+	return 0;
+}
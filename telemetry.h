@@ -0,0 +1,174 @@
+/*
+ * Binary telemetry frames.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Every frame on the wire is the COBS encoding of:
+ *
+ *   [id] [seq] [payload ...] [crc16 lo] [crc16 hi]
+ *
+ * followed by a single 0x00 delimiter.  The CRC is the CCITT one as in
+ * avr-libc's _crc_ccitt_update(), initial value 0xffff, over id, seq and
+ * the payload.  seq is incremented for every frame sent so the receiver
+ * can count lost frames.  Payloads are the packed little-endian structs
+ * below, the AVR's native layout.  This header is shared with the host
+ * side decoder (telemetry-decode.c).
+ *
+ * Commands come in on the RX line in the same framing, with their own
+ * seq, and are told from the single-key commands (see pilot.c) by the
+ * 0x00 that has to precede the first frame: after a 0x00 everything up
+ * to the next 0x00 is a frame, until nothing comes in for
+ * TELEM_RX_TIMEOUT, then it's keys again.  Frames with a bad CRC or a
+ * payload over TELEM_MAX_CMD are dropped and counted in
+ * telem_rx_errors.  A good
+ * get or set is answered with a TELEM_PARAM, any other command but
+ * TELEM_CMD_KEY, and a failed one, with a TELEM_ACK.
+ */
+
+#define TELEM_MAX_PAYLOAD	40
+#define TELEM_MAX_CMD		16
+#define TELEM_RX_TIMEOUT	(F_CPU / 5) /* 0.2s in timer_read() cycles */
+
+enum telem_id_e {
+	TELEM_ATTITUDE = 1,
+	TELEM_RATES,
+	TELEM_ACCEL,
+	TELEM_VELOCITY,
+	TELEM_RX,
+	TELEM_MOTORS,
+	TELEM_BATTERY,
+	TELEM_QUATERNION,
+	TELEM_LATENCY,
+	TELEM_PROFILE,
+	TELEM_JITTER,
+	TELEM_BLACKBOX,
+	TELEM_MEMORY,
+	TELEM_PARAM,
+	TELEM_ACK,
+};
+
+enum telem_cmd_e {
+	TELEM_CMD_KEY = 0x80,	/* Payload is single-key commands */
+	TELEM_CMD_PARAM_GET,	/* struct telem_cmd_param_s, no value */
+	TELEM_CMD_PARAM_SET,	/* struct telem_cmd_param_s */
+	TELEM_CMD_PARAM_SAVE,	/* All to the EEPROM, no payload */
+	TELEM_CMD_PARAM_RESET,	/* All back to the defaults, no payload */
+};
+
+/* pitch/roll in ROLL_PITCH_180DEG units, yaw 32768 == 180 deg, see ahrs.h */
+struct telem_attitude_s {
+	int32_t pitch, roll;
+	int16_t yaw;
+} __attribute__((packed));
+
+struct telem_rates_s {
+	int16_t pitch, roll, yaw;
+} __attribute__((packed));
+
+/* accel_acceleration[], 0x4000 is about 1g */
+struct telem_accel_s {
+	int16_t a[3];
+} __attribute__((packed));
+
+/* The velocity and altitude estimate, cm/s << 8 and cm << 8, see nav.h */
+struct telem_velocity_s {
+	int32_t v[3];
+	int32_t alt;
+} __attribute__((packed));
+
+struct telem_rx_s {
+	uint8_t no_signal;
+	uint8_t co_throttle, co_right, cy_front, cy_right;
+	uint8_t gyro_sw, right_pot;
+} __attribute__((packed));
+
+struct telem_motors_s {
+	uint16_t m[4];
+} __attribute__((packed));
+
+/* Raw ADC readings, battery against 3.3V, temperature against 1.1V */
+struct telem_battery_s {
+	uint16_t battery, temperature;
+} __attribute__((packed));
+
+/* The floating-point filter's state, see ahrs-ekf-float.c */
+struct telem_quaternion_s {
+	float q[4];
+	float mag[3];
+	float acc[3];
+} __attribute__((packed));
+
+/* Sensor read to actuator update, and how far ahead of the estimate the
+ * last attitude was predicted (see control.c), in cycles */
+struct telem_latency_s {
+	uint32_t cur, avg, max;
+	uint32_t lead;
+} __attribute__((packed));
+
+/* One profiled section (enum prof_section_e in profile.h), in cycles */
+struct telem_profile_s {
+	uint8_t section;
+	uint16_t count;
+	uint16_t min, avg, max;
+} __attribute__((packed));
+
+/* Lateness of one set_timeout() user's callbacks, callback is the
+ * function's (word) address, in cycles */
+struct telem_jitter_s {
+	uint16_t callback;
+	uint16_t count;
+	uint16_t min, avg, max;
+} __attribute__((packed));
+
+/* A piece of the blackbox EEPROM (see blackbox.h) at byte address addr */
+struct telem_blackbox_s {
+	uint16_t addr;
+	uint8_t data[32];
+} __attribute__((packed));
+
+/* RAM use in bytes, see stack.h */
+struct telem_memory_s {
+	uint16_t static_size;	/* .data + .bss */
+	uint16_t free;		/* .bss end to the current stack pointer */
+	uint16_t unused;	/* Stack area never touched since boot */
+} __attribute__((packed));
+
+/* A parameter and its range, see params.h, the reply to a get or set */
+struct telem_param_s {
+	uint8_t id;
+	uint8_t type;		/* enum param_type_e */
+	int16_t value, def, min, max;
+	char name[10];		/* PARAM_NAME_LEN, NUL-terminated */
+} __attribute__((packed));
+
+/* The reply to a command that has no data to return or that failed */
+struct telem_ack_s {
+	uint8_t cmd, seq;
+	uint8_t ok;
+} __attribute__((packed));
+
+struct telem_cmd_param_s {
+	uint8_t id;		/* enum param_id_e */
+	int16_t value;
+} __attribute__((packed));
+
+struct telem_cmd_s {
+	uint8_t id, seq;	/* enum telem_cmd_e and the sender's count */
+	uint8_t len;
+	uint8_t payload[TELEM_MAX_CMD];
+};
+
+/*
+ * Returns 0 and drops the whole frame if the UART's transmit buffer
+ * can't take it right now, so a frame is never cut short.
+ */
+uint8_t telem_send(uint8_t id, const void *payload, uint8_t len);
+
+/*
+ * Feed one received byte, returns 1 and fills in *cmd when it completes
+ * a good frame, -1 if it's not part of a frame (a key) and 0 otherwise.
+ */
+int8_t telem_receive(uint8_t ch, struct telem_cmd_s *cmd);
+
+extern volatile uint16_t telem_dropped;
+extern uint16_t telem_rx_errors;
@@ -8,7 +8,9 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 
+#include "hal.h"
 #include "timer1.h"
+#include "profile.h"
 
 #ifndef NULL
 # define NULL 0
@@ -67,8 +69,7 @@ uint32_t timer_read(void) {
 		timer_overflow();
 	}
 
-	sreg = SREG;
-	cli();
+	sreg = irq_save();
 
 	lo = TCNT1, hi = timer_cycles;
 	/*
@@ -81,10 +82,27 @@ uint32_t timer_read(void) {
 	if (unlikely((TIFR1 & 1) && lo < 0x8000))
 		hi ++;
 
-	SREG = sreg;
+	irq_restore(sreg);
 	return ((uint32_t) hi << 16) | lo;
 }
 
+/*
+ * Extend a 16-bit TCNT1 value latched by the hardware less than 65536
+ * cycles ago (an input capture) to a full timer_read() time, much
+ * cheaper than the latter.  Interrupts disabled here.
+ */
+uint32_t timer_extend(uint16_t stamp) {
+	uint16_t lo = TCNT1, hi = timer_cycles;
+
+	/* Same as in timer_read() */
+	if (unlikely((TIFR1 & 1) && lo < 0x8000))
+		hi ++;
+	if (stamp > lo)
+		hi --;
+
+	return ((uint32_t) hi << 16) | stamp;
+}
+
 /* Burn some cycles */
 void my_delay(uint16_t msecs) {
 	uint32_t end = timer_read() + (uint32_t) msecs * (F_CPU / 1000);
@@ -106,54 +124,100 @@ void my_delay(uint16_t msecs) {
  * overflow do its job, but if the callbacks don't take too long, they
  * could be given the comfort of interrupts disabled which would simplify
  * the code here a little.
+ *
+ * The pending timeouts are kept in a binary min-heap ordered by "when"
+ * so both adding one and taking the earliest one off cost at most
+ * log2(MAX_TIMEOUTS) == 4 sift steps (one 6-byte entry copy and one
+ * 32-bit compare each) no matter how many are pending.  That bounds the
+ * interrupts-disabled window in set_timeout() to the sift-up plus one
+ * update_timeouts() call, on the order of 200 cycles (about 13us) for
+ * a full heap, and the same for each pop in TIMER1_COMPA_vect.  Timeouts
+ * set for the same moment are not guaranteed to run in the order they
+ * were set.
+ *
+ * If the heap is full the new timeout is refused rather than overwriting
+ * anything, set_timeout() returns non-zero and timeouts_lost is
+ * incremented.
  */
 #define MAX_TIMEOUTS	16
 
 static struct timeout_s {
 	uint32_t when;
 	void (*callback)(void);
-	uint8_t next;
 } timeouts[MAX_TIMEOUTS];
-static uint8_t next = 0xff;
-static uint8_t k = 0;
+static uint8_t timeouts_len = 0;
+volatile uint8_t timeouts_lost = 0;
+
+#define BEFORE(a, b)	((uint32_t) ((a) - (b)) >> 31)
 
-void set_timeout(uint32_t when, void (*callback)(void)) {
-	uint8_t i, *j, sreg;
+uint8_t set_timeout(uint32_t when, void (*callback)(void)) {
+	uint8_t i, parent, sreg;
 
-	sreg = SREG;
-	cli();
+	sreg = irq_save();
 
-	for (i = next, j = &next; i != 0xff; j = &timeouts[i].next, i = *j)
-		if ((uint32_t) (when - timeouts[i].when) >> 31)
+	if (unlikely(timeouts_len >= MAX_TIMEOUTS)) {
+		timeouts_lost ++;
+		irq_restore(sreg);
+		return 1;
+	}
+
+	/* Sift up */
+	for (i = timeouts_len ++; i; i = parent) {
+		parent = (i - 1) >> 1;
+		if (!BEFORE(when, timeouts[parent].when))
 			break;
-	for (; timeouts[k].callback; k = (k + 1) & (MAX_TIMEOUTS - 1));
-	timeouts[k].when = when;
-	timeouts[k].callback = callback;
-	timeouts[k].next = i;
-	*j = k;
+		timeouts[i] = timeouts[parent];
+	}
+	timeouts[i].when = when;
+	timeouts[i].callback = callback;
 
-	if (j == &next)
+	if (i == 0)
 		update_timeouts();
 
-	SREG = sreg;
+	irq_restore(sreg);
+	return 0;
+}
+
+/* Remove the earliest timeout, interrupts disabled here */
+static void pop_timeout(void) {
+	struct timeout_s *last = &timeouts[-- timeouts_len];
+	uint8_t i, child;
+
+	/* Sift the last entry down from the top */
+	for (i = 0; (child = 2 * i + 1) < timeouts_len; i = child) {
+		if (child + 1 < timeouts_len && BEFORE(timeouts[child + 1].when,
+					timeouts[child].when))
+			child ++;
+		if (!BEFORE(timeouts[child].when, last->when))
+			break;
+		timeouts[i] = timeouts[child];
+	}
+	timeouts[i] = *last;
 }
 
 static volatile uint8_t updating = 0;
 static volatile uint8_t updated;
 
 ISR(TIMER1_COMPA_vect) {
+	PROF_IRQ_ENTRY();
+	PROF_START(PROF_TIMER_ISR);
 	uint32_t now;
 
-	TIMSK1 = 0x01;
+	TIMSK1 &= ~0x02;
 
 #if 0
 	updating = 1;
 #endif
 
+	if (unlikely(!timeouts_len)) {
+		PROF_END(PROF_TIMER_ISR);
+		return;
+	}
+
 	do {
-		void (*cb)(void) = timeouts[next].callback;
-		timeouts[next].callback = NULL;
-		next = timeouts[next].next;
+		void (*cb)(void) = timeouts[0].callback;
+		PROF_TIMEOUT(cb, timeouts[0].when);
+		pop_timeout();
 		updated = 0;
 
 		sei();
@@ -161,11 +225,12 @@ ISR(TIMER1_COMPA_vect) {
 		cli();
 
 		now = timer_read();
-	} while (next != 0xff && (uint32_t) (timeouts[next].when - now) >> 31);
+	} while (timeouts_len && BEFORE(timeouts[0].when, now));
 
 	updating = 0;
 	if (!updated)
 		update_timeouts();
+	PROF_END(PROF_TIMER_ISR);
 }
 
 /*
@@ -185,11 +250,12 @@ static void update_timeouts(void) {
 	if (unlikely(updating))
 		return;
 
-	TIMSK1 = 0x01;
+	/* Only touch OCIE1A, OCIE1B belongs to the actuators */
+	TIMSK1 &= ~0x02;
 	updated = 1;
-	if (next == 0xff)
+	if (!timeouts_len)
 		return;
-	diff = (timeouts[next].when >> 16) - timer_cycles;
+	diff = (timeouts[0].when >> 16) - timer_cycles;
 	if (diff > 0)
 		return;
 
@@ -199,12 +265,12 @@ static void update_timeouts(void) {
 	 * conditions.  The hope is that this function will not take
 	 * longer than MIN_DELAY cycles.
 	 */
-	ocra = timeouts[next].when;
+	ocra = timeouts[0].when;
 	tcnt = TCNT1;
 	if (unlikely(diff || unlikely(ocra < MIN_DELAY ||
 					ocra - MIN_DELAY < tcnt)))
 		ocra = tcnt + MIN_DELAY;
 	OCR1A = ocra;
 	TIFR1 |= 0x02; /* Why is this needed? CPU bug? */
-	TIMSK1 = 0x03;
+	TIMSK1 |= 0x02;
 }
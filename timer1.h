@@ -4,10 +4,19 @@
  * Licensed under AGPLv3.
  */
 
+#ifndef _TIMER1_H
+#define _TIMER1_H
+
 void timer_init(void);
 uint32_t timer_read(void);
+uint32_t timer_extend(uint16_t stamp);
 void my_delay(uint16_t msecs);
-void set_timeout(uint32_t when, void (*callback)(void));
+uint8_t set_timeout(uint32_t when, void (*callback)(void));
+extern volatile uint8_t timeouts_lost;
 
 #define likely(x)	__builtin_expect((x), 1)
 #define unlikely(x)	__builtin_expect((x), 0)
+/* Keeps the compiler from moving memory accesses across it */
+#define barrier()	__asm__ __volatile__ ("" ::: "memory")
+
+#endif /* _TIMER1_H */
@@ -0,0 +1,506 @@
+/*
+ * Cycle and accuracy benchmark for the fixed-point kernels in trig.c,
+ * trig.h, isqrt.S and fixmul.S.
+ *
+ * Licensed under AGPLv3.
+ *
+ * Build with "make bench" and upload trig-bench.hex, or run it under
+ * simavr with "make bench-sim".  Results go out on the UART as one
+ * line per kernel:
+ *
+ *   <name>: cycles <min> <avg> <max> err <max> <rms>
+ *
+ * Cycles are TCNT1 ticks (no prescaler) per call with interrupts
+ * disabled, minus the cost of reading TCNT1 itself, so they include
+ * loading the arguments from and storing the results to RAM like any
+ * real caller would.  Errors are against a floating-point reference,
+ * in LSBs of the kernel's output (1/32768 for the sines, vector units
+ * for the rotations).  avr-libc's double is really a float, good to
+ * about 1e-7 relative, or some 0.003 LSB on a full-scale sine.
+ *
+ * The 16-bit sines are run over every possible input, the rest over
+ * evenly spread or pseudo-random inputs in the ranges the AHRS uses.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <math.h>
+
+#include "timer1.h"
+#include "uart.h"
+#include "ahrs.h"
+#include "trig.h"
+#include "isqrt.h"
+#include "fixmul.h"
+
+struct bench_s {
+	uint16_t min, max;
+	uint32_t sum, count;
+	double maxerr, sumsq;
+};
+
+static uint16_t overhead;
+
+static void bench_reset(struct bench_s *b) {
+	b->min = 0xffff;
+	b->max = 0;
+	b->sum = b->count = 0;
+	b->maxerr = b->sumsq = 0;
+}
+
+static void bench_cycles(struct bench_s *b, uint16_t cycles) {
+	cycles -= overhead;
+	if (cycles < b->min)
+		b->min = cycles;
+	if (cycles > b->max)
+		b->max = cycles;
+	b->sum += cycles;
+	b->count ++;
+}
+
+static void bench_err(struct bench_s *b, double err) {
+	err = fabs(err);
+	if (err > b->maxerr)
+		b->maxerr = err;
+	b->sumsq += err * err;
+}
+
+/*
+ * The inputs and results go through volatiles so the compiler can
+ * neither hoist the computation out of the timed window nor drop it.
+ */
+#define TIMED(b, stmt)				\
+	do {					\
+		uint16_t t0, t1;		\
+		cli();				\
+		t0 = TCNT1;			\
+		stmt;				\
+		t1 = TCNT1;			\
+		sei();				\
+		bench_cycles(b, t1 - t0);	\
+	} while (0)
+
+static volatile int16_t in16, out16, in_vec[3], in_vec2[3], out_vec[3];
+static volatile int32_t in32, in_p, in_r;
+static volatile uint32_t inu32, outu32;
+
+static void report(const char *name, struct bench_s *b, uint32_t errs) {
+	/* Don't let the UART buffer drop any of it */
+	while (serial_tx_free() < 100);
+
+	serial_write_str_P(name);
+	serial_write_str_P(PSTR(": cycles"));
+	serial_write_dec32(b->min);
+	serial_write_fp32((b->sum * 10 + b->count / 2) / b->count, 10);
+	serial_write_dec32(b->max);
+	if (errs) {
+		serial_write_str_P(PSTR(" err"));
+		serial_write_fp32(b->maxerr * 1000 + 0.5, 1000);
+		serial_write_fp32(sqrt(b->sumsq / errs) * 1000 + 0.5, 1000);
+	}
+	serial_write_eol();
+}
+
+static uint32_t lfsr = 1;
+
+static uint32_t rand32(void) {
+	/* Galois LFSR, taps for a 2^32 - 1 period */
+	lfsr = (lfsr >> 1) ^ (-(lfsr & 1) & 0xd0000001);
+	return lfsr;
+}
+
+#define RAD16(x)	((double) (x) * M_PI / 32768)
+#define RAD32(x)	((double) (x) * M_PI / ROLL_PITCH_180DEG)
+
+static void bench_sin16(const char *name, int16_t (*fn)(int16_t)) {
+	struct bench_s b;
+	uint32_t i;
+
+	bench_reset(&b);
+	for (i = 0; i < 0x10000; i ++) {
+		in16 = i;
+		TIMED(&b, out16 = fn(in16));
+		bench_err(&b, out16 - sin(RAD16((int16_t) i)) * 32768);
+	}
+	report(name, &b, b.count);
+}
+
+static void bench_sin32(void) {
+	struct bench_s b;
+	int32_t x;
+
+	bench_reset(&b);
+	for (x = -ROLL_PITCH_180DEG; x <= ROLL_PITCH_180DEG; x += 21973) {
+		in32 = x;
+		TIMED(&b, out16 = sin_32_l(in32));
+		bench_err(&b, out16 - sin(RAD32(x)) * 32768);
+	}
+	report(PSTR("sin_32_l"), &b, b.count);
+}
+
+static void random_vec(int16_t v[3], int16_t len) {
+	/* Roughly uniform direction, length about len */
+	double x = (int16_t) rand32(), y = (int16_t) rand32(),
+	       z = (int16_t) rand32();
+	double n = sqrt(x * x + y * y + z * z) + 1;
+
+	v[0] = x * len / n;
+	v[1] = y * len / n;
+	v[2] = z * len / n;
+}
+
+/* Any yaw, pitch and roll within +/- range */
+static void random_angles(int16_t *y, int32_t *p, int32_t *r,
+		int32_t range) {
+	*y = rand32();
+	*p = (int32_t) (rand32() % (2 * (uint32_t) range)) - range;
+	*r = (int32_t) (rand32() % (2 * (uint32_t) range)) - range;
+}
+
+/* The same sequence of rotations as in trig.h, done in floating-point */
+static void rotate_ref(double ret[3], const int16_t v[3],
+		int16_t y, int32_t p, int32_t r) {
+	double c, s, a1, a2, x;
+
+	c = cos(RAD32(r)), s = sin(RAD32(r));
+	a1 = v[1] * c - v[2] * s;
+	a2 = v[2] * c + v[1] * s;
+	c = cos(RAD32(p)), s = sin(RAD32(p));
+	x = v[0] * c - a2 * s;
+	ret[2] = a2 * c + v[0] * s;
+	c = cos(RAD16(y)), s = sin(RAD16(y));
+	ret[1] = a1 * c - x * s;
+	ret[0] = x * c + a1 * s;
+}
+
+static void rotate_rev_ref(double ret[3], const int16_t v[3],
+		int16_t y, int32_t p, int32_t r) {
+	double c, s, a0, a1, z;
+
+	c = cos(RAD16(-y)), s = sin(RAD16(-y));
+	a0 = v[0] * c + v[1] * s;
+	a1 = v[1] * c - v[0] * s;
+	c = cos(RAD32(-p)), s = sin(RAD32(-p));
+	z = v[2] * c + a0 * s;
+	ret[0] = a0 * c - v[2] * s;
+	c = cos(RAD32(-r)), s = sin(RAD32(-r));
+	ret[2] = z * c + a1 * s;
+	ret[1] = a1 * c - z * s;
+}
+
+#define VEC_COPY(d, s)	(d[0] = s[0], d[1] = s[1], d[2] = s[2])
+
+static void bench_rotate(const char *name, uint8_t rev, int32_t range) {
+	struct bench_s b;
+	int16_t v[3], a[3], ret[3], y;
+	int32_t p, r;
+	double ref[3];
+	uint16_t i;
+
+	bench_reset(&b);
+	for (i = 0; i < 4096; i ++) {
+		random_vec(v, 0x4000);
+		random_angles(&y, &p, &r, range);
+		VEC_COPY(in_vec, v);
+		in16 = y, in_p = p, in_r = r;
+		if (rev) {
+			TIMED(&b, VEC_COPY(a, in_vec);
+					rotate_rev(ret, a, in16, in_p, in_r);
+					VEC_COPY(out_vec, ret));
+			rotate_rev_ref(ref, v, y, p, r);
+		} else {
+			TIMED(&b, VEC_COPY(a, in_vec);
+					rotate(ret, a, in16, in_p, in_r);
+					VEC_COPY(out_vec, ret));
+			rotate_ref(ref, v, y, p, r);
+		}
+		bench_err(&b, ret[0] - ref[0]);
+		bench_err(&b, ret[1] - ref[1]);
+		bench_err(&b, ret[2] - ref[2]);
+	}
+	report(name, &b, b.count * 3);
+}
+
+/*
+ * The matrix is timed on its own, the error is for the complete
+ * matrix construction plus multiply
+ */
+static void bench_dcm(const char *name, uint8_t rev, int32_t range) {
+	struct bench_s b, bm;
+	struct dcm_s dcm;
+	int16_t v[3], a[3], ret[3], y;
+	int32_t p, r;
+	double ref[3];
+	uint16_t i;
+
+	bench_reset(&b);
+	bench_reset(&bm);
+	for (i = 0; i < 4096; i ++) {
+		random_vec(v, 0x4000);
+		random_angles(&y, &p, &r, range);
+		VEC_COPY(in_vec, v);
+		in16 = y, in_p = p, in_r = r;
+		TIMED(&bm, dcm_from_euler(&dcm, in16, in_p, in_r));
+		if (rev) {
+			TIMED(&b, VEC_COPY(a, in_vec);
+					dcm_rotate_rev(&dcm, ret, a);
+					VEC_COPY(out_vec, ret));
+			rotate_rev_ref(ref, v, y, p, r);
+		} else {
+			TIMED(&b, VEC_COPY(a, in_vec);
+					dcm_rotate(&dcm, ret, a);
+					VEC_COPY(out_vec, ret));
+			rotate_ref(ref, v, y, p, r);
+		}
+		bench_err(&b, ret[0] - ref[0]);
+		bench_err(&b, ret[1] - ref[1]);
+		bench_err(&b, ret[2] - ref[2]);
+	}
+	if (!rev)
+		report(PSTR("dcm_from_euler"), &bm, 0);
+	report(name, &b, b.count * 3);
+}
+
+static void bench_rotate_z(const char *name, int32_t range) {
+	struct bench_s b;
+	int16_t y;
+	int32_t p, r;
+	uint16_t i;
+
+	bench_reset(&b);
+	for (i = 0; i < 4096; i ++) {
+		random_angles(&y, &p, &r, range);
+		in16 = y, in_p = p, in_r = r;
+		TIMED(&b, out16 = rotate_z(in16, in_p, in_r));
+		bench_err(&b, out16 -
+				cos(RAD32(p)) * cos(RAD32(r)) * 32768);
+	}
+	report(name, &b, b.count);
+}
+
+/*
+ * cross() is used with magnetometer-sized vectors (|v| about 400 and a
+ * factor of up to 4000) and accelerometer-sized ones (|v| about 0x4000
+ * with a factor of 1), anything bigger overflows inside.
+ */
+static void bench_cross(const char *name, int16_t len, uint16_t m) {
+	struct bench_s b;
+	int16_t va[3], vb[3], a[3], c[3], ret[3];
+	double ref[3];
+	uint16_t i;
+
+	bench_reset(&b);
+	for (i = 0; i < 4096; i ++) {
+		random_vec(va, len);
+		random_vec(vb, len);
+		VEC_COPY(in_vec, va);
+		VEC_COPY(in_vec2, vb);
+		TIMED(&b, VEC_COPY(a, in_vec); VEC_COPY(c, in_vec2);
+				cross(ret, a, c, m);
+				VEC_COPY(out_vec, ret));
+		ref[0] = ((double) va[1] * vb[2] - (double) va[2] * vb[1]) *
+			m / 65536;
+		ref[1] = ((double) va[2] * vb[0] - (double) va[0] * vb[2]) *
+			m / 65536;
+		ref[2] = ((double) va[0] * vb[1] - (double) va[1] * vb[0]) *
+			m / 65536;
+		bench_err(&b, ret[0] - ref[0]);
+		bench_err(&b, ret[1] - ref[1]);
+		bench_err(&b, ret[2] - ref[2]);
+	}
+	report(name, &b, b.count * 3);
+}
+
+static void bench_hypot3(void) {
+	struct bench_s b;
+	int16_t v[3], a[3];
+	uint16_t i;
+
+	bench_reset(&b);
+	for (i = 0; i < 4096; i ++) {
+		random_vec(v, 0x4000);
+		VEC_COPY(in_vec, v);
+		TIMED(&b, VEC_COPY(a, in_vec); outu32 = hypot3(a));
+		bench_err(&b, (double) outu32 - ((double) v[0] * v[0] +
+					(double) v[1] * v[1] +
+					(double) v[2] * v[2]));
+	}
+	report(PSTR("hypot3"), &b, b.count);
+}
+
+static void bench_isqrt32(void) {
+	struct bench_s b;
+	uint32_t n, i, s;
+
+	bench_reset(&b);
+	for (i = 0; i < 0x10000; i ++) {
+		/* Random inputs, and squares or the numbers right below
+		 * them where any rounding would show */
+		n = (i & 1) ? rand32() : i * i - ((i >> 1) & 1);
+		inu32 = n;
+		TIMED(&b, outu32 = isqrt32(inu32));
+
+		/* The exact floor(sqrt(n)), the float alone isn't enough */
+		s = sqrt(n);
+		if (s > 0xffff)
+			s = 0xffff;
+		while (s * s > n)
+			s --;
+		while (s < 0xffff && (s + 1) * (s + 1) <= n)
+			s ++;
+		bench_err(&b, (double) outu32 - s);
+	}
+	report(PSTR("isqrt32"), &b, b.count);
+}
+
+static void bench_ihypot(void) {
+	struct bench_s b;
+	int16_t x, y;
+	uint16_t i;
+
+	bench_reset(&b);
+	for (i = 0; i < 4096; i ++) {
+		x = rand32(), y = rand32();
+		in_vec[0] = x, in_vec[1] = y;
+		TIMED(&b, out16 = ihypot(in_vec[0], in_vec[1]));
+		bench_err(&b, (uint16_t) out16 -
+				sqrt((double) x * x + (double) y * y));
+	}
+	report(PSTR("ihypot"), &b, b.count);
+}
+
+/* Errors in AHRS yaw LSBs (the top 16 bits) */
+static void bench_atan2(void) {
+	struct bench_s b;
+	int16_t x, y;
+	uint16_t i;
+	double err;
+
+	bench_reset(&b);
+	for (i = 0; i < 4096; i ++) {
+		x = rand32(), y = rand32();
+		in_vec[0] = y, in_vec[1] = x;
+		TIMED(&b, outu32 = atan2_32(in_vec[0], in_vec[1]));
+		err = (int32_t) outu32 / 65536.0 - atan2(y, x) * 32768 / M_PI;
+		if (err > 32768)
+			err -= 65536;
+		else if (err < -32768)
+			err += 65536;
+		bench_err(&b, err);
+	}
+	report(PSTR("atan2_32"), &b, b.count);
+}
+
+/*
+ * The fixmul.S kernels against the plain C expressions they replace,
+ * which avr-gcc compiles into its generic 32-bit multiply and divide.
+ * Errors are against the C results, which are exact.
+ */
+static void bench_fixmul(void) {
+	struct bench_s b, bc;
+	int16_t v[3], a[3];
+	uint16_t i, d;
+	uint32_t n;
+
+	bench_reset(&b);
+	bench_reset(&bc);
+	for (i = 0; i < 4096; i ++) {
+		in_vec[0] = rand32(), in_vec[1] = rand32();
+		TIMED(&b, out16 = mul_15(in_vec[0], in_vec[1]));
+		v[0] = out16;
+		TIMED(&bc, out16 = ((int32_t) in_vec[0] * in_vec[1] +
+					0x3fff) >> 15);
+		bench_err(&b, v[0] - out16);
+	}
+	report(PSTR("mul_15"), &b, b.count);
+	report(PSTR("mul_15 (C)"), &bc, 0);
+
+	bench_reset(&b);
+	bench_reset(&bc);
+	for (i = 0; i < 4096; i ++) {
+		random_vec(v, 0x4000);
+		random_vec(a, 0x4000);
+		VEC_COPY(in_vec, v);
+		VEC_COPY(in_vec2, a);
+		TIMED(&b, out16 = mac3_15(in_vec[0], in_vec2[0],
+					in_vec[1], in_vec2[1],
+					in_vec[2], in_vec2[2]));
+		v[0] = out16;
+		TIMED(&bc, out16 = ((int32_t) in_vec[0] * in_vec2[0] +
+					(int32_t) in_vec[1] * in_vec2[1] +
+					(int32_t) in_vec[2] * in_vec2[2] +
+					0x3fff) >> 15);
+		bench_err(&b, v[0] - out16);
+	}
+	report(PSTR("mac3_15"), &b, b.count);
+	report(PSTR("mac3_15 (C)"), &bc, 0);
+
+	bench_reset(&b);
+	bench_reset(&bc);
+	for (i = 0; i < 4096; i ++) {
+		/* Any quotient that fits in 16 bits */
+		d = rand32() | 1;
+		n = rand32() % ((uint32_t) d << 16);
+		inu32 = n, in16 = d;
+		TIMED(&b, out16 = div_32_16(inu32, in16));
+		d = out16;
+		TIMED(&bc, out16 = inu32 / (uint16_t) in16);
+		bench_err(&b, (double) d - (uint16_t) out16);
+	}
+	report(PSTR("div_32_16"), &b, b.count);
+	report(PSTR("div_32_16 (C)"), &bc, 0);
+}
+
+int main(void) {
+	uint16_t t0, t1;
+
+	serial_init();
+	timer_init();
+	sei();
+
+	cli();
+	t0 = TCNT1;
+	t1 = TCNT1;
+	sei();
+	overhead = t1 - t0;
+
+	serial_write_str_P(PSTR("Kernel: cycles min avg max err max rms "
+				"(LSB)"));
+	serial_write_eol();
+
+	bench_sin16(PSTR("sin_16_bhaskara"), sin_16_bhaskara);
+	bench_sin16(PSTR("sin_16"), sin_16);
+	bench_sin16(PSTR("sin_16_l"), sin_16_l);
+	bench_sin32();
+	/* Separately for the +/- 90 deg pitch and roll the vehicle
+	 * normally stays within */
+	bench_rotate(PSTR("rotate"), 0, ROLL_PITCH_180DEG);
+	bench_rotate(PSTR("rotate (90deg)"), 0, ROLL_PITCH_180DEG >> 1);
+	bench_rotate(PSTR("rotate_rev"), 1, ROLL_PITCH_180DEG);
+	bench_rotate(PSTR("rotate_rev (90deg)"), 1, ROLL_PITCH_180DEG >> 1);
+	bench_dcm(PSTR("dcm_rotate"), 0, ROLL_PITCH_180DEG);
+	bench_dcm(PSTR("dcm_rotate_rev"), 1, ROLL_PITCH_180DEG);
+	bench_rotate_z(PSTR("rotate_z"), ROLL_PITCH_180DEG);
+	bench_rotate_z(PSTR("rotate_z (90deg)"), ROLL_PITCH_180DEG >> 1);
+	bench_cross(PSTR("cross (mag)"), 400, 4000);
+	bench_cross(PSTR("cross (acc)"), 0x4000, 1);
+	bench_hypot3();
+	bench_isqrt32();
+	bench_ihypot();
+	bench_atan2();
+	bench_fixmul();
+
+	serial_write_str_P(PSTR("Done"));
+	serial_write_eol();
+	serial_flush();
+
+	/* simavr exits on sleep with interrupts off */
+	cli();
+	sleep_enable();
+	for (;;)
+		sleep_cpu();
+
+	return 0;
+}
@@ -7,19 +7,23 @@
 #include <avr/pgmspace.h>
 
 #include "ahrs.h"
+#include "trig.h"
 
-/* 7th century formula that gives only about 0.0015 maximum error */
+/*
+ * 7th century formula that gives only about 0.0015 maximum error.  The
+ * fraction is reduced by 4 so the divisor fits in 16 bits.
+ */
 int16_t sin_16_bhaskara(int16_t angle) {
 	uint32_t w;
 	if (!(angle & 0x3fff))
 		return angle << 1;
 	if (angle >= 0) {
-		w = (uint32_t) angle * (0x8000 - angle);
-		return (w << 4) / ((5L << 15) - (w >> 13));
+		w = umul_16_32(angle, 0x8000 - angle);
+		return div_32_16(w << 2, (5u << 13) - (w >> 15));
 	}
 	angle = (uint16_t) angle & 0x7fff;
-	w = (uint32_t) angle * (0x8000 - angle);
-	return -(int16_t) ((w << 4) / ((5L << 15) - (w >> 13)));
+	w = umul_16_32(angle, 0x8000 - angle);
+	return -(int16_t) div_32_16(w << 2, (5u << 13) - (w >> 15));
 }
 
 /* 15-bit sine LUT indexed by angle.  */
@@ -94,20 +98,90 @@ const uint16_t sin_lut32[169] PROGMEM = {
 };
 
 int16_t sin_32_l(int32_t x) {
-	int16_t b;
+	uint16_t b, diff;
 	if (x >= 0) {
 		if (x > (ROLL_PITCH_180DEG >> 1))
 			x = ROLL_PITCH_180DEG - x;
 		b = pgm_read_word(sin_lut32 + (x >> 22));
-		return b +
-			(((pgm_read_word(sin_lut32 + (x >> 22) + 1) - b) *
-			  (x & 0x3fffff) + 0x1fffff) >> 22);
+		diff = pgm_read_word(sin_lut32 + (x >> 22) + 1) - b;
+		return b + ((mul_32_16(x & 0x3fffff, diff) + 0x1fffff) >> 22);
 	}
 	x += ROLL_PITCH_180DEG;
 	if (x > (ROLL_PITCH_180DEG >> 1))
 		x = ROLL_PITCH_180DEG - x;
 	b = pgm_read_word(sin_lut32 + (x >> 22));
-	return -b -
-		(((pgm_read_word(sin_lut32 + (x >> 22) + 1) - b) *
-		  (x & 0x3fffff) + 0x1fffff) >> 22);
+	diff = pgm_read_word(sin_lut32 + (x >> 22) + 1) - b;
+	return -b - ((mul_32_16(x & 0x3fffff, diff) + 0x1fffff) >> 22);
+}
+
+/*
+ * Roll, then pitch, then yaw, same as rotate():
+ *
+ *   |  cy cp   sy cr - cy sp sr   -sy sr - cy sp cr |
+ *   | -sy cp   cy cr + sy sp sr   -cy sr + sy sp cr |
+ *   |  sp      cp sr               cp cr            |
+ */
+void dcm_from_euler(struct dcm_s *dcm, int16_t y, int32_t p, int32_t r) {
+	int16_t sy = sin_16_l(y), cy = cos_16_l(y);
+	int16_t sp = sin_32_l(p), cp = cos_32_l(p);
+	int16_t sr = sin_32_l(r), cr = cos_32_l(r);
+	int16_t spsr = mul_15(sp, sr), spcr = mul_15(sp, cr);
+
+	dcm->m[0][0] = mul_15(cy, cp);
+	dcm->m[0][1] = clip_15((int32_t) mul_15(sy, cr) - mul_15(cy, spsr));
+	dcm->m[0][2] = clip_15(-(int32_t) mul_15(sy, sr) - mul_15(cy, spcr));
+	dcm->m[1][0] = -mul_15(sy, cp);
+	dcm->m[1][1] = clip_15((int32_t) mul_15(cy, cr) + mul_15(sy, spsr));
+	dcm->m[1][2] = clip_15(-(int32_t) mul_15(cy, sr) + mul_15(sy, spcr));
+	dcm->m[2][0] = sp;
+	dcm->m[2][1] = mul_15(cp, sr);
+	dcm->m[2][2] = mul_15(cp, cr);
+}
+
+/* atan(i / 128) scaled so that 45 deg is 32768 */
+const uint16_t atan_lut[130] PROGMEM = {
+	0, 326, 652, 978, 1303, 1629, 1954, 2279, 2604, 2929, 3253, 3577,
+	3900, 4223, 4545, 4867, 5188, 5509, 5829, 6148, 6467, 6784, 7101,
+	7418, 7733, 8047, 8361, 8673, 8985, 9296, 9605, 9914, 10221, 10527,
+	10832, 11136, 11439, 11740, 12040, 12339, 12637, 12933, 13228, 13522,
+	13814, 14105, 14394, 14682, 14968, 15253, 15537, 15819, 16100, 16379,
+	16656, 16932, 17206, 17479, 17750, 18020, 18288, 18554, 18819, 19083,
+	19344, 19604, 19862, 20119, 20374, 20627, 20879, 21129, 21378, 21624,
+	21870, 22113, 22355, 22595, 22834, 23070, 23306, 23539, 23771, 24001,
+	24230, 24457, 24682, 24906, 25128, 25349, 25568, 25785, 26001, 26215,
+	26427, 26638, 26848, 27056, 27262, 27467, 27670, 27871, 28072, 28270,
+	28467, 28663, 28857, 29050, 29241, 29430, 29619, 29805, 29991, 30175,
+	30357, 30538, 30718, 30896, 31073, 31248, 31423, 31595, 31767, 31937,
+	32106, 32273, 32439, 32604, 32768, 32768,
+};
+
+/*
+ * Reduced to the first octant, one divide for the tangent there and a
+ * linearly interpolated LUT lookup.  About 0.002 deg maximum error.
+ */
+int32_t atan2_32(int16_t y, int16_t x) {
+	uint16_t ax = x < 0 ? -x : x, ay = y < 0 ? -y : y;
+	uint32_t z, b, a;
+
+	if (!ax && !ay)
+		return 0;
+
+	/* 0 to 65536 for 0 to 45 deg, the one quotient that needs 17 bits */
+	if (ay == ax)
+		z = 0x10000;
+	else if (ay < ax)
+		z = div_32_16((uint32_t) ay << 16, ax);
+	else
+		z = div_32_16((uint32_t) ax << 16, ay);
+
+	b = pgm_read_word(atan_lut + (z >> 9));
+	a = (b << 9) + umul_16_32(pgm_read_word(atan_lut + (z >> 9) + 1) - b,
+			z & 511);
+	a <<= 5;
+
+	if (ay > ax)
+		a = (1ul << 30) - a;
+	if (x < 0)
+		a = (1ul << 31) - a;
+	return y < 0 ? -(int32_t) a : (int32_t) a;
 }
@@ -2,8 +2,15 @@
  * Fixed point sine & cosine and related stuff.
  *
  * Licensed under AGPLv3.
+ *
+ * The multiplies go through the fixmul.h kernels.
  */
 
+#ifndef _TRIG_H
+#define _TRIG_H
+
+#include "fixmul.h"
+
 int16_t sin_16_bhaskara(int16_t angle);
 int16_t sin_16(int16_t x);
 int16_t sin_16_l(int16_t x);
@@ -16,7 +23,7 @@ static inline int16_t cos_16_l(int16_t x) {
 static inline int16_t cos_32_l(int32_t x) {
 	x += ROLL_PITCH_180DEG >> 1;
 	if (x > ROLL_PITCH_180DEG)
-		x -= ROLL_PITCH_180DEG;
+		x -= 2 * (uint32_t) ROLL_PITCH_180DEG;
 	return sin_32_l(x);
 }
 
@@ -26,16 +33,16 @@ static inline void rotate(int16_t ret[3], int16_t v[3],
 
 	/* Roll */
 	c = cos_32_l(r), s = sin_32_l(r);
-	ret[1] = ((int32_t) v[1] * c - (int32_t) v[2] * s + 0x3fff) >> 15;
-	ret[2] = ((int32_t) v[2] * c + (int32_t) v[1] * s + 0x3fff) >> 15;
+	ret[1] = mac2_15(v[1], c, v[2], -s);
+	ret[2] = mac2_15(v[2], c, v[1], s);
 	/* Pitch */
 	c = cos_32_l(p), s = sin_32_l(p);
-	x = ((int32_t) v[0] * c - (int32_t) ret[2] * s + 0x3fff) >> 15;
-	ret[2] = ((int32_t) ret[2] * c + (int32_t) v[0] * s + 0x3fff) >> 15;
+	x = mac2_15(v[0], c, ret[2], -s);
+	ret[2] = mac2_15(ret[2], c, v[0], s);
 	/* Yaw */
 	c = cos_16_l(y), s = sin_16_l(y);
-	ret[1] = ((int32_t) ret[1] * c - (int32_t) x * s + 0x3fff) >> 15;
-	ret[0] = ((int32_t) x * c + (int32_t) ret[1] * s + 0x3fff) >> 15;
+	ret[0] = mac2_15(x, c, ret[1], s);
+	ret[1] = mac2_15(ret[1], c, x, -s);
 }
 
 static inline void rotate_rev(int16_t ret[3], int16_t v[3],
@@ -44,34 +51,99 @@ static inline void rotate_rev(int16_t ret[3], int16_t v[3],
 
 	/* Yaw */
 	c = cos_16_l(-y), s = sin_16_l(-y);
-	ret[0] = ((int32_t) v[0] * c + (int32_t) v[1] * s + 0x3fff) >> 15;
-	ret[1] = ((int32_t) v[1] * c - (int32_t) v[0] * s + 0x3fff) >> 15;
+	ret[0] = mac2_15(v[0], c, v[1], s);
+	ret[1] = mac2_15(v[1], c, v[0], -s);
 	/* Pitch */
 	c = cos_32_l(-p), s = sin_32_l(-p);
-	z = ((int32_t) v[2] * c + (int32_t) ret[0] * s + 0x3fff) >> 15;
-	ret[0] = ((int32_t) ret[0] * c - (int32_t) v[2] * s + 0x3fff) >> 15;
+	z = mac2_15(v[2], c, ret[0], s);
+	ret[0] = mac2_15(ret[0], c, v[2], -s);
 	/* Roll */
 	c = cos_32_l(-r), s = sin_32_l(-r);
-	ret[2] = ((int32_t) z * c + (int32_t) ret[1] * s + 0x3fff) >> 15;
-	ret[1] = ((int32_t) ret[1] * c - (int32_t) z * s + 0x3fff) >> 15;
+	ret[2] = mac2_15(z, c, ret[1], s);
+	ret[1] = mac2_15(ret[1], c, z, -s);
 }
 
 static inline void cross(int16_t *ret, int16_t va[3], int16_t vb[3],
 		uint16_t m) {
-	ret[0] = (((int32_t) va[1] * vb[2] - (int32_t) va[2] * vb[1]) * m +
-			(1 << 15)) >> 16;
-	ret[1] = (((int32_t) va[2] * vb[0] - (int32_t) va[0] * vb[2]) * m +
-			(1 << 15)) >> 16;
-	ret[2] = (((int32_t) va[0] * vb[1] - (int32_t) va[1] * vb[0]) * m +
-			(1 << 15)) >> 16;
+	ret[0] = (mul_32_16(mul_16_32(va[1], vb[2]) -
+				mul_16_32(va[2], vb[1]), m) + (1 << 15)) >> 16;
+	ret[1] = (mul_32_16(mul_16_32(va[2], vb[0]) -
+				mul_16_32(va[0], vb[2]), m) + (1 << 15)) >> 16;
+	ret[2] = (mul_32_16(mul_16_32(va[0], vb[1]) -
+				mul_16_32(va[1], vb[0]), m) + (1 << 15)) >> 16;
 }
 
 static inline uint32_t hypot3(int16_t v[3]) {
-	return (int32_t) v[0] * v[0] + (int32_t) v[1] * v[1] +
-		(int32_t) v[2] * v[2];
+	return mul_16_32(v[0], v[0]) + mul_16_32(v[1], v[1]) +
+		mul_16_32(v[2], v[2]);
 }
 
 /* Rotate_rev { 0, 0, 1 } and return z */
 static inline int16_t rotate_z(int16_t y, int32_t p, int32_t r) {
-	return ((int32_t) cos_32_l(-p) * cos_32_l(-r) + 0x3fff) >> 15;
+	return mul_15(cos_32_l(-p), cos_32_l(-r));
+}
+
+/*
+ * The rotation that rotate() performs as a matrix (direction cosine
+ * matrix), elements scaled by 32768 and clipped to 32767.  Building it
+ * costs the six sin/cos evaluations once, then every vector rotated by
+ * the same angles is just nine multiplies:
+ *
+ * dcm_rotate(dcm, ret, v) is rotate(ret, v, y, p, r),
+ * dcm_rotate_rev(dcm, ret, v) is rotate_rev(ret, v, y, p, r) (the
+ * transpose, i.e. the inverse rotation) and dcm_z(dcm) is
+ * rotate_z(y, p, r).
+ */
+struct dcm_s {
+	int16_t m[3][3];
+};
+
+void dcm_from_euler(struct dcm_s *dcm, int16_t y, int32_t p, int32_t r);
+
+/* Orthonormal rows so no partial sum can overflow for any int16 v */
+static inline void dcm_rotate(const struct dcm_s *dcm,
+		int16_t ret[3], const int16_t v[3]) {
+	ret[0] = mac3_15(dcm->m[0][0], v[0], dcm->m[0][1], v[1],
+			dcm->m[0][2], v[2]);
+	ret[1] = mac3_15(dcm->m[1][0], v[0], dcm->m[1][1], v[1],
+			dcm->m[1][2], v[2]);
+	ret[2] = mac3_15(dcm->m[2][0], v[0], dcm->m[2][1], v[1],
+			dcm->m[2][2], v[2]);
+}
+
+static inline void dcm_rotate_rev(const struct dcm_s *dcm,
+		int16_t ret[3], const int16_t v[3]) {
+	ret[0] = mac3_15(dcm->m[0][0], v[0], dcm->m[1][0], v[1],
+			dcm->m[2][0], v[2]);
+	ret[1] = mac3_15(dcm->m[0][1], v[0], dcm->m[1][1], v[1],
+			dcm->m[2][1], v[2]);
+	ret[2] = mac3_15(dcm->m[0][2], v[0], dcm->m[1][2], v[1],
+			dcm->m[2][2], v[2]);
+}
+
+static inline int16_t dcm_z(const struct dcm_s *dcm) {
+	return dcm->m[2][2];
 }
+
+static inline int16_t clip_15(int32_t x) {
+	if (x > 32767)
+		return 32767;
+	if (x < -32767)
+		return -32767;
+	return x;
+}
+
+/* (a * b) >> 15 for a 32-bit a without a 64-bit multiply, exact as long
+ * as the result fits in 31 bits */
+static inline int32_t mul_32_15(int32_t a, int16_t b) {
+	return (mul_16_32(a >> 16, b) << 1) +
+		(mulsu_16_32(b, (uint16_t) a) >> 15);
+}
+
+/*
+ * atan2(y, x) as a 32-bit binary angle: 1 << 31 is 180 deg (and wraps
+ * to -180 deg), so the top 16 bits are in AHRS yaw units.
+ */
+int32_t atan2_32(int16_t y, int16_t x);
+
+#endif /* _TRIG_H */
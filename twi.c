@@ -1,7 +1,7 @@
 /*
- * Need to rewrite and simplify this, we don't need all this buffering
- * here.
+ * Interrupt-driven TWI/I2C master with a queue of transactions.
  *
+ * Originally based loosely on:
  * twi.c - TWI/I2C library for Wiring & Arduino
  * Copyright (c) 2006 Nicholas Zambetti.  All right reserved.
  *
@@ -18,466 +18,210 @@
  * You should have received a copy of the GNU Lesser General Public
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * We only ever talk to the sensors as the bus master so all of the
+ * slave mode and the intermediate buffering is gone.  Callers queue a
+ * struct twi_job_s and the TWI_vect state machine walks the queue,
+ * reading directly into each job's buffer.  Nobody busy-waits on the bus
+ * except the blocking helpers used during boot.  A register read is one
+ * transaction with a repeated START between the write and the read.
  */
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <compat/twi.h>
 
-#ifndef cbi
-# define cbi(sfr, bit) (_SFR_BYTE(sfr) &= ~_BV(bit))
-#endif
-
-#ifndef sbi
-# define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
-#endif
-
+#include "hal.h"
+#include "timer1.h"
 #include "twi.h"
 
-static volatile uint8_t twi_state;
-static uint8_t twi_slarw;
-
-static void (*twi_onSlaveTransmit)(void);
-static void (*twi_onSlaveReceive)(uint8_t*, int);
-
-static uint8_t twi_masterBuffer[TWI_BUFFER_LENGTH];
-static volatile uint8_t twi_masterBufferIndex;
-static uint8_t twi_masterBufferLength;
-
-static uint8_t twi_txBuffer[TWI_BUFFER_LENGTH];
-static volatile uint8_t twi_txBufferIndex;
-static volatile uint8_t twi_txBufferLength;
-
-static uint8_t twi_rxBuffer[TWI_BUFFER_LENGTH];
-static volatile uint8_t twi_rxBufferIndex;
-
-static volatile uint8_t twi_error;
-
-/* 
- * Function twi_init
- * Desc     readys twi pins and sets twi bitrate
- * Input    none
- * Output   none
- */
-void twi_init(void)
-{
-  // initialize state
-  twi_state = TWI_READY;
-
-  #if defined(__AVR_ATmega168__) || defined(__AVR_ATmega8__) || defined(__AVR_ATmega328P__)
-    // activate internal pull-ups for twi
-    // as per note from atmega8 manual pg167
-    sbi(PORTC, 4);
-    sbi(PORTC, 5);
-  #else
-    // activate internal pull-ups for twi
-    // as per note from atmega128 manual pg204
-    sbi(PORTD, 0);
-    sbi(PORTD, 1);
-  #endif
-
-  // initialize twi prescaler and bit rate
-  cbi(TWSR, TWPS0);
-  cbi(TWSR, TWPS1);
-  TWBR = ((F_CPU / TWI_FREQ) - 16) / 2;
-
-  /* twi bit rate formula from atmega128 manual pg 204
-  SCL Frequency = CPU Clock Frequency / (16 + (2 * TWBR))
-  note: TWBR should be 10 or higher for master mode
-  It is 72 for a 16mhz Wiring board with 100kHz TWI */
-
-  // enable twi module, acks, and twi interrupt
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
-}
-
-/*
- * Function twi_slaveInit
- * Desc     sets slave address and enables interrupt
- * Input    none
- * Output   none
- */
-void twi_setAddress(uint8_t address)
-{
-  // set twi slave address (skip over TWGCE bit)
-  TWAR = address << 1;
-}
-
-void twi_irq_handle(void);
-/*
- * Function twi_readFrom
- * Desc     attempts to become twi bus master and read a
- *          series of bytes from a device on the bus
- * Input    address: 7bit i2c device address
- *          data: pointer to byte array
- *          length: number of bytes to read into array
- * Output   number of bytes read
- */
-uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length)
-{
-  uint8_t i;
-
-  // ensure data will fit into buffer
-  if(TWI_BUFFER_LENGTH < length){
-    return 0;
-  }
-
-  // wait until twi is ready, become master receiver
-  while(TWI_READY != twi_state)
-    if (TWCR & 0x80)
-      twi_irq_handle();
-  twi_state = TWI_MRX;
-  // reset error state (0xFF.. no error occured)
-  twi_error = 0xFF;
-
-  // initialize buffer iteration vars
-  twi_masterBufferIndex = 0;
-  twi_masterBufferLength = length-1;  // This is not intuitive, read on...
-  // On receive, the previously configured ACK/NACK setting is transmitted in
-  // response to the received byte before the interrupt is signalled.
-  // Therefor we must actually set NACK when the _next_ to last byte is
-  // received, causing that NACK to be sent in response to receiving the last
-  // expected byte of data.
-
-  // build sla+w, slave device address + w bit
-  twi_slarw = TW_READ;
-  twi_slarw |= address << 1;
-
-  // send start condition
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA);
-
-  // wait for read operation to complete
-  while(TWI_MRX == twi_state)
-    if (TWCR & 0x80)
-      twi_irq_handle();
-
-  if (twi_masterBufferIndex < length)
-    length = twi_masterBufferIndex;
-
-  // copy twi buffer to data
-  for(i = 0; i < length; ++i)
-    data[i] = twi_masterBuffer[i];
-
-  return length;
-}
+#ifndef NULL
+# define NULL 0
+#endif
 
-/*
- * Function twi_writeTo
- * Desc     attempts to become twi bus master and write a
- *          series of bytes to a device on the bus
- * Input    address: 7bit i2c device address
- *          data: pointer to byte array
- *          length: number of bytes in array
- *          wait: boolean indicating to wait for write or not
- * Output   0 .. success
- *          1 .. length too long for buffer
- *          2 .. address sent, NACK received
- *          3 .. data sent, NACK received
- *          4 .. other twi error (lost bus arbitration, bus error, ..)
- */
-uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait)
-{
-  uint8_t i;
-
-  // ensure data will fit into buffer
-  if(TWI_BUFFER_LENGTH < length){
-    return 1;
-  }
-
-  // wait until twi is ready, become master transmitter
-  while(TWI_READY != twi_state)
-    if (TWCR & 0x80)
-     twi_irq_handle();
-  twi_state = TWI_MTX;
-  // reset error state (0xFF.. no error occured)
-  twi_error = 0xFF;
-
-  // initialize buffer iteration vars
-  twi_masterBufferIndex = 0;
-  twi_masterBufferLength = length;
-
-  // copy data to twi buffer
-  for(i = 0; i < length; ++i)
-    twi_masterBuffer[i] = data[i];
-
-  // build sla+w, slave device address + w bit
-  twi_slarw = TW_WRITE;
-  twi_slarw |= address << 1;
-
-  // send start condition
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA);
-
-  // wait for write operation to complete
-  while (wait && TWI_MTX == twi_state)
-    if (TWCR & 0x80)
-     twi_irq_handle();
-
-  if (twi_error == 0xFF)
-    return 0;	// success
-  else if (twi_error == TW_MT_SLA_NACK)
-    return 2;	// error: address send, nack received
-  else if (twi_error == TW_MT_DATA_NACK)
-    return 3;	// error: data send, nack received
-  else
-    return 4;	// other twi error
-}
+#if ((F_CPU / TWI_FREQ) - 16) / 2 < 10
+# error TWI_FREQ too high for F_CPU
+#endif
 
-/*
- * Function twi_transmit
- * Desc     fills slave tx buffer with data
- *          must be called in slave tx event callback
- * Input    data: pointer to byte array
- *          length: number of bytes in array
- * Output   1 length too long for buffer
- *          2 not slave transmitter
- *          0 ok
- */
-uint8_t twi_transmit(uint8_t* data, uint8_t length)
-{
-  uint8_t i;
-
-  // ensure data will fit into buffer
-  if(TWI_BUFFER_LENGTH < length){
-    return 1;
-  }
-
-  // ensure we are currently a slave transmitter
-  if(TWI_STX != twi_state){
-    return 2;
-  }
-
-  // set length and copy data into tx buffer
-  twi_txBufferLength = length;
-  for(i = 0; i < length; ++i){
-    twi_txBuffer[i] = data[i];
-  }
-
-  return 0;
+#define TWCR_ACK	(_BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA))
+#define TWCR_NACK	(_BV(TWEN) | _BV(TWIE) | _BV(TWINT))
+#define TWCR_START	(TWCR_ACK | _BV(TWSTA))
+#define TWCR_STOP	(TWCR_ACK | _BV(TWSTO))
+
+static struct twi_job_s *volatile twi_head = NULL;
+static struct twi_job_s *twi_tail;
+static uint8_t twi_pos;
+static uint8_t twi_reading;
+
+void twi_init(void) {
+	/* Activate internal pull-ups for twi, as per note from atmega8
+	 * manual pg167 */
+	PORTC |= _BV(4) | _BV(5);
+
+	/*
+	 * SCL Frequency = CPU Clock Frequency / (16 + (2 * TWBR)),
+	 * TWBR should be 10 or higher for master mode.  It is 72 for a
+	 * 16MHz board with 100kHz TWI and 12 with 400kHz.
+	 */
+	TWSR &= ~(_BV(TWPS0) | _BV(TWPS1));
+	TWBR = ((F_CPU / TWI_FREQ) - 16) / 2;
+
+	TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
 }
 
-/*
- * Function twi_attachSlaveRxEvent
- * Desc     sets function called before a slave read operation
- * Input    function: callback function to use
- * Output   none
- */
-void twi_attachSlaveRxEvent( void (*function)(uint8_t*, int) )
-{
-  twi_onSlaveReceive = function;
+/* Interrupts disabled here */
+static void twi_begin(void) {
+	twi_pos = 0;
+	twi_reading = !(twi_head->wlen + twi_head->dlen);
+
+	/*
+	 * A STOP condition may still be going out on the bus from the
+	 * previous job, TWSTO clears itself within one SCL cycle.  Setting
+	 * TWSTA before that could cancel the STOP.
+	 */
+	while (unlikely(TWCR & _BV(TWSTO)));
+	TWCR = TWCR_START;
 }
 
-/*
- * Function twi_attachSlaveTxEvent
- * Desc     sets function called before a slave write operation
- * Input    function: callback function to use
- * Output   none
- */
-void twi_attachSlaveTxEvent( void (*function)(void) )
-{
-  twi_onSlaveTransmit = function;
-}
+void twi_queue(struct twi_job_s *job) {
+	uint8_t sreg = irq_save();
 
-/*
- * Function twi_reply
- * Desc     sends byte or readys receive line
- * Input    ack: byte indicating to ack or to nack
- * Output   none
- */
-void twi_reply(uint8_t ack)
-{
-  // transmit master read ready signal, with or without ack
-  if(ack){
-    TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | _BV(TWEA);
-  }else{
-	  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT);
-  }
-}
+	job->status = TWI_JOB_PENDING;
+	job->next = NULL;
+	if (twi_head) {
+		twi_tail->next = job;
+		twi_tail = job;
+	} else {
+		twi_head = twi_tail = job;
+		twi_begin();
+	}
 
-/*
- * Function twi_stop
- * Desc     relinquishes bus master status
- * Input    none
- * Output   none
- */
-void twi_stop(void)
-{
-  // send stop condition
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTO);
-
-  // wait for stop condition to be exectued on bus
-  // TWINT is not set after a stop condition!
-  while(TWCR & _BV(TWSTO)){
-    continue;
-  }
-
-  // update twi state
-  twi_state = TWI_READY;
+	irq_restore(sreg);
 }
 
 /*
- * Function twi_releaseBus
- * Desc     releases bus control
- * Input    none
- * Output   none
+ * Interrupts disabled here.  Release the bus, or hand it straight to
+ * the next job in the queue by letting the hardware emit STOP followed
+ * by START, and return the finished job.
  */
-void twi_releaseBus(void)
-{
-  // release bus
-  TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT);
-
-  // update twi state
-  twi_state = TWI_READY;
+static struct twi_job_s *twi_finish(uint8_t status) {
+	struct twi_job_s *job = twi_head;
+
+	job->status = status;
+	twi_head = job->next;
+	if (twi_head) {
+		twi_pos = 0;
+		twi_reading = !(twi_head->wlen + twi_head->dlen);
+		TWCR = TWCR_STOP | _BV(TWSTA);
+	} else
+		TWCR = TWCR_STOP;
+
+	return job;
 }
 
-void twi_irq_handle(void)
-{
-  switch(TW_STATUS){
-    // All Master
-    case TW_START:     // sent start condition
-    case TW_REP_START: // sent repeated start condition
-      // copy device address and r/w bit to output register and ack
-      TWDR = twi_slarw;
-      twi_reply(1);
-      break;
-
-    // Master Transmitter
-    case TW_MT_SLA_ACK:  // slave receiver acked address
-    case TW_MT_DATA_ACK: // slave receiver acked data
-      // if there is data to send, send it, otherwise stop
-      if(twi_masterBufferIndex < twi_masterBufferLength){
-        // copy data to output register and ack
-        TWDR = twi_masterBuffer[twi_masterBufferIndex++];
-        twi_reply(1);
-      }else{
-        twi_stop();
-      }
-      break;
-    case TW_MT_SLA_NACK:  // address sent, nack received
-      twi_error = TW_MT_SLA_NACK;
-      twi_stop();
-      break;
-    case TW_MT_DATA_NACK: // data sent, nack received
-      twi_error = TW_MT_DATA_NACK;
-      twi_stop();
-      break;
-    case TW_MT_ARB_LOST: // lost bus arbitration
-      twi_error = TW_MT_ARB_LOST;
-      twi_releaseBus();
-      break;
-
-    // Master Receiver
-    case TW_MR_DATA_ACK: // data received, ack sent
-      // put byte into buffer
-      twi_masterBuffer[twi_masterBufferIndex++] = TWDR;
-    case TW_MR_SLA_ACK:  // address sent, ack received
-      // ack if more bytes are expected, otherwise nack
-      if(twi_masterBufferIndex < twi_masterBufferLength){
-        twi_reply(1);
-      }else{
-        twi_reply(0);
-      }
-      break;
-    case TW_MR_DATA_NACK: // data received, nack sent
-      // put final byte into buffer
-      twi_masterBuffer[twi_masterBufferIndex++] = TWDR;
-    case TW_MR_SLA_NACK: // address sent, nack received
-      twi_stop();
-      break;
-    // TW_MR_ARB_LOST handled by TW_MT_ARB_LOST case
-
-    // Slave Receiver
-    case TW_SR_SLA_ACK:   // addressed, returned ack
-    case TW_SR_GCALL_ACK: // addressed generally, returned ack
-    case TW_SR_ARB_LOST_SLA_ACK:   // lost arbitration, returned ack
-    case TW_SR_ARB_LOST_GCALL_ACK: // lost arbitration, returned ack
-      // enter slave receiver mode
-      twi_state = TWI_SRX;
-      // indicate that rx buffer can be overwritten and ack
-      twi_rxBufferIndex = 0;
-      twi_reply(1);
-      break;
-    case TW_SR_DATA_ACK:       // data received, returned ack
-    case TW_SR_GCALL_DATA_ACK: // data received generally, returned ack
-      // if there is still room in the rx buffer
-      if(twi_rxBufferIndex < TWI_BUFFER_LENGTH){
-        // put byte in buffer and ack
-        twi_rxBuffer[twi_rxBufferIndex++] = TWDR;
-        twi_reply(1);
-      }else{
-        // otherwise nack
-        twi_reply(0);
-      }
-      break;
-    case TW_SR_STOP: // stop or repeated start condition received
-      // put a null char after data if there's room
-      if(twi_rxBufferIndex < TWI_BUFFER_LENGTH){
-        twi_rxBuffer[twi_rxBufferIndex] = '\0';
-      }
-      // callback to user defined callback
-      twi_onSlaveReceive(twi_rxBuffer, twi_rxBufferIndex);
-      // ack future responses
-      twi_reply(1);
-      // leave slave receiver state
-      twi_state = TWI_READY;
-      break;
-    case TW_SR_DATA_NACK:       // data received, returned nack
-    case TW_SR_GCALL_DATA_NACK: // data received generally, returned nack
-      // nack back at master
-      twi_reply(0);
-      break;
-
-    // Slave Transmitter
-    case TW_ST_SLA_ACK:          // addressed, returned ack
-    case TW_ST_ARB_LOST_SLA_ACK: // arbitration lost, returned ack
-      // enter slave transmitter mode
-      twi_state = TWI_STX;
-      // ready the tx buffer index for iteration
-      twi_txBufferIndex = 0;
-      // set tx buffer length to be zero, to verify if user changes it
-      twi_txBufferLength = 0;
-      // request for txBuffer to be filled and length to be set
-      // note: user must call twi_transmit(bytes, length) to do this
-      twi_onSlaveTransmit();
-      // if they didn't change buffer & length, initialize it
-      if(0 == twi_txBufferLength){
-        twi_txBufferLength = 1;
-        twi_txBuffer[0] = 0x00;
-      }
-      // transmit first byte from buffer, fall
-    case TW_ST_DATA_ACK: // byte sent, ack returned
-      // copy data to output register
-      TWDR = twi_txBuffer[twi_txBufferIndex++];
-      // if there is more to send, ack, otherwise nack
-      if(twi_txBufferIndex < twi_txBufferLength){
-        twi_reply(1);
-      }else{
-        twi_reply(0);
-      }
-      break;
-    case TW_ST_DATA_NACK: // received nack, we are done
-    case TW_ST_LAST_DATA: // received ack, but we are done already!
-      // ack future responses
-      twi_reply(1);
-      // leave slave receiver state
-      twi_state = TWI_READY;
-      break;
-
-    // All
-    case TW_NO_INFO:   // no state information
-      break;
-    case TW_BUS_ERROR: // bus error, illegal stop/start
-      twi_error = TW_BUS_ERROR;
-      twi_stop();
-      break;
-  }
-}
-SIGNAL(TWI_vect) {
-  twi_irq_handle();
+ISR(TWI_vect) {
+	struct twi_job_s *job = twi_head;
+	uint8_t status = TWI_JOB_DONE;
+
+	if (unlikely(!job)) {
+		TWCR = TWCR_STOP;
+		return;
+	}
+
+	switch (TW_STATUS) {
+	case TW_START:
+	case TW_REP_START:
+		TWDR = (job->addr << 1) | (twi_reading ? TW_READ : TW_WRITE);
+		TWCR = TWCR_ACK;
+		return;
+
+	/* Master Transmitter */
+	case TW_MT_SLA_ACK:
+	case TW_MT_DATA_ACK:
+		if (twi_pos < job->wlen) {
+			TWDR = job->wbuf[twi_pos ++];
+			TWCR = TWCR_ACK;
+			return;
+		}
+		if (twi_pos < job->wlen + job->dlen) {
+			TWDR = job->data[twi_pos ++ - job->wlen];
+			TWCR = TWCR_ACK;
+			return;
+		}
+		if (!job->rlen)
+			break;
+
+		/*
+		 * Register number is out, a repeated START for the read
+		 * keeps the bus and saves the STOP, the bus free time and
+		 * the slave re-arming its register pointer.
+		 */
+		twi_pos = 0;
+		twi_reading = 1;
+		TWCR = TWCR_START;
+		return;
+
+	case TW_MT_ARB_LOST: /* Also TW_MR_ARB_LOST */
+		/* Start over as soon as the bus is free again */
+		twi_pos = 0;
+		twi_reading = !(job->wlen + job->dlen);
+		TWCR = TWCR_START;
+		return;
+
+	/* Master Receiver */
+	case TW_MR_DATA_ACK:
+		job->rbuf[twi_pos ++] = TWDR;
+		/* Fall through */
+	case TW_MR_SLA_ACK:
+		/*
+		 * The ACK/NACK setting is transmitted in response to the
+		 * *next* received byte, so NACK when the next to last byte
+		 * is in.
+		 */
+		TWCR = (twi_pos + 1 < job->rlen) ? TWCR_ACK : TWCR_NACK;
+		return;
+
+	case TW_MR_DATA_NACK:
+		job->rbuf[twi_pos ++] = TWDR;
+		break;
+
+	case TW_NO_INFO:
+		return;
+
+	default: /* SLA/data NACK, bus error */
+		status = TWI_JOB_ERROR;
+		break;
+	}
+
+	job = twi_finish(status);
+	if (job->finished) {
+		sei();
+		job->finished();
+	}
 }
 
 void i2c_send_byte(uint8_t address, uint8_t byte) {
-	twi_writeTo(address, &byte, 1, 1);
+	struct twi_job_s job;
+
+	job.addr = address;
+	job.wlen = 1;
+	job.wbuf[0] = byte;
+	job.dlen = 0;
+	job.rlen = 0;
+	job.finished = NULL;
+	twi_queue(&job);
+	twi_wait(&job);
 }
 
 void i2c_request_bytes(uint8_t address, uint8_t count, uint8_t *out) {
-	twi_readFrom(address, out, count);
+	struct twi_job_s job;
+
+	job.addr = address;
+	job.wlen = 0;
+	job.dlen = 0;
+	job.rlen = count;
+	job.rbuf = out;
+	job.finished = NULL;
+	twi_queue(&job);
+	twi_wait(&job);
 }
@@ -1,21 +1,71 @@
 /*
- * TWI/I2C library for Wiring & Arduino
+ * Interrupt-driven TWI/I2C master.
+ *
+ * Licensed under LGPLv2.1 (see twi.c).
  */
 
+/*
+ * 100kHz standard mode, or 400kHz fast mode with TWI=fast in the
+ * Makefile.  Fast mode needs the external pull-ups on the sensor
+ * boards, the AVR's internal ones are too weak for its rise times.
+ */
 #ifndef TWI_FREQ
 # define TWI_FREQ 100000L
 #endif
 
-#ifndef TWI_BUFFER_LENGTH
-# define TWI_BUFFER_LENGTH 12
-#endif
+/* Maximum number of bytes written before the optional read phase */
+#define TWI_JOB_WLEN	2
 
-#define TWI_READY	0
-#define TWI_MRX		1
-#define TWI_MTX		2
-#define TWI_SRX		3
-#define TWI_STX		4
+#define TWI_JOB_DONE	0
+#define TWI_JOB_PENDING	1
+#define TWI_JOB_ERROR	2
+
+/*
+ * A bus transaction: write wlen bytes from wbuf (typically a register
+ * number) followed by dlen bytes from data, then if rlen is non-zero a
+ * repeated START and a read of rlen bytes straight into rbuf, as many
+ * as the slave auto-increments over.  data is for longer writes such
+ * as EEPROM pages, it's sent in place and must stay untouched until
+ * the job is finished too.
+ * The job is owned by the caller and must not be touched or re-queued
+ * until status is no longer TWI_JOB_PENDING.  finished (may be NULL) is
+ * called from the TWI interrupt with interrupts re-enabled, after the
+ * next queued job has already been started.
+ */
+struct twi_job_s {
+	uint8_t addr;
+	uint8_t wlen;
+	uint8_t wbuf[TWI_JOB_WLEN];
+	uint8_t dlen;
+	const uint8_t *data;
+	uint8_t rlen;
+	uint8_t *rbuf;
+	void (*finished)(void);
+	volatile uint8_t status;
+	struct twi_job_s *next;
+};
 
 void twi_init(void);
+void twi_queue(struct twi_job_s *job);
+
+static inline void twi_wait(struct twi_job_s *job) {
+	while (job->status == TWI_JOB_PENDING);
+}
+
+/* Queue a write of the register number followed by a read of count bytes */
+static inline void twi_read_regs(struct twi_job_s *job, uint8_t address,
+		uint8_t reg, uint8_t count, uint8_t *out,
+		void (*finished)(void)) {
+	job->addr = address;
+	job->wlen = 1;
+	job->wbuf[0] = reg;
+	job->dlen = 0;
+	job->rlen = count;
+	job->rbuf = out;
+	job->finished = finished;
+	twi_queue(job);
+}
+
+/* Blocking helpers, only for use outside of the time-critical paths */
 void i2c_send_byte(uint8_t address, uint8_t byte);
 void i2c_request_bytes(uint8_t address, uint8_t count, uint8_t *out);
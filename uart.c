@@ -6,8 +6,13 @@
 
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 
+#include "hal.h"
 #include "timer1.h"
+#include "uart.h"
+#include "gps.h"
+#include "telemetry.h"
 
 #ifndef NULL
 # define NULL 0
@@ -22,52 +27,93 @@ void serial_init(void) {
 	UCSR0C = 0x06; /*(3 << UCSZ00);*/
 }
 
-static const long int timeout = 10000;
+/*
+ * Transmit side is a ring buffer drained by the USART_UDRE_vect interrupt
+ * so nobody waits for the wire.  When the buffer is full the new byte is
+ * dropped and counted in serial_tx_dropped, callers who care about
+ * keeping a whole message together can check serial_tx_free() first.
+ * Only the ISR moves tx_tail.
+ */
+#define TX_BUF_LEN	128 /* Must be a power of 2 */
+
+static volatile char tx_buf[TX_BUF_LEN];
+static volatile uint8_t tx_head = 0, tx_tail = 0;
+volatile uint16_t serial_tx_dropped = 0;
+
 void serial_write1(char ch) {
-	int count = 0;
-#if defined(__AVR_ATmega128__) || defined(__AVR_ATmega1280__)
-	while (!(UCSR0A & _BV(UDRE0)) && ++ count < timeout);
-	UDR0 = ch;
-	count = 0;
-	while (!(UCSR1A & _BV(UDRE1)) && ++ count < timeout);
-	UDR1 = ch;
-#elif defined(__AVR_ATmega168__)  || defined(__AVR_ATmega328P__)
-	while (!(UCSR0A & _BV(UDRE0)) && ++ count < timeout);
-	UDR0 = ch;
-#else
-	/* m8,16,32,169,8515,8535,163 */
-	while (!(UCSRA & _BV(UDRE)) && ++ count < timeout);
-	UDR = ch;
-#endif
+	uint8_t sreg = irq_save(), head;
+
+	head = (tx_head + 1) & (TX_BUF_LEN - 1);
+	if (unlikely(head == tx_tail)) {
+		serial_tx_dropped ++;
+		irq_restore(sreg);
+		return;
+	}
+
+	tx_buf[tx_head] = ch;
+	tx_head = head;
+	UCSR0B |= 1 << UDRIE0;
+
+	irq_restore(sreg);
+}
+
+uint8_t serial_tx_free(void) {
+	return (tx_tail - tx_head - 1) & (TX_BUF_LEN - 1);
 }
 
-static const char to_hex[16] = {
+ISR(USART_UDRE_vect) {
+	uint8_t tail = tx_tail;
+
+	UDR0 = tx_buf[tail];
+	tx_tail = tail = (tail + 1) & (TX_BUF_LEN - 1);
+	if (tail == tx_head)
+		UCSR0B &= ~(1 << UDRIE0);
+}
+
+/*
+ * Push out everything that's queued by polling, for use with interrupts
+ * disabled, e.g. right before halting.
+ */
+void serial_flush(void) {
+	while (tx_tail != tx_head) {
+		while (!(UCSR0A & (1 << UDRE0)));
+		UDR0 = tx_buf[tx_tail];
+		tx_tail = (tx_tail + 1) & (TX_BUF_LEN - 1);
+	}
+	UCSR0B &= ~(1 << UDRIE0);
+}
+
+static const char to_hex[16] PROGMEM = {
 	'0', '1', '2', '3', '4', '5', '6', '7',
 	'8', '9', 'a', 'b', 'c', 'd', 'e', 'f',
 };
 
+static void serial_write_nibble(uint8_t val) {
+	serial_write1(pgm_read_byte(&to_hex[val & 15]));
+}
+
 void serial_write_hex16(uint16_t val) {
 	serial_write1(' ');
 	serial_write1('0');
 	serial_write1('x');
-	serial_write1(to_hex[(val >> 12) & 15]);
-	serial_write1(to_hex[(val >>  8) & 15]);
-	serial_write1(to_hex[(val >>  4) & 15]);
-	serial_write1(to_hex[(val >>  0) & 15]);
+	serial_write_nibble(val >> 12);
+	serial_write_nibble(val >> 8);
+	serial_write_nibble(val >> 4);
+	serial_write_nibble(val);
 }
 
 void serial_write_hex32(uint32_t val) {
 	serial_write1(' ');
 	serial_write1('0');
 	serial_write1('x');
-	serial_write1(to_hex[(val >> 28) & 15]);
-	serial_write1(to_hex[(val >> 24) & 15]);
-	serial_write1(to_hex[(val >> 20) & 15]);
-	serial_write1(to_hex[(val >> 16) & 15]);
-	serial_write1(to_hex[(val >> 12) & 15]);
-	serial_write1(to_hex[(val >>  8) & 15]);
-	serial_write1(to_hex[(val >>  4) & 15]);
-	serial_write1(to_hex[(val >>  0) & 15]);
+	serial_write_nibble(val >> 28);
+	serial_write_nibble(val >> 24);
+	serial_write_nibble(val >> 20);
+	serial_write_nibble(val >> 16);
+	serial_write_nibble(val >> 12);
+	serial_write_nibble(val >> 8);
+	serial_write_nibble(val >> 4);
+	serial_write_nibble(val);
 }
 
 void serial_write_eol(void) {
@@ -80,6 +126,13 @@ void serial_write_str(const char *str) {
 		serial_write1(*str ++);
 }
 
+void serial_write_str_P(const char *str) {
+	char ch;
+
+	while ((ch = pgm_read_byte(str ++)))
+		serial_write1(ch);
+}
+
 void serial_write_dec8(uint8_t val) {
 	serial_write1(' ');
 	if (val > 99)
@@ -143,10 +196,80 @@ void serial_set_handler(void (*handler)(char ch)) {
 	ch_handler = handler;
 }
 
+/*
+ * Receive side is a ring buffer filled by the USART_RX_vect interrupt
+ * and emptied by serial_poll() in the main loop, which is where the
+ * handler runs, so the handler can take its time and print.  The GPS
+ * sentences are parsed right in the interrupt though (see gps.h), only
+ * the rest is queued.  Bytes that don't fit are counted in
+ * serial_rx_dropped.  Only the ISR moves rx_head.
+ *
+ * A command frame can hold any byte but 0x00, '$' included, so the
+ * interrupt keeps track of telem_receive()'s frame mode too (see
+ * telemetry.h): from a 0x00 until nothing comes in for
+ * TELEM_RX_TIMEOUT everything is queued and the GPS sees nothing.
+ * A sentence that starts meanwhile is lost, the frame it lands in
+ * fails its CRC.
+ */
+#define RX_BUF_LEN	64 /* Must be a power of 2 */
+
+static volatile char rx_buf[RX_BUF_LEN];
+static volatile uint8_t rx_head = 0, rx_tail = 0;
+volatile uint16_t serial_rx_dropped = 0;
+
+/* Interrupts disabled here */
+static inline void rx_queue(uint8_t ch) {
+	uint8_t head = (rx_head + 1) & (RX_BUF_LEN - 1);
+
+	if (unlikely(head == rx_tail)) {
+		serial_rx_dropped ++;
+		return;
+	}
+	rx_buf[rx_head] = ch;
+	rx_head = head;
+}
+
+#ifdef GPS
+static uint8_t rx_framing;
+static uint32_t rx_ts;
+
+/* Interrupts disabled here, returns 1 if the GPS has taken ch */
+static inline uint8_t rx_gps(uint8_t ch) {
+	uint32_t now = timer_read();
+
+	if (rx_framing && now - rx_ts > TELEM_RX_TIMEOUT)
+		rx_framing = 0;
+
+	if (!ch)
+		rx_framing = 1;
+	else if (!rx_framing && gps_input(ch))
+		return 1;
+
+	rx_ts = now;
+	return 0;
+}
+#else
+static inline uint8_t rx_gps(uint8_t ch) { return 0; }
+#endif
+
 ISR(USART_RX_vect) {
 	uint8_t status = UCSR0A;
 	uint8_t ch = UDR0;
 
-	if (!unlikely(status & 0x14) && ch_handler)
-		ch_handler(ch);
+	if (unlikely(status & 0x14) || rx_gps(ch))
+		return;
+
+	rx_queue(ch);
+}
+
+void serial_poll(void) {
+	uint8_t tail = rx_tail;
+	char ch;
+
+	while (tail != rx_head) {
+		ch = rx_buf[tail];
+		rx_tail = tail = (tail + 1) & (RX_BUF_LEN - 1);
+		if (ch_handler)
+			ch_handler(ch);
+	}
 }
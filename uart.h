@@ -13,4 +13,13 @@ void serial_write_dec32(uint32_t val);
 void serial_write_fp32(int32_t val, uint32_t unit);
 void serial_write_eol(void);
 void serial_write_str(const char *str);
+/* str in flash, e.g. serial_write_str_P(PSTR("...")) */
+void serial_write_str_P(const char *str);
 void serial_set_handler(void (*handler)(char ch));
+/* Pass the bytes received so far to the handler, call from the main loop */
+void serial_poll(void);
+
+uint8_t serial_tx_free(void);
+void serial_flush(void);
+extern volatile uint16_t serial_tx_dropped;
+extern volatile uint16_t serial_rx_dropped;
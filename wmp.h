@@ -0,0 +1,76 @@
+/*
+ * Wii MotionPlus 3-axis gyro driver.
+ *
+ * Licensed under AGPLv3.
+ *
+ * The MotionPlus answers at WMP_INIT_ADDR until it's activated, after that
+ * at WMP_ADDR where register 0 starts a 6-byte report with all three
+ * 14-bit rates (0x2000 is zero) and their "slow mode" bits:
+ *
+ *   0: yaw[7:0]     1: yaw[13:8] << 2 | yaw slow << 1 | pitch slow
+ *   2: roll[7:0]    3: roll[13:8] << 2 | roll slow << 1 | extension
+ *   4: pitch[7:0]   5: pitch[13:8] << 2 | 1 << 1
+ *
+ * so one burst read gets a complete sample.  The gyro runs its own ADC at
+ * a few kHz, any read rate up to what the bus allows is fine.  In slow mode
+ * an axis covers about +/- 440 deg/s, in fast mode +/- 2000 deg/s with
+ * the same number of LSBs.
+ */
+
+#define WMP_ADDR	0x52
+#define WMP_INIT_ADDR	0x53
+
+/* gscale values, the LSB size relative to slow mode times 1000 */
+#define WMP_SCALE_SLOW	1000
+#define WMP_SCALE_FAST	4545 /* 2000 / 440 */
+
+/*
+ * The WMP's roll, pitch and yaw axes (graw[0..2] below) in the local
+ * frame, i.e. the CMPS09's after cmps09_xy_adjust().  These are the
+ * signs ahrs-ekf-float.c uses, check them when remounting either board.
+ */
+static const int8_t wmp_axis_sign[3] = { 1, -1, 1 };
+
+/* Blocking, only for boot-time use.  Give the gyro some 200ms to settle
+ * before trusting the readings. */
+static inline void wmp_on(void) {
+	struct twi_job_s job;
+
+	job.addr = WMP_INIT_ADDR;
+	job.wlen = 2;
+	job.wbuf[0] = 0xfe;
+	job.wbuf[1] = 0x04;
+	job.dlen = 0;
+	job.rlen = 0;
+	job.finished = 0;
+	twi_queue(&job);
+	twi_wait(&job);
+}
+
+/* Queue a read of one report into regs[6], finished is called from the
+ * TWI interrupt */
+static inline void wmp_read_async(struct twi_job_s *job, uint8_t *regs,
+		void (*finished)(void)) {
+	twi_read_regs(job, WMP_ADDR, 0x00, 6, regs, finished);
+}
+
+/* Unpack a report into the raw roll, pitch and yaw rates and scales */
+static inline void wmp_decode(const uint8_t *regs,
+		uint16_t graw[3], uint16_t gscale[3]) {
+	graw[0] = regs[2] | ((uint16_t) (regs[3] & 0xfc) << 6);
+	graw[1] = regs[4] | ((uint16_t) (regs[5] & 0xfc) << 6);
+	graw[2] = regs[0] | ((uint16_t) (regs[1] & 0xfc) << 6);
+	gscale[0] = (regs[3] & 2) ? WMP_SCALE_SLOW : WMP_SCALE_FAST;
+	gscale[1] = (regs[1] & 1) ? WMP_SCALE_SLOW : WMP_SCALE_FAST;
+	gscale[2] = (regs[1] & 2) ? WMP_SCALE_SLOW : WMP_SCALE_FAST;
+}
+
+/* Blocking version, only for boot-time use */
+static inline void wmp_read(uint16_t graw[3], uint16_t gscale[3]) {
+	struct twi_job_s job;
+	uint8_t regs[6];
+
+	wmp_read_async(&job, regs, 0);
+	twi_wait(&job);
+	wmp_decode(regs, graw, gscale);
+}